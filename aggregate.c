@@ -0,0 +1,157 @@
+#include "tappet.h"
+
+/*
+ * Frame aggregation: a busy tunnel carrying small frames (ACKs, VoIP,
+ * DNS) spends most of its time on per-datagram costs (a system call, a
+ * nonce, a crypto_box setup, and a 16-byte tag each). Instead, we hold
+ * on to each small message for a little while, and pack the ones that
+ * arrive in the meantime into a single MSG_BUNDLE, in which each
+ * message is preceded by its two-byte length.
+ *
+ * The first message is held as it is. When a second one arrives, the
+ * first is moved along to make room for the bundle header, and later
+ * messages are copied in after it. A bundle is sent when the next
+ * message would not fit into a datagram the path can carry, when there
+ * is nothing more to read from the TAP device (unless we were told to
+ * hold messages longer), or when the oldest message in it has been
+ * held for as long as we may. With --source-ports, a bundle is sent
+ * from the port its first frame's flow picks, so it is also sent when
+ * the next frame's flow picks another port, lest that frame overtake
+ * (or be overtaken by) the rest of its flow.
+ */
+
+#define BUNDLE_HDR 1
+#define SUBMSG_HDR 2
+
+
+/*
+ * Queues the len-byte message at (*bp)->data for the given peer, or
+ * sends it at once if it is too big to share a datagram. If the buffer
+ * is held, *bp is replaced with a fresh one. Returns 0 on success, or
+ * -1 on failure.
+ */
+
+int agg_message(struct worker *w, int udp, struct peer *peer,
+                struct pktbuf **bp, int len)
+{
+    struct aggregate *agg = &peer->agg;
+    struct pktbuf *b = agg->pending;
+    int limit = message_limit(w, peer);
+
+    w->agg_stats.messages++;
+
+    /*
+     * If this message must go from another port than the pending
+     * bundle, or wouldn't fit into it, we send the bundle first.
+     */
+
+    if (b && peer->sports &&
+        b->flow % peer->sports->n != (*bp)->flow % peer->sports->n)
+    {
+        if (agg_flush(w, udp, peer, AGG_PORT) < 0)
+            return -1;
+        b = NULL;
+    }
+
+    if (b) {
+        int need = SUBMSG_HDR + len;
+
+        if (agg->count == 1)
+            need += BUNDLE_HDR + SUBMSG_HDR;
+
+        if (b->len + need > limit && agg_flush(w, udp, peer, AGG_FULL) < 0)
+            return -1;
+        b = agg->pending;
+    }
+
+    /*
+     * A message that can't share a datagram with anything else is sent
+     * on its own (or in fragments), and so is one we have no spare
+     * buffer to hold.
+     */
+
+    if (b == NULL) {
+        struct pktbuf *fresh = NULL;
+
+        if (BUNDLE_HDR + 2*SUBMSG_HDR + len < limit)
+            fresh = pool_get(&w->pool, (*bp)->owner);
+
+        if (fresh == NULL) {
+            w->agg_stats.datagrams++;
+            return frag_message(w, udp, peer, bp, len);
+        }
+
+        agg->pending = *bp;
+        agg->pending->len = len;
+        agg->count = 1;
+        agg->deadline = monotonic_usec() + agg->hold;
+        *bp = fresh;
+
+        return 0;
+    }
+
+    /*
+     * The second message turns the pending message into a bundle.
+     */
+
+    if (agg->count == 1) {
+        memmove(b->data + BUNDLE_HDR + SUBMSG_HDR, b->data, b->len);
+        b->data[0] = MSG_BUNDLE;
+        b->data[1] = b->len >> 8;
+        b->data[2] = b->len;
+        b->len += BUNDLE_HDR + SUBMSG_HDR;
+    }
+
+    b->data[b->len] = len >> 8;
+    b->data[b->len+1] = len;
+    memcpy(b->data + b->len + SUBMSG_HDR, (*bp)->data, len);
+    b->len += SUBMSG_HDR + len;
+    agg->count++;
+
+    return 0;
+}
+
+
+/*
+ * Sends the messages held for the given peer (as a bundle, unless there
+ * is only one of them), and records why. Returns 0 on success, or -1
+ * on failure.
+ */
+
+int agg_flush(struct worker *w, int udp, struct peer *peer, int reason)
+{
+    struct aggregate *agg = &peer->agg;
+    int n;
+
+    if (agg->pending == NULL)
+        return 0;
+
+    w->agg_stats.datagrams++;
+    w->agg_stats.flushes[reason]++;
+    if (agg->count > 1)
+        w->agg_stats.bundled += agg->count;
+
+    n = send_message(w, udp, peer, &agg->pending, agg->pending->len);
+
+    pool_put(&w->pool, agg->pending);
+    agg->pending = NULL;
+    agg->count = 0;
+
+    return n < 0 ? -1 : 0;
+}
+
+
+/*
+ * Prints a one-line summary of frame aggregation to the given file.
+ */
+
+void agg_report(const struct agg_stats *s, FILE *f)
+{
+    fprintf(f, "aggregation: %lu messages in %lu datagrams (%.2f per "
+            "datagram), %lu bundled; flushed %lu full, %lu drained, "
+            "%lu expired, %lu for another port\n", s->messages,
+            s->datagrams,
+            s->datagrams ? (double) s->messages / s->datagrams : 0.0,
+            s->bundled, s->flushes[AGG_FULL], s->flushes[AGG_DRAINED],
+            s->flushes[AGG_EXPIRED], s->flushes[AGG_PORT]);
+}
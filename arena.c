@@ -0,0 +1,152 @@
+#include "tappet.h"
+
+#include <sys/mman.h>
+
+#define HUGEPAGE_SIZE (2*1024*1024)
+
+/*
+ * An arena is a single anonymous mapping from which packet buffers and
+ * per-peer state are allocated at startup and never freed. Keeping all
+ * of the hot state in one place lets us back it with huge pages, fault
+ * it in before any traffic arrives, and lock it into memory, so that
+ * neither TLB misses nor page faults show up in the packet path.
+ *
+ * If ARENA_HUGEPAGES is set, we try an explicit MAP_HUGETLB mapping
+ * first, and fall back to asking for transparent huge pages if no huge
+ * pages are reserved. If ARENA_MLOCK is set, the whole arena is locked
+ * with mlock(). Failure to do either is reported, but is not fatal.
+ * If node is not -1, the arena's memory is bound to that NUMA node
+ * before it is faulted in.
+ */
+
+int arena_init(struct arena *a, size_t size, int flags, int node)
+{
+    void *p = MAP_FAILED;
+    size_t i;
+
+    memset(a, 0, sizeof(*a));
+    size = (size + HUGEPAGE_SIZE - 1) & ~((size_t) HUGEPAGE_SIZE - 1);
+
+    if (flags & ARENA_HUGEPAGES) {
+        p = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+            a->backing = ARENA_HUGETLB;
+    }
+
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "Couldn't map %lu-byte arena: %s\n",
+                    (unsigned long) size, strerror(errno));
+            return -1;
+        }
+
+        a->backing = ARENA_PAGES;
+        if (flags & ARENA_HUGEPAGES) {
+            if (madvise(p, size, MADV_HUGEPAGE) == 0)
+                a->backing = ARENA_THP;
+            else
+                fprintf(stderr, "Couldn't get huge pages for arena: %s\n",
+                        strerror(errno));
+        }
+    }
+
+    if (node >= 0 && bind_memory(p, size, node) == 0)
+        a->node = node;
+    else
+        a->node = -1;
+
+    /*
+     * Touch every page now, so that the page faults (and, if we are
+     * lucky, the huge page allocations) happen at startup.
+     */
+
+    for (i = 0; i < size; i += 4096)
+        ((volatile unsigned char *) p)[i] = 0;
+
+    if (flags & ARENA_MLOCK) {
+        if (mlock(p, size) == 0)
+            a->locked = 1;
+        else
+            fprintf(stderr, "Couldn't lock %lu-byte arena: %s\n",
+                    (unsigned long) size, strerror(errno));
+    }
+
+    a->base = p;
+    a->size = size;
+    a->used = 0;
+
+    return 0;
+}
+
+
+/*
+ * Allocates size bytes, aligned to a cache line, from the arena.
+ * Returns NULL and counts the failure if the arena is exhausted.
+ */
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    void *p;
+
+    size = (size + CACHELINE - 1) & ~((size_t) CACHELINE - 1);
+    if (size > a->size - a->used) {
+        a->failures++;
+        return NULL;
+    }
+
+    p = a->base + a->used;
+    a->used += size;
+
+    return p;
+}
+
+
+/*
+ * Unmaps the given arena, which must no longer be in use.
+ */
+
+void arena_free(struct arena *a)
+{
+    if (a->base)
+        (void) munmap(a->base, a->size);
+
+    memset(a, 0, sizeof(*a));
+}
+
+
+/*
+ * Prints a one-line summary of arena usage to the given file.
+ */
+
+void arena_report(const struct arena *a, const char *name, FILE *f)
+{
+    static const char *backing[] = { "pages", "transparent huge pages",
+                                     "huge pages" };
+
+    fprintf(f, "%s arena: %lu of %lu bytes used, %lu failed allocations, "
+            "%s%s", name, (unsigned long) a->used, (unsigned long) a->size,
+            a->failures, backing[a->backing], a->locked ? ", locked" : "");
+    if (a->node >= 0)
+        fprintf(f, ", node %d", a->node);
+    fprintf(f, "\n");
+}
+
+
+/*
+ * Locks the given memory (e.g., key material) so that it is never
+ * written to swap. Returns 0 on success, or prints a warning and
+ * returns -1 on failure.
+ */
+
+int lock_memory(const void *p, size_t len)
+{
+    if (mlock(p, len) < 0) {
+        fprintf(stderr, "Couldn't lock memory: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,331 @@
+#include "tappet.h"
+
+#include <time.h>
+
+/*
+ * Payload compression: frames are compressed with a small LZ77 coder
+ * that uses the LZF format, which is about as fast as compression gets
+ * and does well enough on text (HTTP, logs, SQL). A compressed frame is
+ * sent as a MSG_FRAME with the MSG_COMPRESSED bit set.
+ *
+ * Much of what we carry is already compressed or encrypted, and it is
+ * a waste of time to try to compress that. So we keep track of flows
+ * (hashed from the addresses and ports in the frame), and when a frame
+ * fails to shrink by at least 1/COMPRESS_GAIN, we send the next few
+ * frames of its flow as they are. The number of frames skipped doubles
+ * with each consecutive failure (up to COMPRESS_MAXSKIP), and is reset
+ * when the flow compresses again.
+ *
+ * The compressed data is a sequence of literal runs and back-references
+ * into the output so far:
+ *
+ *     000LLLLL <L+1 literal bytes>
+ *     LLLooooo oooooooo                 (match of L+2 bytes, L < 7)
+ *     111ooooo LLLLLLLL oooooooo        (match of L+9 bytes)
+ *
+ * where the offset o is one less than the distance back to the match.
+ */
+
+#define LZ_MAXOFF 8192
+#define LZ_MAXLIT 32
+#define LZ_MAXMATCH (7+255+2)
+
+#define COMPRESS_MIN 128
+#define COMPRESS_GAIN 32
+#define COMPRESS_MINSKIP 16
+#define COMPRESS_MAXSKIP 4096
+
+
+/*
+ * Returns the time on the monotonic clock in nanoseconds.
+ */
+
+static uint64_t nsec(void)
+{
+    struct timespec tp;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &tp);
+    return ((uint64_t)tp.tv_sec) * 1000*1000*1000 + tp.tv_nsec;
+}
+
+
+static unsigned int lz_hash(const unsigned char *p)
+{
+    uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+
+    return (v * 2654435761U) >> (32 - LZ_HLOG);
+}
+
+
+/*
+ * Compresses inlen bytes from in into at most outmax bytes at out, using
+ * the given hash table (which need not be cleared between calls, since
+ * every candidate match is checked). Returns the length of the output,
+ * or 0 if it would not fit.
+ */
+
+static int lz_compress(uint16_t *htab, const unsigned char *in, int inlen,
+                       unsigned char *out, int outmax)
+{
+    int ip = 0, op = 0, lit = 0, ctl;
+
+    if (outmax < 2)
+        return 0;
+
+    ctl = op++;
+
+    while (ip < inlen) {
+        if (ip + 2 < inlen) {
+            unsigned int h = lz_hash(in + ip);
+            int ref = htab[h];
+            int off = ip - ref - 1;
+
+            htab[h] = ip;
+
+            if (ref < ip && off < LZ_MAXOFF && in[ref] == in[ip] &&
+                in[ref+1] == in[ip+1] && in[ref+2] == in[ip+2])
+            {
+                int len = 3, max = inlen - ip;
+
+                if (max > LZ_MAXMATCH)
+                    max = LZ_MAXMATCH;
+                while (len < max && in[ref+len] == in[ip+len])
+                    len++;
+
+                /*
+                 * End the current literal run (or take back the control
+                 * byte we reserved for it, if it is empty), emit the
+                 * back-reference, and start a new literal run.
+                 */
+
+                if (lit)
+                    out[ctl] = lit - 1;
+                else
+                    op--;
+
+                if (op + 4 > outmax)
+                    return 0;
+
+                len -= 2;
+                if (len < 7) {
+                    out[op++] = (len << 5) | (off >> 8);
+                } else {
+                    out[op++] = (7 << 5) | (off >> 8);
+                    out[op++] = len - 7;
+                }
+                out[op++] = off;
+
+                ip += len + 2;
+                lit = 0;
+                ctl = op++;
+                continue;
+            }
+        }
+
+        if (op >= outmax)
+            return 0;
+
+        out[op++] = in[ip++];
+        if (++lit == LZ_MAXLIT) {
+            if (op >= outmax)
+                return 0;
+            out[ctl] = lit - 1;
+            lit = 0;
+            ctl = op++;
+        }
+    }
+
+    if (lit)
+        out[ctl] = lit - 1;
+    else
+        op--;
+
+    return op;
+}
+
+
+/*
+ * Decompresses inlen bytes from in into at most outmax bytes at out.
+ * Returns the length of the output, or -1 if the input is malformed or
+ * the output would not fit.
+ */
+
+static int lz_decompress(const unsigned char *in, int inlen,
+                         unsigned char *out, int outmax)
+{
+    int ip = 0, op = 0;
+
+    while (ip < inlen) {
+        int c = in[ip++];
+
+        if (c < LZ_MAXLIT) {
+            int n = c + 1;
+
+            if (ip + n > inlen || op + n > outmax)
+                return -1;
+            memcpy(out + op, in + ip, n);
+            ip += n;
+            op += n;
+        }
+        else {
+            int len = c >> 5, ref;
+
+            if (len == 7) {
+                if (ip >= inlen)
+                    return -1;
+                len += in[ip++];
+            }
+            if (ip >= inlen)
+                return -1;
+
+            ref = op - ((c & 0x1f) << 8) - in[ip++] - 1;
+            len += 2;
+            if (ref < 0 || op + len > outmax)
+                return -1;
+
+            while (len--)
+                out[op++] = out[ref++];
+        }
+    }
+
+    return op;
+}
+
+
+/*
+ * Sets up the worker's compression state. Returns 0 on success, or
+ * prints an error and returns -1 on failure.
+ */
+
+int compress_init(struct worker *w)
+{
+    struct compressor *c;
+
+    c = arena_alloc(&w->arena, sizeof(struct compressor));
+    if (c != NULL)
+        c->scratch = arena_alloc(&w->arena, PKTBUF_SIZE);
+    if (c == NULL || c->scratch == NULL) {
+        fprintf(stderr, "Couldn't allocate compression state\n");
+        return -1;
+    }
+
+    memset(c->htab, 0, sizeof(c->htab));
+    memset(c->flows, 0, sizeof(c->flows));
+    memset(&c->stats, 0, sizeof(c->stats));
+    w->lz = c;
+
+    return 0;
+}
+
+
+/*
+ * Compresses the len-byte MSG_FRAME at (*bp)->data, if it belongs to a
+ * flow that we expect to compress and it shrinks enough, in which case
+ * *bp is replaced with a buffer containing the compressed message.
+ * Returns the length of the message in *bp.
+ */
+
+int compress_message(struct worker *w, struct pktbuf **bp, int len)
+{
+    struct compressor *c = w->lz;
+    struct compress_stats *s = &c->stats;
+    struct flowstate *fl;
+    struct pktbuf *b;
+    unsigned char *frame = (*bp)->data + 1;
+    int n, flen = len - 1;
+    uint64_t t0;
+
+    if (flen < COMPRESS_MIN)
+        return len;
+
+    fl = &c->flows[flow_hash(frame, flen, w->opts->tun) % COMPRESS_FLOWS];
+    if (fl->skip > 0) {
+        fl->skip--;
+        s->skipped++;
+        return len;
+    }
+
+    b = pool_get(&w->pool, (*bp)->owner);
+    if (b == NULL)
+        return len;
+
+    t0 = nsec();
+    n = lz_compress(c->htab, frame, flen, b->data + 1,
+                    flen - flen/COMPRESS_GAIN);
+    s->nsec += nsec() - t0;
+    s->tried++;
+
+    /*
+     * If the frame didn't shrink, we leave its flow alone for a while,
+     * and for twice as long if it fails again when we try next time.
+     */
+
+    if (n == 0) {
+        if (fl->backoff < COMPRESS_MINSKIP)
+            fl->backoff = COMPRESS_MINSKIP;
+        else if (fl->backoff < COMPRESS_MAXSKIP)
+            fl->backoff *= 2;
+        fl->skip = fl->backoff;
+
+        s->incompressible++;
+        pool_put(&w->pool, b);
+        return len;
+    }
+
+    fl->backoff = 0;
+    s->compressed++;
+    s->bytes_in += flen;
+    s->bytes_out += n;
+
+    b->data[0] = MSG_FRAME | MSG_COMPRESSED;
+    b->flow = (*bp)->flow;
+    pool_put(&w->pool, *bp);
+    *bp = b;
+
+    return n + 1;
+}
+
+
+/*
+ * Decompresses the len-byte body of a compressed MSG_FRAME into the
+ * worker's scratch buffer. Returns the length of the frame, or -1 if
+ * it is malformed.
+ */
+
+int decompress_frame(struct worker *w, const unsigned char *p, int len)
+{
+    struct compressor *c = w->lz;
+    uint64_t t0;
+    int n;
+
+    t0 = nsec();
+    n = lz_decompress(p, len, c->scratch, PKTBUF_SIZE);
+    c->stats.dnsec += nsec() - t0;
+
+    if (n < 0) {
+        c->stats.malformed++;
+        return -1;
+    }
+
+    c->stats.decompressed++;
+    return n;
+}
+
+
+/*
+ * Prints a one-line summary of compression to the given file.
+ */
+
+void compress_report(const struct compress_stats *s, FILE *f)
+{
+    fprintf(f, "compression: %lu frames tried, %lu compressed (%.1f%% of "
+            "size), %lu incompressible, %lu skipped; %.0f ns per frame "
+            "compressed; %lu decompressed in %.0f ns each, %lu malformed\n",
+            s->tried, s->compressed,
+            s->bytes_in ? 100.0 * s->bytes_out / s->bytes_in : 0.0,
+            s->incompressible, s->skipped,
+            s->tried ? (double) s->nsec / s->tried : 0.0,
+            s->decompressed,
+            s->decompressed ? (double) s->dnsec / s->decompressed : 0.0,
+            s->malformed);
+}
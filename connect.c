@@ -0,0 +1,153 @@
+#include "tappet.h"
+
+#include <sys/epoll.h>
+
+/*
+ * Connected sockets: for every datagram sent through an unconnected UDP
+ * socket, the kernel looks up the route (and the neighbour) for the
+ * address it is given, whereas a connected socket looks them up when
+ * it is connected, and sends to the cached destination from then on.
+ *
+ * With --connect, we send to a peer through a socket of its own, which
+ * is connected to the peer's address, and shares the local address and
+ * port of our UDP socket (with SO_REUSEPORT), so the peer can't tell
+ * the difference. Datagrams from the peer's address arrive on its own
+ * socket too (the kernel prefers a connected socket to an unconnected
+ * one), and anything else still arrives on the UDP socket. That is how
+ * we notice that the peer has moved, as before, and its socket is then
+ * connected to the new address.
+ *
+ * A tunnel has one such socket, and a hub one for each peer it serves,
+ * which it opens when it first hears from the peer, watches with an
+ * epoll instance, and closes when it forgets the peer. If a hub runs out
+ * of file descriptors, it sends to the peers it has no socket for
+ * through its UDP socket, as it would without --connect.
+ */
+
+
+/*
+ * Returns a new UDP socket bound to the same local address and port as
+ * the given one (which must allow that with SO_REUSEPORT), or -1 (with
+ * errno set) on failure.
+ */
+
+static int conn_socket(int udp)
+{
+    union peeraddr local;
+    socklen_t len = sizeof(local);
+    int s, err, val = 1;
+
+    if (getsockname(udp, &local.sa, &len) < 0)
+        return -1;
+
+    s = socket(local.sa.sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (s < 0)
+        return -1;
+
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0 ||
+        bind(s, &local.sa, len) < 0)
+    {
+        err = errno;
+        (void) close(s);
+        errno = err;
+        return -1;
+    }
+
+    val = IP_PMTUDISC_DO;
+    (void) setsockopt(s, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+
+    return s;
+}
+
+
+/*
+ * Gives the peer a socket of its own, sharing the local address of the
+ * given UDP socket (but not yet connected), and adds it to the given
+ * epoll instance, unless epfd is -1. Returns 0 on success, or -1 (with
+ * errno set) on failure.
+ */
+
+int conn_open(struct worker *w, struct peer *peer, int udp, int epfd)
+{
+    struct epoll_event ev;
+    int err;
+
+    peer->fd = conn_socket(udp);
+    if (peer->fd < 0) {
+        w->conn_stats.failed++;
+        return -1;
+    }
+
+    if (epfd >= 0) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = peer->fd;
+
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, peer->fd, &ev) < 0) {
+            err = errno;
+            (void) close(peer->fd);
+            peer->fd = -1;
+            w->conn_stats.failed++;
+            errno = err;
+            return -1;
+        }
+    }
+
+    w->conn_stats.opened++;
+    return 0;
+}
+
+
+/*
+ * Connects the peer's socket to the peer's address if it isn't yet (or
+ * if the peer has moved). Until that succeeds (e.g., if there is no
+ * route to the peer yet), we send to the peer through our UDP socket.
+ */
+
+void conn_update(struct worker *w, struct peer *peer, int moved)
+{
+    if (peer->fd < 0 || (peer->connected && !moved) ||
+        peer->addr.sa.sa_family == 0)
+        return;
+
+    if (connect(peer->fd, &peer->addr.sa, peer->addrlen) < 0) {
+        peer->connected = 0;
+        w->conn_stats.failed++;
+        return;
+    }
+
+    if (peer->connected)
+        w->conn_stats.reconnected++;
+    else
+        w->conn_stats.connected++;
+    peer->connected = 1;
+}
+
+
+/*
+ * Closes the peer's socket, if it has one.
+ */
+
+void conn_close(struct worker *w, struct peer *peer)
+{
+    if (peer->fd < 0)
+        return;
+
+    (void) close(peer->fd);
+    peer->fd = -1;
+    peer->connected = 0;
+    w->conn_stats.closed++;
+}
+
+
+/*
+ * Prints a one-line summary of our connected sockets to the given file.
+ */
+
+void conn_report(const struct conn_stats *s, FILE *f)
+{
+    fprintf(f, "connected sockets: %lu open, %lu opened, %lu connected, "
+            "%lu reconnected (peer moved), %lu closed, %lu failed\n",
+            s->opened - s->closed, s->opened, s->connected, s->reconnected,
+            s->closed, s->failed);
+}
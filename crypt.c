@@ -73,6 +73,23 @@ void update_nonce(unsigned char nonce[NONCEBYTES])
 }
 
 
+/*
+ * Returns the time on the same monotonic clock, in microseconds.
+ */
+
+uint64_t monotonic_usec(void)
+{
+    struct timespec tp;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &tp) < 0) {
+        fprintf(stderr, "clock_gettime() failed: %s\n", strerror(errno));
+        exit(-1);
+    }
+
+    return ((uint64_t)tp.tv_sec) * 1000*1000 + tp.tv_nsec / 1000;
+}
+
+
 /*
  * Decrypts the contents of ctbuf and writes the result to ptbuf.
  * Returns the number of characters in ptbuf on success and -1 on
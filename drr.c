@@ -0,0 +1,307 @@
+#include "tappet.h"
+
+/*
+ * Fair queueing for a hub: all its peers share one UDP socket (and one
+ * uplink), and without it, a peer that is sent a bulk transfer fills
+ * the socket's buffer, and everyone else's frames wait behind its
+ * backlog (or are dropped with it).
+ *
+ * With --quantum, the hub's socket doesn't block. A frame for a peer is
+ * sent straight away if no one has frames waiting, and otherwise (or if
+ * the socket has no room) it is queued for the peer. When the socket
+ * has room again, the peers with frames waiting take turns, in a
+ * deficit round robin (Shreedhar and Varghese): on each turn, a peer
+ * may send frames adding up to its deficit, to which its weight times
+ * the quantum is added at the start of the turn, and what it doesn't
+ * use is carried over to its next turn (unless its queue empties). So
+ * each busy peer gets a share of the uplink in proportion to its
+ * weight, whatever the size of its frames, and a peer that sends a
+ * little now and then is never behind more than a turn of each of the
+ * others, however much they have queued.
+ *
+ * Frames are queued only when the socket is full, so its send buffer
+ * is shrunk to DRR_SNDBUF quanta: otherwise the kernel would hold a
+ * few hundred kilobytes of the busiest peer's frames in first-in,
+ * first-out order, and everyone else's would wait behind them anyway.
+ *
+ * Each queue holds up to DRR_LIMIT frames, which share a pool of
+ * DRR_BUFS buffers, and a frame that finds no room is dropped.
+ */
+
+#define DRR_BUFS 2048
+#define DRR_LIMIT 128
+#define DRR_SNDBUF 4
+#define DRR_REPORT_PEERS 16
+
+#define DRR_NONE UINT32_MAX
+
+
+/*
+ * Returns the number of bytes that drr_init() will allocate for the
+ * given number of peers.
+ */
+
+size_t drr_size(uint32_t count)
+{
+    return pool_size(DRR_BUFS, PKTBUF_SIZE, HEADROOM) +
+        count * sizeof(struct txq) + CACHELINE;
+}
+
+
+/*
+ * Sets up a queue for each of the given number of peers, and the
+ * queues' buffers, allocated from the given arena, and makes the given
+ * UDP socket non-blocking, with a send buffer of a few quanta. Returns
+ * 0 on success, or prints an error and returns -1 on failure.
+ */
+
+int drr_init(struct worker *w, struct drr *d, struct arena *arena, int udp,
+             uint32_t count)
+{
+    int val;
+
+    memset(d, 0, sizeof(*d));
+
+    d->queues = arena_alloc(arena, count * sizeof(struct txq));
+    if (d->queues == NULL) {
+        fprintf(stderr, "Couldn't allocate queues\n");
+        return -1;
+    }
+    memset(d->queues, 0, count * sizeof(struct txq));
+
+    if (pool_init(&d->pool, arena, DRR_BUFS, PKTBUF_SIZE, HEADROOM) < 0)
+        return -1;
+
+    if (set_blocking(udp, 0) < 0) {
+        fprintf(stderr, "Couldn't set UDP socket to non-blocking: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    d->quantum = w->opts->quantum;
+
+    val = DRR_SNDBUF * d->quantum;
+    if (setsockopt(udp, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val)) < 0) {
+        fprintf(stderr, "Couldn't set UDP send buffer size: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    d->head = d->tail = DRR_NONE;
+
+    return 0;
+}
+
+
+/*
+ * Puts peer n at the end of the round.
+ */
+
+static void drr_append(struct drr *d, uint32_t n)
+{
+    d->queues[n].next = DRR_NONE;
+    if (d->tail == DRR_NONE)
+        d->head = n;
+    else
+        d->queues[d->tail].next = n;
+    d->tail = n;
+}
+
+
+/*
+ * Takes the frame at the head of the given queue off it.
+ */
+
+static struct pktbuf *drr_dequeue(struct drr *d, struct txq *q)
+{
+    struct pktbuf *b = q->head;
+
+    q->head = b->next;
+    if (q->head == NULL)
+        q->tail = NULL;
+    q->count--;
+    d->backlog--;
+
+    return b;
+}
+
+
+/*
+ * Sends the len-byte frame at p to the given peer, or queues it if
+ * other peers have frames waiting (or the socket has no room). Returns
+ * 0 on success (or if the frame had to be dropped), or -1 on failure.
+ */
+
+int drr_send(struct worker *w, struct peer *peer, const unsigned char *p,
+             int len)
+{
+    struct hub *hub = w->hub;
+    struct drr *d = &hub->drr;
+    struct txq *q = &d->queues[peer - hub->peers];
+    struct pktbuf *b;
+    int n;
+
+    if (d->head == DRR_NONE && !d->blocked) {
+        n = hub_xmit(w, peer, p, len);
+        if (n != 1) {
+            d->stats.direct++;
+            return n;
+        }
+
+        d->blocked = 1;
+        d->stats.blocked++;
+    }
+
+    if (q->count >= DRR_LIMIT || len > pktbuf_room(&d->pool) ||
+        (b = pool_get(&d->pool, BUF_UDP_TX)) == NULL)
+    {
+        d->stats.dropped++;
+        return 0;
+    }
+
+    memcpy(b->data, p, len);
+    b->len = len;
+    b->seq = (uint32_t) monotonic_usec();
+
+    if (q->tail)
+        q->tail->next = b;
+    else
+        q->head = b;
+    q->tail = b;
+
+    if (++q->count > q->max_count)
+        q->max_count = q->count;
+    if (++d->backlog > d->max_backlog)
+        d->max_backlog = d->backlog;
+    d->stats.enqueued++;
+
+    if (!q->listed) {
+        q->listed = 1;
+        drr_append(d, peer - hub->peers);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Sends the queued frames, in turn, until they are all sent or the
+ * socket has no room for more (in which case we carry on from where we
+ * left off when it has). Returns 0 on success, or -1 on failure.
+ */
+
+int drr_run(struct worker *w)
+{
+    struct hub *hub = w->hub;
+    struct drr *d = &hub->drr;
+
+    d->blocked = 0;
+
+    while (d->head != DRR_NONE) {
+        uint32_t n = d->head;
+        struct peer *peer = &hub->peers[n];
+        struct txq *q = &d->queues[n];
+        struct pktbuf *b;
+
+        if (!q->turn) {
+            q->deficit += d->quantum * q->weight;
+            q->turn = 1;
+        }
+
+        /*
+         * The frames for a peer we have forgotten go nowhere.
+         */
+
+        while ((b = q->head) != NULL && peer->addr.sa.sa_family == 0) {
+            pool_put(&d->pool, drr_dequeue(d, q));
+            d->stats.dropped++;
+        }
+
+        while ((b = q->head) != NULL && b->len <= q->deficit) {
+            uint32_t waited;
+            int r = hub_xmit(w, peer, b->data, b->len);
+
+            if (r < 0)
+                return -1;
+
+            if (r == 1) {
+                d->blocked = 1;
+                d->stats.blocked++;
+                return 0;
+            }
+
+            q->deficit -= b->len;
+            waited = (uint32_t) monotonic_usec() - b->seq;
+            pool_put(&d->pool, drr_dequeue(d, q));
+
+            q->sent++;
+            q->waited += waited;
+            d->stats.dequeued++;
+            d->stats.waited += waited;
+            if (d->stats.max_wait < waited)
+                d->stats.max_wait = waited;
+        }
+
+        /*
+         * The peer's turn is over: it goes to the back of the round if
+         * it has frames left, or leaves it (with no deficit to carry
+         * over) if not.
+         */
+
+        d->head = q->next;
+        if (d->head == DRR_NONE)
+            d->tail = DRR_NONE;
+        q->turn = 0;
+
+        if (q->head) {
+            drr_append(d, n);
+        } else {
+            q->deficit = 0;
+            q->listed = 0;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Prints a summary of the queues to the given file: a line for all of
+ * them, and one for each of the first few peers that had frames queued.
+ */
+
+void drr_report(const struct hub *hub, FILE *f)
+{
+    const struct drr *d = &hub->drr;
+    const struct drr_stats *s = &d->stats;
+    int i, shown = 0, more = 0;
+
+    fprintf(f, "fair queueing: quantum %d, %lu frames sent directly, %lu "
+            "queued (%u now, at most %u), %lu sent from queues (mean wait "
+            "%lu us, max %lu us), %lu dropped; socket full %lu times\n",
+            d->quantum, s->direct, s->enqueued, d->backlog, d->max_backlog,
+            s->dequeued,
+            (unsigned long) (s->dequeued ? s->waited / s->dequeued : 0),
+            (unsigned long) s->max_wait, s->dropped, s->blocked);
+
+    for (i = 0; i < hub->npeers; i++) {
+        const struct txq *q = &d->queues[i];
+
+        if (q->sent == 0 && q->count == 0)
+            continue;
+
+        if (shown == DRR_REPORT_PEERS) {
+            more++;
+            continue;
+        }
+        shown++;
+
+        fprintf(f, "  peer %d (weight %u): %u queued (at most %u), %lu "
+                "sent from the queue (mean wait %lu us)\n", i, q->weight,
+                q->count, q->max_count, q->sent,
+                (unsigned long) (q->sent ? q->waited / q->sent : 0));
+    }
+
+    if (more)
+        fprintf(f, "  (and %d more peers)\n", more);
+}
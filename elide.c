@@ -0,0 +1,278 @@
+#include "tappet.h"
+
+/*
+ * Ethernet header elision: between two sites, nearly every frame has
+ * one of a handful of pairs of MAC addresses (and ethertypes), so each
+ * side keeps a small table of recent headers, and a frame whose header
+ * the peer is known to have in its table is sent with the header
+ * replaced by its index:
+ *
+ *     [ MSG_FRAME|MSG_ELIDED | index | payload ]
+ *
+ * The table is direct-mapped by a hash of the header. When a header
+ * displaces another (or isn't known to the peer yet), its frames are
+ * sent whole, with the index and a generation number that changes
+ * whenever the entry does:
+ *
+ *     [ MSG_FRAME|MSG_ELIDED | index|ELIDE_DEFINE | generation | frame ]
+ *
+ * The receiver stores the header and acknowledges the index and
+ * generation with a MSG_HDR_ACK, after which the sender may elide the
+ * header. Since datagrams are never accepted out of order (which is why
+ * this can't be used with multipath, source ports, or FEC, whose
+ * rebuilt messages arrive late), the receiver always has the entry the
+ * sender last defined. If it has no entry at
+ * all (e.g., because it has restarted), it drops the frame and sends a
+ * MSG_HDR_RESET, and the sender defines all its entries afresh.
+ */
+
+#define ELIDE_HASH_SEED 2166136261U
+#define ELIDE_RESET_USEC 100000
+
+
+/*
+ * Returns the index of the given Ethernet header in our table.
+ */
+
+static unsigned int hdr_index(const unsigned char *h)
+{
+    uint32_t v = ELIDE_HASH_SEED;
+    int i;
+
+    for (i = 0; i < ELIDE_HDRLEN; i++)
+        v = (v ^ h[i]) * 16777619U;
+
+    return (v ^ (v >> 16)) % ELIDE_ENTRIES;
+}
+
+
+/*
+ * Sets up the given peer's header tables, allocated from the worker's
+ * arena. Returns 0 on success, or prints an error and returns -1 on
+ * failure.
+ */
+
+int elide_init(struct worker *w, struct peer *peer)
+{
+    struct hdrcache *hc;
+
+    hc = arena_alloc(&w->arena, sizeof(struct hdrcache));
+    if (hc == NULL) {
+        fprintf(stderr, "Couldn't allocate header elision state\n");
+        return -1;
+    }
+
+    memset(hc, 0, sizeof(*hc));
+    peer->hdrs = hc;
+
+    return 0;
+}
+
+
+/*
+ * Replaces the Ethernet header of the len-byte MSG_FRAME at b->data
+ * with its index in our table, if the peer has it, or otherwise turns
+ * the message into a definition of the entry. Returns the new length
+ * of the message.
+ */
+
+int elide_message(struct worker *w, struct peer *peer, struct pktbuf *b,
+                  int len)
+{
+    struct hdrcache *hc = peer->hdrs;
+    struct elide_stats *s = &w->elide_stats;
+    struct hdrentry *e;
+    unsigned char *frame = b->data + 1;
+    int idx, flen = len - 1;
+
+    if (b->data[0] != MSG_FRAME || flen < ELIDE_HDRLEN)
+        return len;
+
+    idx = hdr_index(frame);
+    e = &hc->tx[idx];
+
+    if (e->state != HDR_UNUSED &&
+        memcmp(e->hdr, frame, ELIDE_HDRLEN) == 0)
+    {
+        if (e->state == HDR_CONFIRMED) {
+            b->data[0] = MSG_FRAME | MSG_ELIDED;
+            b->data[1] = idx;
+            memmove(b->data + 2, frame + ELIDE_HDRLEN, flen - ELIDE_HDRLEN);
+            s->elided++;
+            return 2 + flen - ELIDE_HDRLEN;
+        }
+    }
+    else {
+        if (e->state != HDR_UNUSED)
+            s->replaced++;
+        memcpy(e->hdr, frame, ELIDE_HDRLEN);
+        e->gen++;
+        e->state = HDR_DEFINED;
+    }
+
+    /*
+     * The peer doesn't know this header yet (or we don't know that it
+     * does), so we send the frame as it is, and define the entry.
+     */
+
+    if (len + 2 > pktbuf_room(&w->pool))
+        return len;
+
+    memmove(b->data + 3, frame, flen);
+    b->data[0] = MSG_FRAME | MSG_ELIDED;
+    b->data[1] = idx | ELIDE_DEFINE;
+    b->data[2] = e->gen;
+    s->defined++;
+
+    return len + 2;
+}
+
+
+/*
+ * Writes the frame in the len-byte body of a MSG_FRAME|MSG_ELIDED from
+ * the given peer to the TAP device, storing the header it defines or
+ * restoring the header it omits. Returns 0 on success, or -1 on failure
+ * (but ignores malformed messages and frames with unknown headers).
+ */
+
+int elide_input(struct worker *w, int tap, struct peer *peer,
+                unsigned char *p, int len)
+{
+    struct hdrcache *hc = peer->hdrs;
+    struct elide_stats *s = &w->elide_stats;
+    struct hdrentry *e;
+    int idx;
+
+    if (hc == NULL || len < 1 || (p[0] & ~ELIDE_DEFINE) >= ELIDE_ENTRIES) {
+        s->bad++;
+        return 0;
+    }
+
+    idx = p[0] & ~ELIDE_DEFINE;
+    e = &hc->rx[idx];
+
+    if (p[0] & ELIDE_DEFINE) {
+        if (len < 2 + ELIDE_HDRLEN) {
+            s->bad++;
+            return 0;
+        }
+
+        memcpy(e->hdr, p + 2, ELIDE_HDRLEN);
+        e->gen = p[1];
+        e->state = HDR_DEFINED;
+        hc->ack_due |= 1ULL << idx;
+        s->learned++;
+
+        return tap_write(tap, p + 2, len - 2);
+    }
+
+    /*
+     * We don't know this header, so the peer must think we have an
+     * entry we have lost. We ask it to start again, though not for
+     * every frame already on its way.
+     */
+
+    if (e->state == HDR_UNUSED) {
+        uint64_t now = monotonic_usec();
+
+        s->missed++;
+        if (now - hc->last_reset >= ELIDE_RESET_USEC) {
+            hc->last_reset = now;
+            hc->reset_due = 1;
+        }
+        return 0;
+    }
+
+    s->restored++;
+    return tap_writev(tap, e->hdr, ELIDE_HDRLEN, p + 1, len - 1);
+}
+
+
+/*
+ * Takes note of the len-byte body of a MSG_HDR_ACK from the given peer,
+ * which lists the entries (index and generation) it has stored.
+ */
+
+void elide_ack(struct worker *w, struct peer *peer, const unsigned char *p,
+               int len)
+{
+    struct hdrcache *hc = peer->hdrs;
+
+    if (hc == NULL)
+        return;
+
+    for (; len >= 2; p += 2, len -= 2) {
+        struct hdrentry *e;
+
+        if (p[0] >= ELIDE_ENTRIES)
+            continue;
+
+        e = &hc->tx[p[0]];
+        if (e->state == HDR_DEFINED && e->gen == p[1]) {
+            e->state = HDR_CONFIRMED;
+            w->elide_stats.confirmed++;
+        }
+    }
+}
+
+
+/*
+ * Forgets that the peer has any of our entries (because it has told us
+ * that it doesn't), so that they are all defined again before use.
+ */
+
+void elide_reset(struct worker *w, struct peer *peer)
+{
+    struct hdrcache *hc = peer->hdrs;
+    int i;
+
+    if (hc == NULL)
+        return;
+
+    for (i = 0; i < ELIDE_ENTRIES; i++) {
+        if (hc->tx[i].state == HDR_CONFIRMED)
+            hc->tx[i].state = HDR_DEFINED;
+    }
+
+    w->elide_stats.resets++;
+}
+
+
+/*
+ * Writes a MSG_HDR_ACK for the entries the peer has defined since we
+ * last acknowledged any into the buffer at p. Returns the length of
+ * the message.
+ */
+
+int elide_ack_message(struct peer *peer, unsigned char *p)
+{
+    struct hdrcache *hc = peer->hdrs;
+    int i, len = 0;
+
+    p[len++] = MSG_HDR_ACK;
+
+    for (i = 0; i < ELIDE_ENTRIES; i++) {
+        if (hc->ack_due & (1ULL << i)) {
+            p[len++] = i;
+            p[len++] = hc->rx[i].gen;
+        }
+    }
+
+    hc->ack_due = 0;
+    return len;
+}
+
+
+/*
+ * Prints a one-line summary of header elision to the given file.
+ */
+
+void elide_report(const struct elide_stats *s, FILE *f)
+{
+    fprintf(f, "header elision: %lu frames sent without headers, %lu "
+            "with definitions (%lu entries replaced, %lu confirmed, %lu "
+            "resets); %lu headers restored, %lu learned, %lu unknown, "
+            "%lu malformed\n", s->elided, s->defined, s->replaced,
+            s->confirmed, s->resets, s->restored, s->learned, s->missed,
+            s->bad);
+}
@@ -0,0 +1,232 @@
+#include "tappet.h"
+
+/*
+ * The forwarding database of a hub that switches Ethernet frames: which
+ * port (the TAP device, or one of the peers) each MAC address was last
+ * seen on, as the source of a frame. An entry that hasn't been seen for
+ * FDB_AGE_SEC is ignored, and removed by the next sweep.
+ *
+ * The table is open-addressed with linear probing, so a lookup usually
+ * touches one cache line (which holds four entries). It is never more
+ * than 3/4 full, and entries are removed by shifting later entries of
+ * the same probe sequence back, so there are no tombstones to skip.
+ */
+
+#define FDB_AGE_SEC 300
+#define FDB_SWEEP_USEC (10*1000000ULL)
+
+
+/*
+ * Returns the key for the given MAC address, which is never 0 (so that
+ * 0 can mark an unused entry).
+ */
+
+static uint64_t mac_key(const unsigned char *mac)
+{
+    return 1ULL << 48 | (uint64_t) mac[0] << 40 | (uint64_t) mac[1] << 32 |
+        (uint64_t) mac[2] << 24 | (uint64_t) mac[3] << 16 |
+        (uint64_t) mac[4] << 8 | mac[5];
+}
+
+
+static uint32_t fdb_index(const struct fdb *fdb, uint64_t key)
+{
+    return (uint32_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & fdb->mask;
+}
+
+
+/*
+ * Returns the number of entries (a power of two) in a table of at least
+ * the given size.
+ */
+
+static uint32_t fdb_slots(uint32_t entries)
+{
+    uint32_t slots;
+
+    for (slots = 64; slots < entries; slots *= 2)
+        ;
+
+    return slots;
+}
+
+
+/*
+ * Sets up an empty table with at least the given number of entries
+ * (rounded up to a power of two), allocated from the given arena.
+ * Returns 0 on success, or prints an error and returns -1 on failure.
+ */
+
+int fdb_init(struct fdb *fdb, struct arena *arena, uint32_t entries)
+{
+    uint32_t slots = fdb_slots(entries);
+
+    memset(fdb, 0, sizeof(*fdb));
+    fdb->table = arena_alloc(arena, slots * sizeof(struct fdbentry));
+    if (fdb->table == NULL) {
+        fprintf(stderr, "Couldn't allocate forwarding table\n");
+        return -1;
+    }
+
+    memset(fdb->table, 0, slots * sizeof(struct fdbentry));
+    fdb->mask = slots - 1;
+    fdb->next_sweep = monotonic_usec() + FDB_SWEEP_USEC;
+
+    return 0;
+}
+
+
+/*
+ * Returns the number of bytes that fdb_init() will allocate for the
+ * given number of entries.
+ */
+
+size_t fdb_size(uint32_t entries)
+{
+    return fdb_slots(entries) * sizeof(struct fdbentry);
+}
+
+
+/*
+ * Records that the given source MAC address was seen on the given port
+ * at the given time (in seconds).
+ */
+
+void fdb_learn(struct fdb *fdb, const unsigned char *mac, uint32_t port,
+               uint32_t now)
+{
+    uint64_t key = mac_key(mac);
+    struct fdbentry *e;
+    uint32_t i;
+
+    if (mac[0] & 1)
+        return;
+
+    i = fdb_index(fdb, key);
+    for (; fdb->table[i].key; i = (i+1) & fdb->mask) {
+        e = &fdb->table[i];
+        if (e->key == key) {
+            if (e->port != port) {
+                e->port = port;
+                fdb->stats.moved++;
+            }
+            e->seen = now;
+            return;
+        }
+    }
+
+    if (fdb->count >= fdb->mask - fdb->mask/4) {
+        fdb->stats.full++;
+        return;
+    }
+
+    e = &fdb->table[i];
+    e->key = key;
+    e->port = port;
+    e->seen = now;
+    fdb->count++;
+    fdb->stats.learned++;
+}
+
+
+/*
+ * Returns the port on which the given destination MAC address was seen
+ * (if it hasn't aged out by the given time), or -1 if it is unknown.
+ */
+
+int fdb_lookup(struct fdb *fdb, const unsigned char *mac, uint32_t now)
+{
+    uint64_t key = mac_key(mac);
+    uint32_t i;
+
+    i = fdb_index(fdb, key);
+    for (; fdb->table[i].key; i = (i+1) & fdb->mask) {
+        const struct fdbentry *e = &fdb->table[i];
+
+        if (e->key == key && now - e->seen < FDB_AGE_SEC) {
+            fdb->stats.hits++;
+            return e->port;
+        }
+        if (e->key == key)
+            break;
+    }
+
+    fdb->stats.misses++;
+    return -1;
+}
+
+
+/*
+ * Removes the entry at index i, moving back any later entries that
+ * would otherwise no longer be found.
+ */
+
+static void fdb_remove(struct fdb *fdb, uint32_t i)
+{
+    uint32_t j = i;
+
+    while (1) {
+        uint32_t k;
+
+        j = (j+1) & fdb->mask;
+        if (fdb->table[j].key == 0)
+            break;
+
+        /*
+         * The entry at j may move to i only if its home slot k is not
+         * cyclically in (i, j].
+         */
+
+        k = fdb_index(fdb, fdb->table[j].key);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+
+        fdb->table[i] = fdb->table[j];
+        i = j;
+    }
+
+    memset(&fdb->table[i], 0, sizeof(fdb->table[i]));
+    fdb->count--;
+}
+
+
+/*
+ * Removes the entries that have aged out, if it's time to look for
+ * them.
+ */
+
+void fdb_sweep(struct fdb *fdb, uint64_t now_usec)
+{
+    uint32_t i, now = now_usec / 1000000;
+
+    if (now_usec < fdb->next_sweep)
+        return;
+
+    fdb->next_sweep = now_usec + FDB_SWEEP_USEC;
+
+    for (i = 0; i <= fdb->mask; i++) {
+        while (fdb->table[i].key &&
+               now - fdb->table[i].seen >= FDB_AGE_SEC)
+        {
+            fdb_remove(fdb, i);
+            fdb->stats.aged++;
+        }
+    }
+}
+
+
+/*
+ * Prints a one-line summary of the forwarding table to the given file.
+ */
+
+void fdb_report(const struct fdb *fdb, FILE *f)
+{
+    const struct fdb_stats *s = &fdb->stats;
+
+    fprintf(f, "forwarding table: %u of %u entries used (%lu bytes), %lu "
+            "addresses learned, %lu moved, %lu aged out, %lu not learned "
+            "(table full); %lu lookups found, %lu missed\n", fdb->count,
+            fdb->mask + 1,
+            (unsigned long) (fdb->mask + 1) * sizeof(struct fdbentry),
+            s->learned, s->moved, s->aged, s->full, s->hits, s->misses);
+}
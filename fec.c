@@ -0,0 +1,669 @@
+#include "tappet.h"
+
+/*
+ * Forward error correction: messages are sent in groups of up to k, and
+ * each group is followed by m parity messages, from which the receiver
+ * can rebuild any m messages of the group that were lost. A protected
+ * message carries its group number, its index in the group, and the
+ * number of parity messages that will follow:
+ *
+ *     [ MSG_FEC | group (2 bytes) | index | m | message ]
+ *     [ MSG_FEC_PARITY | group (2 bytes) | j | m | k | parity ]
+ *
+ * Parity message j is a linear combination (over GF(2^8)) of the group's
+ * messages, each preceded by its two-byte length and padded with zeros
+ * to the length of the longest. The coefficients are a Cauchy matrix
+ * with its columns scaled so that the first row is all ones, so that
+ * any k of the k+m messages suffice to rebuild the rest, and the first
+ * parity message is just the XOR of the group.
+ *
+ * Messages are delivered as soon as they arrive, and the receiver keeps
+ * a copy of each in case it needs it to rebuild another. (Since we never
+ * accept datagrams out of order, a message from another group means
+ * that the current one is over. That is why FEC can't be used with
+ * multipath or source ports, which reorder datagrams.) A group that
+ * isn't full is closed after FEC_FLUSH_USEC, so that losses at the end
+ * of a burst are repaired too.
+ *
+ * The receiver counts the messages it should have received, and reports
+ * the loss rate (in thousandths) in a MSG_FEC_LOSS every FEC_REPORT_USEC.
+ * If asked to, the sender adjusts m to the reported loss rate, up to the
+ * configured limit.
+ */
+
+#define FEC_FLUSH_USEC 5000
+#define FEC_REPORT_USEC 1000000
+#define FEC_MARGIN 2
+#define FEC_MAXGAP 1024
+
+#define GF_POLY 0x11D
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t gf_mul[256][256];
+static uint8_t fec_coef[FEC_MAXM][FEC_MAXK];
+
+
+static uint8_t gf_inv(uint8_t a)
+{
+    return gf_exp[255 - gf_log[a]];
+}
+
+
+/*
+ * Builds the GF(2^8) multiplication table and our coefficient matrix,
+ * unless that has already been done.
+ */
+
+static void gf_init(void)
+{
+    int i, j, x = 1;
+
+    if (gf_exp[0] != 0)
+        return;
+
+    for (i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= GF_POLY;
+    }
+
+    for (i = 1; i < 256; i++) {
+        for (j = 1; j < 256; j++)
+            gf_mul[i][j] = gf_exp[gf_log[i] + gf_log[j]];
+    }
+
+    /*
+     * Row j, column i of the Cauchy matrix is 1/(x_j + y_i), with x_j = j
+     * and y_i = FEC_MAXM + i, so that all of them are distinct.
+     */
+
+    for (i = 0; i < FEC_MAXK; i++) {
+        uint8_t first = gf_inv(0 ^ (FEC_MAXM + i));
+
+        for (j = 0; j < FEC_MAXM; j++) {
+            uint8_t c = gf_inv(j ^ (FEC_MAXM + i));
+
+            fec_coef[j][i] = gf_mul[c][gf_inv(first)];
+        }
+    }
+}
+
+
+/*
+ * Adds c times the len bytes at in to the bytes at out.
+ */
+
+static void gf_muladd(unsigned char *out, const unsigned char *in, int len,
+                      uint8_t c)
+{
+    const uint8_t *row = gf_mul[c];
+    int i;
+
+    if (c == 0)
+        return;
+
+    if (c == 1) {
+        for (i = 0; i < len; i++)
+            out[i] ^= in[i];
+        return;
+    }
+
+    for (i = 0; i < len; i++)
+        out[i] ^= row[in[i]];
+}
+
+
+/*
+ * Inverts the n×n matrix a in place. Returns 0 on success, or -1 if it
+ * is singular (which it can't be, if our coefficients are right).
+ */
+
+static int gf_invert(uint8_t a[FEC_MAXM][FEC_MAXM], int n)
+{
+    uint8_t b[FEC_MAXM][FEC_MAXM];
+    int i, j, r;
+
+    memset(b, 0, sizeof(b));
+    for (i = 0; i < n; i++)
+        b[i][i] = 1;
+
+    for (i = 0; i < n; i++) {
+        uint8_t inv;
+
+        for (r = i; r < n && a[r][i] == 0; r++)
+            ;
+        if (r == n)
+            return -1;
+
+        if (r != i) {
+            for (j = 0; j < n; j++) {
+                uint8_t t;
+
+                t = a[i][j]; a[i][j] = a[r][j]; a[r][j] = t;
+                t = b[i][j]; b[i][j] = b[r][j]; b[r][j] = t;
+            }
+        }
+
+        inv = gf_inv(a[i][i]);
+        for (j = 0; j < n; j++) {
+            a[i][j] = gf_mul[inv][a[i][j]];
+            b[i][j] = gf_mul[inv][b[i][j]];
+        }
+
+        for (r = 0; r < n; r++) {
+            uint8_t c = a[r][i];
+
+            if (r == i || c == 0)
+                continue;
+            for (j = 0; j < n; j++) {
+                a[r][j] ^= gf_mul[c][a[i][j]];
+                b[r][j] ^= gf_mul[c][b[i][j]];
+            }
+        }
+    }
+
+    memcpy(a, b, sizeof(b));
+    return 0;
+}
+
+
+static int popcount(uint32_t v)
+{
+    int n = 0;
+
+    for (; v; v &= v - 1)
+        n++;
+
+    return n;
+}
+
+
+/*
+ * Sets up the given peer's FEC state, with groups of k messages followed
+ * by m parity messages (or between 1 and m, adapted to the loss rate),
+ * allocating buffers for received messages from the worker's arena.
+ * Returns 0 on success, or prints an error and returns -1 on failure.
+ */
+
+int fec_init(struct worker *w, struct peer *peer, int k, int m, int adapt)
+{
+    struct fec *f;
+    int i;
+
+    gf_init();
+
+    f = arena_alloc(&w->arena, sizeof(struct fec));
+    if (f == NULL) {
+        fprintf(stderr, "Couldn't allocate FEC state\n");
+        return -1;
+    }
+
+    memset(f, 0, sizeof(*f));
+
+    for (i = 0; i < FEC_MAXK + FEC_MAXM; i++) {
+        f->rx.shards[i] = arena_alloc(&w->arena, PKTBUF_SIZE);
+        if (f->rx.shards[i] == NULL) {
+            fprintf(stderr, "Couldn't allocate FEC buffers\n");
+            return -1;
+        }
+    }
+
+    f->k = k;
+    f->maxm = m;
+    f->m = adapt ? 1 : m;
+    f->adapt = adapt;
+    f->rx.last_report = monotonic_usec();
+
+    peer->fec = f;
+    return 0;
+}
+
+
+/*
+ * Returns the number of bytes that FEC adds to the biggest message we
+ * may send, for the length and header of a parity message.
+ */
+
+int fec_overhead(const struct peer *peer)
+{
+    return peer->fec ? FEC_PARITY_HDR + 2 : 0;
+}
+
+
+/*
+ * Sends the parity messages for the peer's current group, and starts a
+ * new group. Returns 0 on success, or -1 on failure.
+ */
+
+int fec_flush(struct worker *w, int udp, struct peer *peer)
+{
+    struct fec *f = peer->fec;
+    int j, n = 0;
+
+    if (f->count == 0)
+        return 0;
+
+    for (j = 0; j < f->gm; j++) {
+        unsigned char *p = f->parity[j]->data;
+
+        p[0] = MSG_FEC_PARITY;
+        p[1] = f->group >> 8;
+        p[2] = f->group;
+        p[3] = j;
+        p[4] = f->gm;
+        p[5] = f->count;
+
+        if (n == 0) {
+            n = seal_message(w, udp, peer, &f->parity[j],
+                             FEC_PARITY_HDR + f->plen) < 0 ? -1 : 0;
+            if (n == 0)
+                w->fec_stats.parity++;
+        }
+
+        pool_put(&w->pool, f->parity[j]);
+        f->parity[j] = NULL;
+    }
+
+    w->fec_stats.groups++;
+    f->group++;
+    f->count = 0;
+    f->plen = 0;
+
+    return n;
+}
+
+
+/*
+ * Sends the len-byte message at (*bp)->data to the given peer as part
+ * of the current group, and the group's parity messages if it is now
+ * full. A message is sent unprotected if there is no room for the FEC
+ * header, or no buffers for parity. Returns the same values as
+ * seal_message().
+ */
+
+int fec_message(struct worker *w, int udp, struct peer *peer,
+                struct pktbuf **bp, int len)
+{
+    struct fec *f = peer->fec;
+    unsigned char *p = (*bp)->data;
+    unsigned char lenbytes[2];
+    int j, n, sl = 2 + len;
+
+    if (FEC_PARITY_HDR + sl > pktbuf_room(&w->pool)) {
+        w->fec_stats.unprotected++;
+        return seal_message(w, udp, peer, bp, len);
+    }
+
+    /*
+     * A new group gets fresh parity buffers, and the number of parity
+     * messages we last chose.
+     */
+
+    if (f->count == 0) {
+        f->gm = f->m;
+        for (j = 0; j < f->gm; j++) {
+            f->parity[j] = pool_get(&w->pool, BUF_UDP_TX);
+            if (f->parity[j] == NULL) {
+                while (j-- > 0) {
+                    pool_put(&w->pool, f->parity[j]);
+                    f->parity[j] = NULL;
+                }
+                w->fec_stats.unprotected++;
+                return seal_message(w, udp, peer, bp, len);
+            }
+        }
+        f->deadline = monotonic_usec() + FEC_FLUSH_USEC;
+    }
+
+    /*
+     * Add the message (and its length) to each parity message, padding
+     * the parity with zeros first if this message is the longest yet.
+     */
+
+    lenbytes[0] = len >> 8;
+    lenbytes[1] = len;
+
+    for (j = 0; j < f->gm; j++) {
+        unsigned char *q = f->parity[j]->data + FEC_PARITY_HDR;
+        uint8_t c = fec_coef[j][f->count];
+
+        if (sl > f->plen)
+            memset(q + f->plen, 0, sl - f->plen);
+
+        gf_muladd(q, lenbytes, 2, c);
+        gf_muladd(q + 2, p, len, c);
+    }
+
+    if (sl > f->plen)
+        f->plen = sl;
+
+    memmove(p + FEC_DATA_HDR, p, len);
+    p[0] = MSG_FEC;
+    p[1] = f->group >> 8;
+    p[2] = f->group;
+    p[3] = f->count;
+    p[4] = f->gm;
+
+    f->count++;
+    w->fec_stats.sent++;
+
+    n = seal_message(w, udp, peer, bp, FEC_DATA_HDR + len);
+    if (n < 0)
+        return n;
+
+    if (f->count == f->k && fec_flush(w, udp, peer) < 0)
+        return -1;
+
+    return n;
+}
+
+
+/*
+ * Accounts for the receiver's current group, which is over, and for any
+ * groups that we never heard of between it and the given one; then
+ * starts the given group. Reports the loss rate when it is time to.
+ */
+
+static void fec_next_group(struct worker *w, struct peer *peer,
+                           uint16_t group)
+{
+    struct fecrx *r = &peer->fec->rx;
+    struct fec_stats *s = &w->fec_stats;
+    uint64_t now;
+
+    if (r->active && r->group == group)
+        return;
+
+    if (r->active) {
+        int k = r->k > 0 ? r->k : r->maxidx + 1;
+        int missing = k - popcount(r->have);
+        uint16_t skipped = group - r->group - 1;
+
+        if (r->repaired)
+            ;
+        else if (missing > 0)
+            s->unrecoverable++;
+        else
+            s->intact++;
+
+        r->expected += k + r->m;
+        r->received += r->got;
+
+        if (skipped > 0 && skipped < FEC_MAXGAP) {
+            s->vanished += skipped;
+            r->expected += skipped * (k + r->m);
+        }
+    }
+
+    r->active = 1;
+    r->group = group;
+    r->have = 0;
+    r->phave = 0;
+    r->k = 0;
+    r->m = 0;
+    r->maxidx = -1;
+    r->got = 0;
+    r->repaired = 0;
+
+    now = monotonic_usec();
+    if (now - r->last_report >= FEC_REPORT_USEC && r->expected > 0) {
+        r->loss = r->expected > r->received ?
+            1000 * (r->expected - r->received) / r->expected : 0;
+        r->loss_due = 1;
+        r->expected = r->received = 0;
+        r->last_report = now;
+    }
+}
+
+
+/*
+ * Accepts the len-byte body of a MSG_FEC from the given peer, keeps a
+ * copy of the message it protects, and delivers the message. Returns 0
+ * on success, or -1 on failure (but ignores malformed messages).
+ */
+
+int fec_input(struct worker *w, int tap, struct peer *peer,
+              unsigned char *p, int len)
+{
+    struct fecrx *r;
+    unsigned char *shard;
+    int i, m;
+
+    if (peer->fec == NULL || len < FEC_DATA_HDR-1 + 1 ||
+        p[2] >= FEC_MAXK || p[3] > FEC_MAXM ||
+        p[4] == MSG_FEC || p[4] == MSG_FEC_PARITY)
+    {
+        w->fec_stats.bad++;
+        return 0;
+    }
+
+    r = &peer->fec->rx;
+    fec_next_group(w, peer, (p[0] << 8) | p[1]);
+
+    i = p[2];
+    m = p[3];
+    p += FEC_DATA_HDR-1;
+    len -= FEC_DATA_HDR-1;
+
+    shard = r->shards[i];
+    shard[0] = len >> 8;
+    shard[1] = len;
+    memcpy(shard + 2, p, len);
+
+    r->have |= 1U << i;
+    r->m = m;
+    r->got++;
+    if (i > r->maxidx)
+        r->maxidx = i;
+
+    w->fec_stats.rcvd++;
+    return deliver(w, tap, peer, p, len, 0);
+}
+
+
+/*
+ * Rebuilds the messages missing from the receiver's current group of k
+ * from the parity messages we have, and delivers them. Returns 0 on
+ * success, or -1 on failure.
+ */
+
+static int fec_repair(struct worker *w, int tap, struct peer *peer, int k,
+                      int plen)
+{
+    struct fecrx *r = &peer->fec->rx;
+    uint8_t a[FEC_MAXM][FEC_MAXM];
+    int lost[FEC_MAXM], par[FEC_MAXM];
+    int i, j, e = 0, np = 0;
+
+    for (i = 0; i < k && e < FEC_MAXM; i++) {
+        if (!(r->have & (1U << i)))
+            lost[e++] = i;
+    }
+
+    for (j = 0; j < FEC_MAXM && np < e; j++) {
+        if (r->phave & (1U << j))
+            par[np++] = j;
+    }
+
+    /*
+     * Take the messages we have out of the parity messages we'll use,
+     * which leaves a linear combination of the missing messages, whose
+     * coefficients we invert.
+     */
+
+    for (j = 0; j < np; j++) {
+        unsigned char *q = r->shards[FEC_MAXK + par[j]];
+
+        for (i = 0; i < k; i++) {
+            unsigned char *shard = r->shards[i];
+            int sl = 2 + ((shard[0] << 8) | shard[1]);
+
+            if (!(r->have & (1U << i)))
+                continue;
+            if (sl > plen) {
+                w->fec_stats.bad++;
+                return 0;
+            }
+            gf_muladd(q, shard, sl, fec_coef[par[j]][i]);
+        }
+
+        for (i = 0; i < e; i++)
+            a[i][j] = fec_coef[par[j]][lost[i]];
+    }
+
+    if (gf_invert(a, e) < 0) {
+        w->fec_stats.bad++;
+        return 0;
+    }
+
+    r->repaired = 1;
+    w->fec_stats.repaired++;
+
+    /*
+     * a was built transposed, so a[j][i] is now the weight of parity j
+     * in missing message i.
+     */
+
+    for (i = 0; i < e; i++) {
+        unsigned char *shard = r->shards[lost[i]];
+        int mlen;
+
+        memset(shard, 0, plen);
+        for (j = 0; j < e; j++)
+            gf_muladd(shard, r->shards[FEC_MAXK + par[j]], plen, a[j][i]);
+
+        mlen = (shard[0] << 8) | shard[1];
+        if (mlen > plen - 2 || mlen == 0 ||
+            shard[2] == MSG_FEC || shard[2] == MSG_FEC_PARITY)
+        {
+            w->fec_stats.bad++;
+            continue;
+        }
+
+        w->fec_stats.recovered++;
+        if (deliver(w, tap, peer, shard + 2, mlen, 0) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Accepts the len-byte body of a MSG_FEC_PARITY from the given peer, and
+ * rebuilds the messages missing from its group once it can. Returns 0
+ * on success, or -1 on failure (but ignores malformed messages).
+ */
+
+int fec_parity(struct worker *w, int tap, struct peer *peer,
+               unsigned char *p, int len)
+{
+    struct fecrx *r;
+    int j, m, k, missing;
+
+    if (peer->fec == NULL || len < FEC_PARITY_HDR-1 + 2 ||
+        p[3] > FEC_MAXM || p[2] >= p[3] || p[4] > FEC_MAXK || p[4] == 0)
+    {
+        w->fec_stats.bad++;
+        return 0;
+    }
+
+    r = &peer->fec->rx;
+    fec_next_group(w, peer, (p[0] << 8) | p[1]);
+
+    j = p[2];
+    m = p[3];
+    k = p[4];
+    p += FEC_PARITY_HDR-1;
+    len -= FEC_PARITY_HDR-1;
+
+    r->k = k;
+    r->m = m;
+    r->got++;
+
+    missing = k - popcount(r->have & ((1U << k) - 1));
+    if (missing == 0 || r->repaired)
+        return 0;
+
+    memcpy(r->shards[FEC_MAXK + j], p, len);
+    r->phave |= 1U << j;
+
+    if (popcount(r->phave) < missing)
+        return 0;
+
+    return fec_repair(w, tap, peer, k, len);
+}
+
+
+/*
+ * Takes note of the loss rate (in thousandths) that the peer reports
+ * in the len-byte body of a MSG_FEC_LOSS, and adjusts the number of
+ * parity messages per group to it, if we are to.
+ */
+
+void fec_loss(struct peer *peer, const unsigned char *p, int len)
+{
+    struct fec *f = peer->fec;
+    int m;
+
+    if (f == NULL || len < 2)
+        return;
+
+    f->reported = (p[0] << 8) | p[1];
+    if (!f->adapt)
+        return;
+
+    /*
+     * We want FEC_MARGIN times as many parity messages as we expect to
+     * lose from a group, which we round up.
+     */
+
+    m = (FEC_MARGIN * f->reported * (f->k + f->maxm) + 999) / 1000;
+    if (m < 1)
+        m = 1;
+    if (m > f->maxm)
+        m = f->maxm;
+    f->m = m;
+}
+
+
+/*
+ * Writes a MSG_FEC_LOSS with the loss rate we have measured into the
+ * buffer at p. Returns the length of the message.
+ */
+
+int fec_loss_message(struct peer *peer, unsigned char *p)
+{
+    struct fecrx *r = &peer->fec->rx;
+
+    r->loss_due = 0;
+    p[0] = MSG_FEC_LOSS;
+    p[1] = r->loss >> 8;
+    p[2] = r->loss;
+
+    return 3;
+}
+
+
+/*
+ * Prints a one-line summary of forward error correction to the given
+ * file.
+ */
+
+void fec_report(const struct worker *w, const struct peer *peer, FILE *f)
+{
+    const struct fec_stats *s = &w->fec_stats;
+    const struct fec *fec = peer->fec;
+
+    fprintf(f, "fec: %d+%d (up to %d), %lu messages in %lu groups with "
+            "%lu parity, %lu unprotected, peer reports %.1f%% loss; "
+            "%lu received, %lu groups intact, %lu repaired (%lu messages), "
+            "%lu unrecoverable, %lu vanished, %.1f%% loss, %lu malformed\n",
+            fec->k, fec->m, fec->maxm, s->sent, s->groups, s->parity,
+            s->unprotected, fec->reported / 10.0, s->rcvd, s->intact,
+            s->repaired, s->recovered, s->unrecoverable, s->vanished,
+            fec->rx.loss / 10.0, s->bad);
+}
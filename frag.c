@@ -0,0 +1,244 @@
+#include "tappet.h"
+
+/*
+ * In-tunnel fragmentation: a message too big to fit into a datagram
+ * that the path can carry is split into MSG_FRAGMENT messages, each of
+ * which is encrypted and authenticated separately, and which carry
+ * the message's identifier and their offset into it:
+ *
+ *     [ MSG_FRAGMENT | id (2 bytes) | last bit, offset (2 bytes) | ... ]
+ *
+ * The receiver copies fragments into one of a few reassembly slots,
+ * and delivers the message once it has all of it. (Replay protection
+ * ensures that no fragment is seen twice, so counting bytes is enough
+ * to tell when a message is complete.) A slot is reclaimed when its
+ * time is up (by the peer's reassembly timer, which is armed for the
+ * oldest slot in use), or when all slots are in use and a new message
+ * needs one; the oldest message is then given up.
+ */
+
+#define FRAG_HDR 4
+#define FRAG_LAST 0x8000
+
+
+/*
+ * Sets up the given peer's fragmentation state, allocating reassembly
+ * buffers from the worker's arena. Returns 0 on success, or prints an
+ * error and returns -1 on failure.
+ */
+
+int frag_init(struct worker *w, struct peer *peer)
+{
+    int i;
+    struct reassembly *r;
+
+    r = arena_alloc(&w->arena, sizeof(struct reassembly));
+    if (r == NULL) {
+        fprintf(stderr, "Couldn't allocate reassembly state\n");
+        return -1;
+    }
+
+    memset(r, 0, sizeof(*r));
+    timer_init(&r->timer, TIMER_REASM, peer);
+
+    for (i = 0; i < FRAG_SLOTS; i++) {
+        r->slots[i].buf = arena_alloc(&w->arena, PKTBUF_SIZE);
+        if (r->slots[i].buf == NULL) {
+            fprintf(stderr, "Couldn't allocate reassembly buffers\n");
+            return -1;
+        }
+    }
+
+    peer->reasm = r;
+    return 0;
+}
+
+
+/*
+ * Sends the len-byte message at (*bp)->data to the given peer, in
+ * fragments if it is too big for one datagram and fragmentation is
+ * enabled. Returns 0 on success, or -1 on failure.
+ */
+
+int frag_message(struct worker *w, int udp, struct peer *peer,
+                 struct pktbuf **bp, int len)
+{
+    int limit = message_limit(w, peer);
+    int nfrags, chunk, off;
+    uint16_t id;
+
+    if (len <= limit || !w->opts->fragment)
+        return send_message(w, udp, peer, bp, len) < 0 ? -1 : 0;
+
+    /*
+     * We split the message into fragments of (nearly) equal size, so
+     * that the last one isn't a tiny runt.
+     */
+
+    nfrags = (len + limit-1-FRAG_HDR - 1) / (limit-1-FRAG_HDR);
+    chunk = (len + nfrags - 1) / nfrags;
+    id = peer->frag_id++;
+
+    w->frag_stats.fragmented++;
+
+    for (off = 0; off < len; off += chunk) {
+        struct pktbuf *f;
+        int n = len - off < chunk ? len - off : chunk;
+        int flags = off + n == len ? FRAG_LAST : 0;
+
+        f = pool_get(&w->pool, BUF_UDP_TX);
+        if (f == NULL) {
+            w->frag_stats.no_buffer++;
+            return 0;
+        }
+
+        f->flow = (*bp)->flow;
+        f->data[0] = MSG_FRAGMENT;
+        f->data[1] = id >> 8;
+        f->data[2] = id;
+        f->data[3] = (off | flags) >> 8;
+        f->data[4] = off | flags;
+        memcpy(f->data + 1+FRAG_HDR, (*bp)->data + off, n);
+
+        n = send_message(w, udp, peer, &f, 1+FRAG_HDR + n);
+        pool_put(&w->pool, f);
+        if (n < 0)
+            return -1;
+
+        w->frag_stats.sent++;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Accepts the len-byte body of a MSG_FRAGMENT (i.e., what follows the
+ * type byte) from the given peer. If the fragment completes a message,
+ * stores its address and length in *msg and *msglen and returns 1.
+ * Otherwise returns 0.
+ */
+
+int frag_input(struct worker *w, struct peer *peer, unsigned char *p,
+               int len, unsigned char **msg, int *msglen)
+{
+    struct reassembly *r = peer->reasm;
+    struct fragslot *s = NULL, *oldest = NULL;
+    struct frag_stats *st = &w->frag_stats;
+    uint64_t now;
+    uint16_t id;
+    int i, off, last;
+
+    if (r == NULL || len < FRAG_HDR) {
+        st->bad++;
+        return 0;
+    }
+
+    id = (p[0] << 8) | p[1];
+    off = ((p[2] << 8) | p[3]) & ~FRAG_LAST;
+    last = p[2] & (FRAG_LAST >> 8);
+    p += FRAG_HDR;
+    len -= FRAG_HDR;
+
+    st->rcvd++;
+
+    if (off + len > PKTBUF_SIZE) {
+        st->bad++;
+        return 0;
+    }
+
+    /*
+     * Find the slot for this message, reclaiming any slots whose time
+     * is up on the way.
+     */
+
+    now = monotonic_usec();
+
+    for (i = 0; i < FRAG_SLOTS; i++) {
+        struct fragslot *t = &r->slots[i];
+
+        if (t->used && t->deadline <= now) {
+            t->used = 0;
+            st->expired++;
+        }
+
+        if (t->used && t->id == id)
+            s = t;
+        else if (oldest == NULL || !t->used ||
+                 (oldest->used && t->deadline < oldest->deadline))
+            oldest = t;
+    }
+
+    if (s == NULL) {
+        s = oldest;
+        if (s->used)
+            st->evicted++;
+
+        s->used = 1;
+        s->id = id;
+        s->have = 0;
+        s->total = -1;
+        s->deadline = now + FRAG_TIMEOUT_USEC;
+
+        if (r->timer.pprev == NULL)
+            timer_arm(w->wheel, &r->timer, s->deadline);
+    }
+
+    memcpy(s->buf + off, p, len);
+    s->have += len;
+    if (last)
+        s->total = off + len;
+
+    if (s->have != s->total)
+        return 0;
+
+    s->used = 0;
+    st->reassembled++;
+
+    *msg = s->buf;
+    *msglen = s->total;
+    return 1;
+}
+
+
+/*
+ * Called when the peer's reassembly timer expires: reclaims the slots
+ * whose time is up, and rearms the timer for the oldest of the rest.
+ */
+
+void frag_expire(struct worker *w, struct peer *peer)
+{
+    struct reassembly *r = peer->reasm;
+    uint64_t now = monotonic_usec(), next = 0;
+    int i;
+
+    for (i = 0; i < FRAG_SLOTS; i++) {
+        struct fragslot *s = &r->slots[i];
+
+        if (s->used && s->deadline <= now) {
+            s->used = 0;
+            w->frag_stats.expired++;
+        }
+
+        if (s->used && (next == 0 || s->deadline < next))
+            next = s->deadline;
+    }
+
+    if (next)
+        timer_arm(w->wheel, &r->timer, next);
+}
+
+
+/*
+ * Prints a one-line summary of fragmentation and reassembly to the
+ * given file.
+ */
+
+void frag_report(const struct frag_stats *s, FILE *f)
+{
+    fprintf(f, "fragmentation: %lu messages in %lu fragments (%lu lost "
+            "for lack of buffers); %lu fragments received, %lu messages "
+            "reassembled, %lu expired, %lu evicted, %lu malformed\n",
+            s->fragmented, s->sent, s->no_buffer, s->rcvd, s->reassembled,
+            s->expired, s->evicted, s->bad);
+}
@@ -0,0 +1,382 @@
+#include "tappet.h"
+
+#include "randombytes.h"
+
+/*
+ * Group keys: a hub floods broadcast and multicast frames (and frames
+ * for unknown addresses) to every peer, and encrypting a copy for each
+ * under the key it shares with that peer would cost one encryption per
+ * peer per frame. Instead, the hub makes up a group key at startup,
+ * and sends it to each peer under their shared key:
+ *
+ *     [ MSG_GROUP_KEY | id (4 bytes) | nonce (16 bytes) | key (32) ]
+ *
+ * The nonce is the constant part of the nonces the hub will use with
+ * the group key, so that the peer can tell which datagrams to decrypt
+ * with it. The peer acknowledges the key with [ MSG_GROUP_ACK | id ],
+ * after which the hub encrypts each frame it floods once with the group
+ * key, and sends the same datagram to every such member with a single
+ * sendmmsg(). Peers that aren't members yet get their own copies.
+ *
+ * A member is remembered along with the prefix of its nonces, which
+ * changes whenever it restarts (and loses the key), so that the key is
+ * sent to it again. The key is resent in reply to everything a peer
+ * sends until it is acknowledged.
+ *
+ * Every member has the key, so any of them can seal a datagram that
+ * looks as if the hub flooded it. Members accept only frames under the
+ * group key (and never control messages, such as a new group key or a
+ * shortcut), but a member can still forge flooded frames, and push the
+ * counter that group_open() expects forward, so that the hub's own
+ * floods are rejected until its counter catches up. That is inherent in
+ * sharing a symmetric key, and the price of encrypting each flooded
+ * frame only once.
+ */
+
+#define GROUP_MSGLEN (1 + 4 + WIRE_CONSTBYTES + KEYBYTES)
+#define GROUP_BATCH 64
+
+
+/*
+ * Returns the prefix (the first four bytes) of the given nonce, which
+ * is never 0 (see get_nonce_prefix()).
+ */
+
+static uint32_t prefix_of(const unsigned char *nonce)
+{
+    return (uint32_t) nonce[0] << 24 | nonce[1] << 16 | nonce[2] << 8 |
+        nonce[3];
+}
+
+
+/*
+ * Returns 1 if the given peer of the hub has acknowledged the current
+ * group key (since it last restarted), or 0 otherwise.
+ */
+
+static int is_member(const struct hub *hub, const struct peer *peer)
+{
+    return hub->member[peer - hub->peers] ==
+        prefix_of(peer->theirnonce);
+}
+
+
+/*
+ * Sets up the given group: a hub makes up a key, and an id and nonce to
+ * go with it, while a peer of a hub waits to be sent them. Returns 0 on
+ * success, or prints an error and returns -1 on failure.
+ */
+
+int group_init(struct worker *w, struct group *g, uint32_t nonce_prefix)
+{
+    memset(g, 0, sizeof(*g));
+
+    if (!w->opts->listen)
+        return 0;
+
+    g->buf = pool_get(&w->pool, BUF_UDP_TX);
+    if (g->buf == NULL) {
+        fprintf(stderr, "Couldn't allocate group key buffer\n");
+        return -1;
+    }
+
+    randombytes(g->k, sizeof(g->k));
+    do {
+        randombytes((unsigned char *) &g->id, sizeof(g->id));
+    } while (g->id == 0);
+    generate_nonce(nonce_prefix, g->nonce);
+
+    g->known = 1;
+    return 0;
+}
+
+
+/*
+ * Takes note of a group key from the hub (the len-byte body of a
+ * MSG_GROUP_KEY message), which we must acknowledge.
+ */
+
+void group_learn(struct group *g, const unsigned char *p, int len)
+{
+    uint32_t id;
+
+    if (g == NULL || len != GROUP_MSGLEN - 1)
+        return;
+
+    id = (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+
+    if (!g->known || id != g->id) {
+        g->id = id;
+        memset(g->nonce, 0, NONCEBYTES);
+        memcpy(g->nonce, p + 4, WIRE_CONSTBYTES);
+        memcpy(g->k, p + 4 + WIRE_CONSTBYTES, KEYBYTES);
+        g->known = 1;
+        g->keys++;
+    }
+
+    g->ack_due = 1;
+}
+
+
+/*
+ * Takes note of a peer's acknowledgement of the group key (the len-byte
+ * body of a MSG_GROUP_ACK message).
+ */
+
+void group_acked(struct worker *w, struct peer *peer, const unsigned char *p,
+                 int len)
+{
+    struct hub *hub = w->hub;
+
+    if (hub == NULL || hub->member == NULL || len != 4)
+        return;
+
+    if (((uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) ==
+        hub->group.id)
+        hub->member[peer - hub->peers] = prefix_of(peer->theirnonce);
+}
+
+
+/*
+ * Sends the peer the group key, if it hasn't acknowledged it, or (if we
+ * are the peer) the acknowledgement of the key, if it is due. Returns 0
+ * on success, or -1 on failure.
+ */
+
+int group_send_replies(struct worker *w, int udp, struct peer *peer,
+                       struct pktbuf **bp)
+{
+    struct hub *hub = w->hub;
+    struct group *g = peer->group;
+    unsigned char *p = (*bp)->data;
+
+    if (hub && hub->member && !is_member(hub, peer)) {
+        g = &hub->group;
+        p[0] = MSG_GROUP_KEY;
+        p[1] = g->id >> 24;
+        p[2] = g->id >> 16;
+        p[3] = g->id >> 8;
+        p[4] = g->id;
+        memcpy(p + 5, g->nonce, WIRE_CONSTBYTES);
+        memcpy(p + 5 + WIRE_CONSTBYTES, g->k, KEYBYTES);
+        g->keys++;
+
+        return send_message(w, udp, peer, bp, GROUP_MSGLEN) < 0 ? -1 : 0;
+    }
+
+    if (g && g->ack_due) {
+        g->ack_due = 0;
+        p[0] = MSG_GROUP_ACK;
+        p[1] = g->id >> 24;
+        p[2] = g->id >> 16;
+        p[3] = g->id >> 8;
+        p[4] = g->id;
+
+        return send_message(w, udp, peer, bp, 5) < 0 ? -1 : 0;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Returns 1 if the given nonce is one the hub uses with the group key,
+ * or 0 otherwise.
+ */
+
+int group_nonce(const struct group *g, const unsigned char *nonce)
+{
+    return g->known && memcmp(nonce, g->nonce, WIRE_CONSTBYTES) == 0;
+}
+
+
+/*
+ * Returns 1 if the len-byte message at p is a frame (compressed or not),
+ * or 0 otherwise.
+ */
+
+static int is_frame(const unsigned char *p, int len)
+{
+    return len > 0 &&
+        (p[0] == MSG_FRAME || p[0] == (MSG_FRAME | MSG_COMPRESSED));
+}
+
+
+/*
+ * Decrypts the len-byte ciphertext at ct, whose nonce is the group's,
+ * in place. Returns the same values as decrypt(), except that anything
+ * but a frame is rejected (with -1), since the hub sends nothing else
+ * under the group key, and any other member could have sealed it.
+ */
+
+int group_open(struct group *g, unsigned char *nonce, unsigned char *ct,
+               int len)
+{
+    int n;
+
+    if (nonce_counter(nonce) <= nonce_counter(g->nonce)) {
+        g->rejected++;
+        return -1;
+    }
+
+    n = decrypt(g->k, nonce, ct, len, ct);
+    if (n == -1) {
+        g->rejected++;
+        return n;
+    }
+
+    if (n > 0 && !is_frame(ct+ZEROBYTES, n-ZEROBYTES)) {
+        g->rejected++;
+        return -1;
+    }
+
+    memcpy(g->nonce, nonce, NONCEBYTES);
+    g->received++;
+    return n;
+}
+
+
+/*
+ * Returns 1 if the given peer can be sent flooded frames encrypted with
+ * the group key, or 0 otherwise.
+ */
+
+int group_is_member(const struct hub *hub, const struct peer *peer)
+{
+    return hub->member != NULL && is_member(hub, peer);
+}
+
+
+/*
+ * Encrypts the len-byte frame at p with the group key, and sets up iov
+ * to point to the datagram, sealed just as seal_message() would, with
+ * the full nonce in front of the ciphertext. Returns 0 on success, or
+ * -1 if the frame can't be sent.
+ */
+
+static int group_seal(struct worker *w, struct group *g,
+                      const unsigned char *frame, int len,
+                      struct iovec *iov)
+{
+    unsigned char *pt;
+    int n, off = w->opts->framed ? 1 : 0;
+
+    if (len + off > pktbuf_room(&w->pool))
+        return -1;
+
+    memcpy(g->buf->data + off, frame, len);
+    len += off;
+    if (off)
+        g->buf->data[0] = MSG_FRAME;
+
+    if (w->opts->compress)
+        len = compress_message(w, &g->buf, len);
+
+    pt = g->buf->data - ZEROBYTES;
+    update_nonce(g->nonce);
+    memset(pt, 0, ZEROBYTES);
+
+    n = encrypt(g->k, g->nonce, pt, len+ZEROBYTES, pt);
+    if (n < 0)
+        return -1;
+
+    memcpy(pt - NONCEBYTES, g->nonce, NONCEBYTES);
+    iov->iov_base = pt - NONCEBYTES;
+    iov->iov_len = n + NONCEBYTES;
+    g->sealed++;
+
+    return 0;
+}
+
+
+/*
+ * Sends the len-byte frame at p, encrypted once with the group key, to
+ * those of the n given peers (by index) that are members of the group,
+ * except the given peer (the one the frame came from, if any). Returns
+ * 0 on success, or prints an error and returns -1 on failure.
+ */
+
+int group_flood(struct worker *w, const struct peer *from,
+                const uint32_t *ports, int n, const unsigned char *frame,
+                int len)
+{
+    struct hub *hub = w->hub;
+    struct group *g = &hub->group;
+    struct mmsghdr msgs[GROUP_BATCH];
+    struct iovec iov;
+    int i, count = 0, sealed = 0;
+
+    for (i = 0; i <= n; i++) {
+        struct peer *peer = NULL;
+        int sent, done;
+
+        if (i < n) {
+            peer = &hub->peers[ports[i]];
+            if (peer == from || !is_member(hub, peer))
+                continue;
+
+            memset(&msgs[count], 0, sizeof(msgs[count]));
+            msgs[count].msg_hdr.msg_name = &peer->addr;
+            msgs[count].msg_hdr.msg_namelen = peer->addrlen;
+            msgs[count].msg_hdr.msg_iov = &iov;
+            msgs[count].msg_hdr.msg_iovlen = 1;
+            count++;
+        }
+
+        if (count == 0 || (count < GROUP_BATCH && i < n))
+            continue;
+
+        if (!sealed && group_seal(w, g, frame, len, &iov) < 0)
+            return 0;
+        sealed = 1;
+
+        /*
+         * A datagram that the kernel won't send (e.g., because the
+         * socket's buffer is full) is dropped, and we carry on with
+         * the rest of the batch.
+         */
+
+        for (sent = 0; sent < count; ) {
+            done = sendmmsg(hub->udp, msgs + sent, count - sent, 0);
+            if (done < 0 && (errno == EAGAIN || errno == ENOBUFS ||
+                             errno == ENETUNREACH || errno == EMSGSIZE)) {
+                g->dropped++;
+                done = 1;
+            }
+            else if (done < 0) {
+                fprintf(stderr, "Error writing to UDP socket: %s\n",
+                        strerror(errno));
+                return -1;
+            }
+            sent += done;
+        }
+
+        g->copies += count;
+        g->batches++;
+        count = 0;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Prints a one-line summary of the group key's use to the given file.
+ */
+
+void group_report(const struct group *g, FILE *f)
+{
+    if (g->buf == NULL) {
+        fprintf(f, "group key: %s, %u keys learned, %lu datagrams "
+                "received with it, %lu rejected\n",
+                g->known ? "known" : "not yet known", g->keys, g->received,
+                g->rejected);
+        return;
+    }
+
+    fprintf(f, "group key: %lu frames flooded with one encryption each, "
+            "sent in %lu datagrams (%lu encryptions saved, %lu dropped) "
+            "with %lu sendmmsg() calls; %u keys sent\n", g->sealed,
+            g->copies, g->copies > g->sealed ? g->copies - g->sealed : 0,
+            g->dropped, g->batches, g->keys);
+}
@@ -0,0 +1,214 @@
+#include "tappet.h"
+
+/*
+ * Measures how much memory a hub needs for each of its peers, and how
+ * long it takes to find the peer that sent a datagram, for hubs of
+ * 10,000, 100,000 and 1,000,000 peers (or however many are given on the
+ * command line). The peers' public keys are made up, and their shared
+ * keys never computed, so that setting up a hub of a million peers
+ * takes seconds rather than most of a minute.
+ *
+ * Each lookup is of a random peer, as when datagrams arrive from all
+ * over a big hub, and reads the parts of the peer's state that the hub
+ * then checks (its last nonce and address), so that the time includes
+ * the cache misses that the hub would take. Lookups of ids that aren't
+ * any peer's are timed too, since anyone can send those.
+ */
+
+#define BENCH_LOOKUPS (1 << 22)
+
+
+/*
+ * Returns the next number from a xorshift64* generator: the keys need
+ * only be different, not secret, and this is much quicker than reading
+ * a million keys' worth of /dev/urandom.
+ */
+
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+
+/*
+ * Fills the given buffer with len pseudo-random bytes.
+ */
+
+static void fill_random(uint64_t *state, unsigned char *p, int len)
+{
+    while (len > 0) {
+        uint64_t x = next_random(state);
+        int n = len < 8 ? len : 8;
+
+        memcpy(p, &x, n);
+        p += n;
+        len -= n;
+    }
+}
+
+
+/*
+ * Looks up the peer in each of the given nonces, and returns the mean
+ * time per lookup, in nanoseconds.
+ */
+
+static double time_lookups(const struct hub *hub, const unsigned char *nonces,
+                           int count)
+{
+    volatile unsigned int sink;
+    unsigned int sum = 0;
+    uint64_t start;
+    int i;
+
+    start = monotonic_usec();
+
+    for (i = 0; i < count; i++) {
+        const struct peer *peer = hub_find(hub, nonces + i * NONCEBYTES);
+
+        if (peer)
+            sum += peer->theirnonce[NONCEBYTES-1] + peer->addr.sa.sa_family;
+    }
+
+    sink = sum;
+    (void) sink;
+
+    return (monotonic_usec() - start) * 1000.0 / count;
+}
+
+
+/*
+ * Sets up a hub with the given number of peers, and prints what it
+ * costs per peer, and how long lookups take. Returns 0 on success, or
+ * prints an error and returns -1 on failure.
+ */
+
+static int bench(struct worker *w, uint32_t count, unsigned char *nonces,
+                 uint64_t *state)
+{
+    struct hub hub;
+    unsigned char sk[KEYBYTES], pk[KEYBYTES];
+    unsigned char (*ids)[HUB_IDBYTES];
+    double hit, miss;
+    uint64_t start;
+    size_t table, keys, fdb;
+    uint32_t i;
+    int j;
+
+    ids = malloc(count * sizeof(*ids));
+    if (ids == NULL) {
+        fprintf(stderr, "Couldn't allocate peer ids\n");
+        return -1;
+    }
+
+    fill_random(state, sk, sizeof(sk));
+    start = monotonic_usec();
+
+    if (hub_setup(w, &hub, count, -1, sk, 1) < 0) {
+        free(ids);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        fill_random(state, pk, sizeof(pk));
+        memcpy(ids[i], pk, HUB_IDBYTES);
+        if (hub_add(&hub, pk, "random key", 1, 1) < 0) {
+            free(ids);
+            pool_put(&w->pool, hub.out);
+            arena_free(&hub.arena);
+            return -1;
+        }
+    }
+
+    start = monotonic_usec() - start;
+
+    /*
+     * Datagrams from random peers, and from ids that (almost certainly)
+     * aren't any peer's.
+     */
+
+    for (j = 0; j < BENCH_LOOKUPS; j++) {
+        unsigned char *nonce = nonces + j * NONCEBYTES;
+
+        fill_random(state, nonce, NONCEBYTES);
+        memcpy(nonce + HUB_IDOFF, ids[next_random(state) % count],
+               HUB_IDBYTES);
+    }
+    hit = time_lookups(&hub, nonces, BENCH_LOOKUPS);
+
+    for (j = 0; j < BENCH_LOOKUPS; j++)
+        fill_random(state, nonces + j * NONCEBYTES, NONCEBYTES);
+    miss = time_lookups(&hub, nonces, BENCH_LOOKUPS);
+
+    table = (hub.mask + 1) * sizeof(struct hubslot);
+    keys = keycache_size(count);
+    fdb = hub.fdb.table ? (hub.fdb.mask + 1) * sizeof(struct fdbentry) : 0;
+
+    printf("%8u peers: %5lu bytes per peer (%lu of state, %lu in the "
+           "peer table, %lu of keys, %lu in the forwarding table, %lu "
+           "other); lookups %.1f ns (%.1f ns for unknown ids); set up in "
+           "%.2f s\n", count, (unsigned long) (hub.arena.used / count),
+           (unsigned long) sizeof(struct peer),
+           (unsigned long) (table / count), (unsigned long) (keys / count),
+           (unsigned long) (fdb / count),
+           (unsigned long) ((hub.arena.used - count * sizeof(struct peer) -
+                             table - keys - fdb) / count),
+           hit, miss, start / 1e6);
+
+    free(ids);
+    pool_put(&w->pool, hub.out);
+    arena_free(&hub.arena);
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    static const uint32_t counts[] = { 10000, 100000, 1000000 };
+    struct options opts;
+    struct worker w;
+    unsigned char *nonces;
+    uint64_t state = 0x9E3779B97F4A7C15ULL ^ monotonic_usec();
+    int i, n;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.listen = 1;
+    opts.hub = 1;
+
+    memset(&w, 0, sizeof(w));
+    w.opts = &opts;
+    w.cpu = -1;
+    w.node = -1;
+
+    if (arena_init(&w.arena, ARENA_SIZE, 0, -1) < 0 ||
+        pool_init(&w.pool, &w.arena, PKTBUF_COUNT, PKTBUF_SIZE,
+                  HEADROOM) < 0)
+        return 1;
+
+    nonces = malloc((size_t) BENCH_LOOKUPS * NONCEBYTES);
+    if (nonces == NULL) {
+        fprintf(stderr, "Couldn't allocate nonces\n");
+        return 1;
+    }
+
+    n = argc > 1 ? argc - 1 : (int) (sizeof(counts) / sizeof(counts[0]));
+    for (i = 0; i < n; i++) {
+        long count = argc > 1 ? atol(argv[i+1]) : (long) counts[i];
+
+        if (count < 1 || count > 100000000) {
+            fprintf(stderr, "Usage: hub-bench [peers...]\n");
+            return 1;
+        }
+
+        if (bench(&w, count, nonces, &state) < 0)
+            return 1;
+    }
+
+    return 0;
+}
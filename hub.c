@@ -0,0 +1,642 @@
+#include "tappet.h"
+
+#include <dirent.h>
+#include <limits.h>
+#include <sys/epoll.h>
+
+#include "crypto_scalarmult_curve25519.h"
+
+/*
+ * Hub mode: rather than one process (and port, and TAP device) for each
+ * spoke, a hub serves all of them. It loads the public key of every
+ * spoke from the files named *.pub in a directory, and has a shared key
+ * computed for each by the time it first hears from it (see keycache.c).
+ *
+ * A datagram must be matched to the spoke that sent it before it can be
+ * decrypted, and trying each key in turn would cost one decryption per
+ * spoke. Instead, each spoke (started with --hub) fills bytes HUB_IDOFF
+ * onwards of its nonce, which would otherwise be random, with its peer
+ * id: the first HUB_IDBYTES of its public key. The rest of the nonce
+ * still makes it unique. The hub looks the id up in a hash table, and
+ * has at most one key to try.
+ *
+ * A hub with a TAP device is a learning switch: it remembers which port
+ * (the TAP device, or a peer) it saw each source MAC address on, and
+ * sends a frame for a known unicast address to that port only, even if
+ * it is from another peer. Other frames are flooded to every port but
+ * the one they came from. (A TUN hub sends everything from its peers to
+ * the TUN device, and everything from the TUN device to all its peers.)
+ * With --snoop, a multicast frame is sent only to the peers behind which
+ * some host has joined its group (see snoop.c), and with --group-key, a
+ * flooded frame is encrypted just once for all the peers that have the
+ * group key (see group.c). With --connect, the hub sends to each peer
+ * through a socket connected to it (see connect.c).
+ */
+
+#define HUB_FDB_PER_PEER 8
+#define HUB_FDB_MIN 1024
+
+
+/*
+ * Returns the peer id in the given nonce.
+ */
+
+static uint64_t nonce_id(const unsigned char *nonce)
+{
+    uint64_t id = 0;
+    int i;
+
+    for (i = HUB_IDOFF; i < HUB_IDOFF + HUB_IDBYTES; i++)
+        id = (id << 8) | nonce[i];
+
+    return id;
+}
+
+
+/*
+ * Returns the first slot at which to look for the given id. Public keys
+ * are random, but a spoke could pick its id, so we mix the bits anyway.
+ */
+
+static uint32_t slot_index(const struct hub *hub, uint64_t id)
+{
+    return (uint32_t) ((id * 0x9E3779B97F4A7C15ULL) >> 32) & hub->mask;
+}
+
+
+/*
+ * Returns 1 if the given directory entry names a public key file, or 0
+ * otherwise.
+ */
+
+static int is_key_file(const struct dirent *d)
+{
+    size_t len = strlen(d->d_name);
+
+    return d->d_name[0] != '.' && len > 4 &&
+        strcmp(d->d_name + len - 4, ".pub") == 0;
+}
+
+
+/*
+ * Returns the weight given to the peer whose public key is in the named
+ * file (or 1, if none was given).
+ */
+
+static int peer_weight(const struct options *opts, const char *file)
+{
+    size_t len = strlen(file) - 4;
+    int i;
+
+    for (i = 0; i < opts->nweights; i++) {
+        const char *name = opts->weight_names[i];
+
+        if (strcmp(name, file) == 0 ||
+            (strlen(name) == len && strncmp(name, file, len) == 0))
+            return opts->peer_weights[i];
+    }
+
+    return 1;
+}
+
+
+/*
+ * Adds the given peer (whose public key is pk, read from the file name)
+ * to the hub's table. Returns 0 on success, or prints an error and
+ * returns -1 if another peer has the same id.
+ */
+
+static int hub_insert(struct hub *hub, int n, const unsigned char *pk,
+                      const char *name)
+{
+    uint64_t id = 0;
+    uint32_t i;
+    int j;
+
+    for (j = 0; j < HUB_IDBYTES; j++)
+        id = (id << 8) | pk[j];
+
+    i = slot_index(hub, id);
+    for (; hub->table[i].peer; i = (i+1) & hub->mask) {
+        if (hub->table[i].id == id) {
+            fprintf(stderr, "The key in %s has the same id as another "
+                    "peer's\n", name);
+            return -1;
+        }
+    }
+
+    hub->table[i].id = id;
+    hub->table[i].peer = n + 1;
+
+    return 0;
+}
+
+
+/*
+ * Sets up the given hub for up to count peers, with no peers yet: the
+ * peers, the table with which hub_lookup() finds them, and everything
+ * else the hub keeps for each peer are allocated from an arena of their
+ * own. Returns 0 on success, or prints an error and returns -1 on
+ * failure.
+ */
+
+int hub_setup(struct worker *w, struct hub *hub, uint32_t count, int udp,
+              const unsigned char oursk[KEYBYTES], uint32_t nonce_prefix)
+{
+    const struct options *opts = w->opts;
+    size_t size;
+    uint32_t slots, macs;
+
+    memset(hub, 0, sizeof(*hub));
+    hub->udp = udp;
+    hub->epfd = -1;
+    hub->out = pool_get(&w->pool, BUF_UDP_TX);
+    w->hub = hub;
+
+    for (slots = 2; slots < 2 * count; slots *= 2)
+        ;
+
+    macs = HUB_FDB_PER_PEER * count;
+    if (macs < HUB_FDB_MIN)
+        macs = HUB_FDB_MIN;
+
+    size = count * (sizeof(struct peer) + 2 * sizeof(uint32_t)) +
+        slots * sizeof(struct hubslot) + keycache_size(count) +
+        4 * CACHELINE;
+    if (!opts->tun)
+        size += fdb_size(macs) + CACHELINE;
+    if (opts->group_key)
+        size += count * sizeof(uint32_t) + CACHELINE;
+    if (opts->snoop)
+        size += snoop_size(count);
+    if (opts->quantum)
+        size += drr_size(count);
+    if (opts->shortcuts)
+        size += count * sizeof(struct shortcut_watch) + CACHELINE;
+    if (arena_init(&hub->arena, size, opts->arena_flags, w->node) < 0)
+        return -1;
+
+    hub->peers = arena_alloc(&hub->arena, count * sizeof(struct peer));
+    hub->live = arena_alloc(&hub->arena, count * sizeof(uint32_t));
+    hub->pos = arena_alloc(&hub->arena, count * sizeof(uint32_t));
+    hub->table = arena_alloc(&hub->arena, slots * sizeof(struct hubslot));
+    memset(hub->peers, 0, count * sizeof(struct peer));
+    memset(hub->table, 0, slots * sizeof(struct hubslot));
+    hub->mask = slots - 1;
+
+    if (keycache_init(&hub->keys, &hub->arena, hub->peers, count,
+                      oursk) < 0)
+        return -1;
+
+    if (!opts->tun && fdb_init(&hub->fdb, &hub->arena, macs) < 0)
+        return -1;
+
+    if (opts->snoop && snoop_init(&hub->snoop, &hub->arena, count) < 0)
+        return -1;
+
+    if (opts->quantum &&
+        drr_init(w, &hub->drr, &hub->arena, udp, count) < 0)
+        return -1;
+
+    if (opts->shortcuts) {
+        size = count * sizeof(struct shortcut_watch);
+        hub->watch = arena_alloc(&hub->arena, size);
+        memset(hub->watch, 0, size);
+    }
+
+    if (opts->connect) {
+        hub->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (hub->epfd < 0) {
+            fprintf(stderr, "Couldn't create epoll instance: %s\n",
+                    strerror(errno));
+            return -1;
+        }
+    }
+
+    if (opts->group_key) {
+        hub->member = arena_alloc(&hub->arena, count * sizeof(uint32_t));
+        memset(hub->member, 0, count * sizeof(uint32_t));
+        if (group_init(w, &hub->group, nonce_prefix) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Adds a peer, whose public key is pk (read from the named file), to
+ * the hub, which must have room for it, with the given weight for fair
+ * queueing. Returns 0 on success, or prints an error and returns -1 on
+ * failure.
+ */
+
+int hub_add(struct hub *hub, const unsigned char pk[KEYBYTES],
+            const char *name, int weight, uint32_t nonce_prefix)
+{
+    int n = hub->npeers;
+    struct peer *peer = &hub->peers[n];
+
+    if (hub_insert(hub, n, pk, name) < 0)
+        return -1;
+
+    keycache_set(&hub->keys, n, pk);
+    if (hub->drr.queues)
+        hub->drr.queues[n].weight = weight;
+    generate_nonce(nonce_prefix, peer->ournonce);
+    wire_init(peer, 0);
+    timer_init(&peer->timer, TIMER_EXPIRE, peer);
+    peer->maxdgram = 1500-48;
+    peer->fd = -1;
+
+    hub->npeers++;
+    hub->keys.count = hub->npeers;
+
+    return 0;
+}
+
+
+/*
+ * Loads the public keys of the hub's peers from the given directory,
+ * and starts computing the key it shares with each in the background.
+ * Returns 0 on success, or prints an error and returns -1 on failure.
+ */
+
+int hub_init(struct worker *w, struct hub *hub, const char *dir, int udp,
+             const unsigned char oursk[KEYBYTES], uint32_t nonce_prefix)
+{
+    const struct options *opts = w->opts;
+    struct dirent *d;
+    DIR *dh;
+    int count;
+
+    dh = opendir(dir);
+    if (dh == NULL) {
+        fprintf(stderr, "Couldn't open peer directory %s: %s\n", dir,
+                strerror(errno));
+        return -1;
+    }
+
+    count = 0;
+    while ((d = readdir(dh)) != NULL) {
+        if (is_key_file(d))
+            count++;
+    }
+
+    if (count == 0) {
+        fprintf(stderr, "Found no peer keys (*.pub) in %s\n", dir);
+        closedir(dh);
+        return -1;
+    }
+
+    if (hub_setup(w, hub, count, udp, oursk, nonce_prefix) < 0) {
+        closedir(dh);
+        return -1;
+    }
+
+    /*
+     * The directory may have changed since we counted its keys, but we
+     * load no more than we have room for.
+     */
+
+    rewinddir(dh);
+    while (hub->npeers < count && (d = readdir(dh)) != NULL) {
+        unsigned char pk[KEYBYTES];
+        char name[PATH_MAX];
+
+        if (!is_key_file(d))
+            continue;
+
+        snprintf(name, sizeof(name), "%s/%s", dir, d->d_name);
+        if (read_key(name, pk) < 0 ||
+            hub_add(hub, pk, name, peer_weight(opts, d->d_name),
+                    nonce_prefix) < 0)
+        {
+            closedir(dh);
+            return -1;
+        }
+    }
+
+    closedir(dh);
+
+    return keycache_start(&hub->keys, opts->key_threads, w->cpu);
+}
+
+
+/*
+ * Writes our peer id into the given nonce, so that a hub can tell which
+ * of its peers we are.
+ */
+
+void hub_set_id(unsigned char nonce[NONCEBYTES],
+                const unsigned char oursk[KEYBYTES])
+{
+    unsigned char pk[KEYBYTES];
+
+    crypto_scalarmult_curve25519_base(pk, oursk);
+    memcpy(nonce + HUB_IDOFF, pk, HUB_IDBYTES);
+}
+
+
+/*
+ * Returns the peer whose id is in the given nonce, or NULL if there is
+ * none.
+ */
+
+struct peer *hub_find(const struct hub *hub, const unsigned char *nonce)
+{
+    uint64_t id = nonce_id(nonce);
+    uint32_t i;
+
+    i = slot_index(hub, id);
+    for (; hub->table[i].peer; i = (i+1) & hub->mask) {
+        if (hub->table[i].id == id)
+            return &hub->peers[hub->table[i].peer - 1];
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Returns the peer that sent the len-byte datagram at wire (judging by
+ * the peer id in its nonce), with its shared key ready, or NULL if it
+ * isn't one of ours.
+ */
+
+struct peer *hub_lookup(struct hub *hub, const unsigned char *wire,
+                        int len)
+{
+    struct peer *peer;
+
+    if (len < NONCEBYTES)
+        return NULL;
+
+    peer = hub_find(hub, wire);
+    if (peer == NULL) {
+        hub->stats.unknown++;
+        return NULL;
+    }
+
+    keycache_get(&hub->keys, peer - hub->peers);
+    return peer;
+}
+
+
+/*
+ * Takes note of an authenticated datagram from the given peer, which
+ * came from the given address: if we haven't heard from the peer
+ * before (or since we forgot it), frames are now sent to it too.
+ */
+
+void hub_received(struct worker *w, struct peer *peer,
+                  const struct sockaddr *addr, socklen_t addrlen)
+{
+    struct hub *hub = w->hub;
+    struct sockaddr *old = (struct sockaddr *) &peer->addr;
+    uint32_t n = peer - hub->peers;
+    int moved = 0;
+
+    /*
+     * Rather than rearm the peer's timer for every datagram, we note
+     * when we heard from it, and hub_expire() takes that into account.
+     */
+
+    peer->heard = w->wheel->tick;
+
+    if (old->sa_family == 0) {
+        hub->pos[n] = hub->active;
+        hub->live[hub->active++] = n;
+        timer_arm(w->wheel, &peer->timer,
+                  monotonic_usec() + HUB_EXPIRE_USEC);
+
+        /*
+         * With --connect, the peer gets a socket of its own (if we
+         * have a file descriptor to spare).
+         */
+
+        if (hub->epfd >= 0)
+            (void) conn_open(w, peer, hub->udp, hub->epfd);
+    }
+    else if (addrlen != peer->addrlen || memcmp(old, addr, addrlen) != 0) {
+        hub->stats.moved++;
+        moved = 1;
+    }
+
+    memcpy(old, addr, addrlen);
+    peer->addrlen = addrlen;
+    conn_update(w, peer, moved);
+}
+
+
+/*
+ * Called when the given peer's timer expires: forgets the peer if we
+ * haven't heard from it in HUB_EXPIRE_USEC, or otherwise rearms the
+ * timer for when we will have not.
+ */
+
+void hub_expire(struct worker *w, struct peer *peer)
+{
+    struct hub *hub = w->hub;
+    uint64_t heard = peer->heard * WHEEL_TICK_USEC;
+    uint32_t n = peer - hub->peers, last;
+
+    if (monotonic_usec() < heard + HUB_EXPIRE_USEC) {
+        timer_arm(w->wheel, &peer->timer, heard + HUB_EXPIRE_USEC);
+        return;
+    }
+
+    last = hub->live[--hub->active];
+    hub->live[hub->pos[n]] = last;
+    hub->pos[last] = hub->pos[n];
+
+    memset(&peer->addr, 0, sizeof(peer->addr));
+    conn_close(w, peer);
+    if (hub->member)
+        hub->member[n] = 0;
+    hub->stats.expired++;
+}
+
+
+/*
+ * Sends the len-byte frame at p to the given peer now. Returns 0 on
+ * success (or if the frame had to be dropped), 1 if the UDP socket has
+ * no room for it (with fair queueing, when the socket doesn't block),
+ * or -1 on failure.
+ */
+
+int hub_xmit(struct worker *w, struct peer *peer, const unsigned char *p,
+             int len)
+{
+    struct hub *hub = w->hub;
+    int n, off = w->opts->framed ? 1 : 0;
+
+    if (len + off > pktbuf_room(&w->pool))
+        return 0;
+
+    memcpy(hub->out->data + off, p, len);
+    len += off;
+    if (off)
+        hub->out->data[0] = MSG_FRAME;
+
+    if (w->opts->compress)
+        len = compress_message(w, &hub->out, len);
+
+    n = send_message(w, hub->udp, peer, &hub->out, len);
+    if (n == 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 1;
+
+    return n < 0 ? -1 : 0;
+}
+
+
+/*
+ * Sends the len-byte frame at p to the given peer, or queues it for the
+ * peer's turn, with fair queueing. Returns 0 on success, or -1 on
+ * failure.
+ */
+
+static int hub_send(struct worker *w, struct peer *peer,
+                    const unsigned char *p, int len)
+{
+    if (w->hub->drr.quantum)
+        return drr_send(w, peer, p, len);
+
+    return hub_xmit(w, peer, p, len) < 0 ? -1 : 0;
+}
+
+
+/*
+ * Sends the len-byte frame at p, which came from the given peer (or
+ * from the TAP device, if from is NULL), to wherever it is going: to
+ * the one port its destination was seen on, or to all ports but the
+ * one it came from. Returns 0 on success, or -1 on failure.
+ */
+
+int hub_switch(struct worker *w, int tap, struct peer *from,
+               const unsigned char *frame, int len)
+{
+    struct hub *hub = w->hub;
+    struct hub_stats *s = &hub->stats;
+    uint32_t src = from ? from - hub->peers + 1 : 0, now = 0;
+    const uint32_t *ports;
+    int i, n, dst = -1;
+
+    if (w->opts->tun) {
+        if (from)
+            dst = 0;
+    }
+    else if (len >= 14) {
+        now = monotonic_usec() / 1000000;
+
+        fdb_learn(&hub->fdb, frame + 6, src, now);
+        if (!(frame[0] & 1))
+            dst = fdb_lookup(&hub->fdb, frame, now);
+        else if (hub->snoop.members)
+            snoop_learn(&hub->snoop, frame, len, src, now);
+    }
+
+    if (dst == (int) src) {
+        s->filtered++;
+        return 0;
+    }
+
+    if (dst == 0) {
+        s->to_tap++;
+        return tap_write(tap, (unsigned char *) frame, len);
+    }
+
+    /*
+     * We may have forgotten the peer that an address was seen on.
+     */
+
+    if (dst > 0 && hub->peers[dst-1].addr.sa.sa_family == 0)
+        dst = -1;
+
+    if (dst > 0) {
+        s->to_peer++;
+        if (from && w->opts->shortcuts &&
+            shortcut_note(w, from, &hub->peers[dst-1], frame, len) < 0)
+            return -1;
+        return hub_send(w, &hub->peers[dst-1], frame, len);
+    }
+
+    /*
+     * A broadcast, multicast, or unknown destination could be anywhere.
+     */
+
+    s->flooded++;
+
+    if (from && tap_write(tap, (unsigned char *) frame, len) < 0)
+        return -1;
+
+    /*
+     * With snooping, a multicast frame goes only to the peers that
+     * want it (if we know who they are).
+     */
+
+    ports = hub->live;
+    n = hub->active;
+
+    if (hub->snoop.members && len >= 14 && (frame[0] & 1) &&
+        (i = snoop_ports(&hub->snoop, frame, now)) >= 0)
+    {
+        uint32_t *to = hub->snoop.ports;
+        int j;
+
+        for (j = 0, n = 0; j < i; j++) {
+            if (to[j] != 0 && to[j] != src &&
+                hub->peers[to[j]-1].addr.sa.sa_family != 0)
+                to[n++] = to[j] - 1;
+        }
+
+        hub->snoop.stats.saved += hub->active - (from != NULL) - n;
+        ports = to;
+    }
+
+    if (hub->member && group_flood(w, from, ports, n, frame, len) < 0)
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        struct peer *peer = &hub->peers[ports[i]];
+
+        if (peer == from || group_is_member(hub, peer))
+            continue;
+
+        if (hub_send(w, peer, frame, len) < 0)
+            return -1;
+        s->copies++;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Prints a one-line summary of the hub's peers and traffic to the given
+ * file.
+ */
+
+void hub_report(const struct hub *hub, FILE *f)
+{
+    const struct hub_stats *s = &hub->stats;
+
+    fprintf(f, "hub: %d of %d peers active, %lu datagrams received (%lu "
+            "from unknown peers, %lu rejected), %lu address changes, %lu "
+            "peers forgotten; frames switched: %lu to the TAP device, %lu "
+            "to one peer, %lu filtered, %lu flooded in %lu copies; %lu "
+            "shortcuts offered\n",
+            hub->active, hub->npeers, s->received, s->unknown, s->rejected,
+            s->moved, s->expired, s->to_tap, s->to_peer, s->filtered,
+            s->flooded, s->copies, s->shortcuts);
+    if (hub->fdb.table)
+        fdb_report(&hub->fdb, f);
+    if (hub->snoop.members)
+        snoop_report(&hub->snoop, f);
+    if (hub->drr.quantum)
+        drr_report(hub, f);
+    if (hub->member)
+        group_report(&hub->group, f);
+    keycache_report(&hub->keys, f);
+    arena_report(&hub->arena, "peer", f);
+}
@@ -0,0 +1,224 @@
+#include "tappet.h"
+
+#include <pthread.h>
+
+/*
+ * The shared keys of a hub's peers. Precomputing one takes a Curve25519
+ * scalar multiplication (tens of microseconds, even with the donna_c64
+ * implementation that NaCl picks on 64-bit CPUs), so doing all of them
+ * before serving anyone would delay a hub with a million peers by most
+ * of a minute. Instead, a pool of threads computes them in the
+ * background while the hub serves, and a datagram from a peer whose key
+ * isn't ready yet has it computed on the spot.
+ *
+ * Each key has a state byte: a thread (in the pool, or the hub itself)
+ * claims a pending key by setting it to KEY_BUSY, and publishes the key
+ * by setting it to KEY_READY. The peers' public keys and the states are
+ * kept apart from the peers, in arrays of 32 bytes and one byte per
+ * peer, so that the pool and a lookup touch as little memory as they
+ * can, and never write to anything the hub is using.
+ */
+
+#define KEY_PENDING 0
+#define KEY_BUSY 1
+#define KEY_READY 2
+
+#define KEY_PEERS_PER_THREAD 256
+
+
+/*
+ * Returns the number of bytes that keycache_init() will allocate for the
+ * given number of peers.
+ */
+
+size_t keycache_size(uint32_t count)
+{
+    return count * (KEYBYTES + 1) + 2 * CACHELINE;
+}
+
+
+/*
+ * Sets up the cache for the given peers, allocated from the given arena,
+ * with all their keys pending. Returns 0 on success, or prints an error
+ * and returns -1 on failure.
+ */
+
+int keycache_init(struct keycache *kc, struct arena *arena,
+                  struct peer *peers, uint32_t count,
+                  const unsigned char oursk[KEYBYTES])
+{
+    memset(kc, 0, sizeof(*kc));
+    kc->pk = arena_alloc(arena, count * KEYBYTES);
+    kc->state = arena_alloc(arena, count);
+    if (kc->pk == NULL || kc->state == NULL) {
+        fprintf(stderr, "Couldn't allocate key cache\n");
+        return -1;
+    }
+
+    memset(kc->state, KEY_PENDING, count);
+    memcpy(kc->sk, oursk, KEYBYTES);
+    kc->peers = peers;
+    kc->count = count;
+
+    return 0;
+}
+
+
+/*
+ * Records the public key of peer n.
+ */
+
+void keycache_set(struct keycache *kc, uint32_t n,
+                  const unsigned char pk[KEYBYTES])
+{
+    memcpy(kc->pk[n], pk, KEYBYTES);
+}
+
+
+/*
+ * Claims the key of peer n and computes it, unless another thread has
+ * claimed it first. Returns 1 if we computed it, or 0 otherwise.
+ */
+
+static int key_compute(struct keycache *kc, uint32_t n)
+{
+    uint8_t pending = KEY_PENDING;
+
+    if (!__atomic_compare_exchange_n(&kc->state[n], &pending, KEY_BUSY, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+
+    crypto_box_beforenm(kc->peers[n].k, kc->pk[n], kc->sk);
+    __atomic_store_n(&kc->state[n], KEY_READY, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+
+/*
+ * The body of each thread in the pool: computes keys in order until
+ * there are none left. The last thread to finish notes the time.
+ */
+
+static void *key_worker(void *arg)
+{
+    struct keycache *kc = arg;
+    uint32_t n;
+
+    while ((n = __atomic_fetch_add(&kc->next, 1, __ATOMIC_RELAXED)) <
+           kc->count)
+    {
+        if (key_compute(kc, n))
+            __atomic_add_fetch(&kc->pooled, 1, __ATOMIC_RELAXED);
+    }
+
+    if (__atomic_sub_fetch(&kc->running, 1, __ATOMIC_ACQ_REL) == 0)
+        __atomic_store_n(&kc->finished, monotonic_usec(), __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+
+/*
+ * Starts up to the given number of threads (or, if it is negative, one
+ * fewer than there are CPUs) computing keys in the background. They
+ * avoid the given CPU (where the hub runs), if it is not -1 and there
+ * are others. With no threads, every key is computed on first contact.
+ * Returns 0 on success, or prints an error and returns -1 on failure.
+ */
+
+int keycache_start(struct keycache *kc, int threads, int cpu)
+{
+    pthread_attr_t attr;
+    cpu_set_t set;
+    int i, err, max;
+
+    if (threads < 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+        if (threads < 1)
+            threads = 1;
+    }
+
+    max = (kc->count + KEY_PEERS_PER_THREAD - 1) / KEY_PEERS_PER_THREAD;
+    if (threads > max)
+        threads = max;
+
+    if (threads == 0)
+        return 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (cpu >= 0) {
+        CPU_ZERO(&set);
+        for (i = 0; i < sysconf(_SC_NPROCESSORS_ONLN); i++)
+            CPU_SET(i, &set);
+        CPU_CLR(cpu, &set);
+        if (CPU_COUNT(&set) > 0)
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+
+    kc->started = monotonic_usec();
+    kc->running = threads;
+
+    for (i = 0; i < threads; i++) {
+        pthread_t t;
+
+        err = pthread_create(&t, &attr, key_worker, kc);
+        if (err != 0) {
+            fprintf(stderr, "Couldn't start key thread: %s\n",
+                    strerror(err));
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+
+        kc->threads++;
+    }
+
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+
+/*
+ * Makes sure that the shared key of peer n is ready: computes it if no
+ * thread has started to, or waits for the thread that has.
+ */
+
+void keycache_get(struct keycache *kc, uint32_t n)
+{
+    if (__atomic_load_n(&kc->state[n], __ATOMIC_ACQUIRE) == KEY_READY)
+        return;
+
+    if (key_compute(kc, n)) {
+        kc->on_contact++;
+        return;
+    }
+
+    kc->waited++;
+    while (__atomic_load_n(&kc->state[n], __ATOMIC_ACQUIRE) != KEY_READY)
+        sched_yield();
+}
+
+
+/*
+ * Prints a one-line summary of how the keys were computed to the given
+ * file.
+ */
+
+void keycache_report(const struct keycache *kc, FILE *f)
+{
+    unsigned long pooled = __atomic_load_n(&kc->pooled, __ATOMIC_RELAXED);
+    uint64_t finished = __atomic_load_n(&kc->finished, __ATOMIC_ACQUIRE);
+
+    fprintf(f, "keys: %lu of %u shared keys computed, %lu by %d threads "
+            "(", pooled + kc->on_contact, kc->count, pooled, kc->threads);
+    if (finished)
+        fprintf(f, "done in %.2f s", (finished - kc->started) / 1e6);
+    else if (kc->threads)
+        fprintf(f, "still running");
+    else
+        fprintf(f, "none started");
+    fprintf(f, "), %lu on first contact, %lu waited for\n",
+            kc->on_contact, kc->waited);
+}
@@ -0,0 +1,448 @@
+#include "tappet.h"
+
+/*
+ * Messages are what we encrypt and send to a peer, and what we get
+ * back after decrypting a datagram from one. These functions are
+ * shared by the tunnel loop and everything that sends on its behalf.
+ */
+
+
+/*
+ * Returns the length of the largest message that we can send to the
+ * given peer in one datagram.
+ */
+
+int message_limit(const struct worker *w, const struct peer *peer)
+{
+    int limit = peer->maxdgram - peer->hdrmax - ZEROBYTES;
+
+    limit -= fec_overhead(peer);
+
+    if (limit > pktbuf_room(&w->pool))
+        limit = pktbuf_room(&w->pool);
+
+    return limit;
+}
+
+
+/*
+ * Sends the len-byte message at (*bp)->data to the given peer, as part
+ * of an FEC group if need be (though path MTU probes never are, since
+ * they are meant to be lost if they are too big). The buffer may be
+ * replaced if the kernel keeps it. Returns the same values as
+ * udp_write().
+ */
+
+int send_message(struct worker *w, int udp, struct peer *peer,
+                 struct pktbuf **bp, int len)
+{
+    if (peer->fec && (*bp)->data[0] != MSG_PROBE)
+        return fec_message(w, udp, peer, bp, len);
+
+    return seal_message(w, udp, peer, bp, len);
+}
+
+
+/*
+ * Encrypts the len-byte message at (*bp)->data for the given peer in
+ * place, and sends it with the appropriate wire header. The buffer may
+ * be replaced if the kernel keeps it. Returns the same values as
+ * udp_write().
+ */
+
+int seal_message(struct worker *w, int udp, struct peer *peer,
+                 struct pktbuf **bp, int len)
+{
+    struct sockaddr *addr = (struct sockaddr *) &peer->addr;
+    socklen_t addrlen = peer->addrlen;
+    struct sockaddr_storage flowaddr;
+    struct path *path;
+    int n;
+    unsigned char *pt = (*bp)->data - ZEROBYTES;
+
+    /*
+     * With a range of source ports, the message type tells us whether
+     * to send it through the port its flow picks.
+     */
+
+    if (peer->sports)
+        udp = sport_select(peer, *bp, udp, &flowaddr, &addr);
+
+    update_nonce(peer->ournonce);
+    memset(pt, 0, ZEROBYTES);
+
+    n = encrypt(peer->k, peer->ournonce, pt, len+ZEROBYTES, pt);
+    if (n < 0)
+        return n;
+
+    (*bp)->hdrlen = wire_header(peer, pt);
+    n += (*bp)->hdrlen;
+
+    if (peer->biggest_tried < n)
+        peer->biggest_tried = n;
+
+    /*
+     * A socket connected to the peer needs no address (and the kernel
+     * needn't look up the route to it).
+     */
+
+    if (peer->connected) {
+        udp = peer->fd;
+        addr = NULL;
+        addrlen = 0;
+    }
+
+    /*
+     * With multipath, the datagram goes through whichever path the
+     * scheduler chooses.
+     */
+
+    if (peer->mp && (path = mp_select(peer)) != NULL) {
+        udp = path->fd;
+        addr = (struct sockaddr *) &path->addr;
+        addrlen = path->addrlen;
+        path->tx_packets++;
+        path->tx_bytes += n;
+    }
+
+    errno = 0;
+    len = n;
+    n = send_datagram(w, udp, bp, len, addr, addrlen);
+
+    /*
+     * If the kernel knows that the datagram is too big for the path, it
+     * may be time to look for a smaller path MTU.
+     */
+
+    if (n == 0 && errno == EMSGSIZE && w->opts->pmtud)
+        pmtud_too_big(w, peer, len);
+
+    return n;
+}
+
+
+/*
+ * Sends the peer a keepalive that tells it the size of the biggest
+ * datagram we have received from it, using the given buffer. Returns 0
+ * on success, -1 on failure.
+ */
+
+int send_keepalive(struct worker *w, int udp, struct peer *peer,
+                   struct pktbuf **bp, uint16_t size)
+{
+    unsigned char *p = (*bp)->data;
+
+    p[0] = MSG_KEEPALIVE;
+    p[1] = size >> 8;
+    p[2] = size & 0xFF;
+
+    return send_message(w, udp, peer, bp, 3) < 0 ? -1 : 0;
+}
+
+
+/*
+ * Called when the peer's keepalive timer expires: sends a keepalive if
+ * we know where the peer is, and haven't sent it anything for
+ * KEEPALIVE_USEC (however much it has sent us). The counter in the last
+ * nonce we used says when we last did, so the timer need not be rearmed
+ * for every datagram; it is rearmed here instead, for KEEPALIVE_USEC
+ * after the last one. Returns 0 on success, -1 on failure.
+ */
+
+int keepalive_timer(struct worker *w, int udp, struct peer *peer,
+                    struct pktbuf **bp)
+{
+    uint64_t now = monotonic_usec();
+    uint64_t sent = nonce_counter(peer->ournonce) / 1000;
+
+    if (sent + KEEPALIVE_USEC <= now) {
+        if (peer->addr.sa.sa_family != 0 &&
+            send_keepalive(w, udp, peer, bp, peer->biggest_rcvd) < 0)
+            return -1;
+        sent = now;
+    }
+
+    timer_arm(w->wheel, &peer->timer, sent + KEEPALIVE_USEC);
+    return 0;
+}
+
+
+/*
+ * Sends the peer whatever acknowledgements are due for the messages we
+ * have received from it: that we have cached the constant part of its
+ * nonce for the session it announced, that its probe reached us, or
+ * which Ethernet headers it has defined (or that we have lost them),
+ * how many of its messages we are losing, that its pings reached us
+ * (through the path each of them took), or the hub's group key (or our
+ * acknowledgement of it). Returns 0 on success, -1 on failure.
+ */
+
+int send_replies(struct worker *w, int udp, struct peer *peer,
+                 struct pktbuf **bp)
+{
+    unsigned char *p = (*bp)->data;
+
+    if (peer->session.ack_due) {
+        peer->session.ack_due = 0;
+
+        p[0] = MSG_SESSION;
+        p[1] = peer->session.theirs;
+
+        if (send_message(w, udp, peer, bp, 2) < 0)
+            return -1;
+    }
+
+    if (peer->probe_ack_due) {
+        peer->probe_ack_due = 0;
+
+        p = (*bp)->data;
+        p[0] = MSG_PROBE_ACK;
+        p[1] = peer->probe_ack >> 8;
+        p[2] = peer->probe_ack;
+
+        if (send_message(w, udp, peer, bp, 3) < 0)
+            return -1;
+    }
+
+    if (peer->hdrs && peer->hdrs->ack_due) {
+        int len = elide_ack_message(peer, (*bp)->data);
+
+        if (send_message(w, udp, peer, bp, len) < 0)
+            return -1;
+    }
+
+    if (peer->fec && peer->fec->rx.loss_due) {
+        int len = fec_loss_message(peer, (*bp)->data);
+
+        if (send_message(w, udp, peer, bp, len) < 0)
+            return -1;
+    }
+
+    if (peer->mp && mp_send_pongs(w, udp, peer, bp) < 0)
+        return -1;
+
+    if (group_send_replies(w, udp, peer, bp) < 0)
+        return -1;
+
+    if (peer->hdrs && peer->hdrs->reset_due) {
+        peer->hdrs->reset_due = 0;
+
+        p = (*bp)->data;
+        p[0] = MSG_HDR_RESET;
+
+        if (send_message(w, udp, peer, bp, 1) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Returns 1 if the len-byte message at p could be an IPv4 or IPv6
+ * packet (which a keepalive, with its MSG_KEEPALIVE type byte, can
+ * never be), or 0 otherwise.
+ */
+
+static int is_ip_packet(const unsigned char *p, int len)
+{
+    switch (len > 0 ? p[0] >> 4 : 0) {
+    case 4:
+        return len >= 20;
+    case 6:
+        return len >= 40;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Writes the len-byte frame at p from the given peer to the TAP device,
+ * or, in a hub, sends it wherever it is going. Returns 0 on success, or
+ * -1 on failure.
+ */
+
+static int write_frame(struct worker *w, int tap, struct peer *peer,
+                       unsigned char *p, int len)
+{
+    if (w->hub)
+        return hub_switch(w, tap, peer, p, len);
+
+    return tap_write(tap, p, len);
+}
+
+
+/*
+ * Acts on the len-byte decrypted message at p from the given peer: an
+ * Ethernet frame is written to the TAP device (after decompression or
+ * restoring its header, if need be), a bundle is split into the
+ * messages it contains, a fragment is reassembled (and the message
+ * delivered once it is complete), a probe is acknowledged, a keepalive
+ * tells us how big a packet the peer has received from us, a session
+ * acknowledgement tells us that we can start sending compact headers,
+ * a header acknowledgement (or reset) tells us which headers we may
+ * elide, messages protected by FEC are delivered (along with any
+ * that their group's parity lets us rebuild), a path ping is answered,
+ * a hub's group key is learned (or a peer's acknowledgement of it
+ * noted), and a shortcut to another of the hub's peers is set up.
+ *
+ * Without framing, a message too short to be an Ethernet frame (or, in
+ * TUN mode, one that isn't an IP packet) is a keepalive, and anything
+ * else is a frame. In a hub, frames are switched rather than written to
+ * the TAP device. Returns 0 on success, or -1 on failure (but ignores
+ * malformed messages).
+ */
+
+int deliver(struct worker *w, int tap, struct peer *peer,
+            unsigned char *p, int len, int nested)
+{
+    int type;
+
+    if (!w->opts->framed) {
+        if (w->opts->tun ? is_ip_packet(p, len) : len >= 64-ZEROBYTES)
+            return write_frame(w, tap, peer, p, len);
+        if (len != 3 || *p != MSG_KEEPALIVE)
+            return 0;
+    }
+
+    if (len < 1)
+        return 0;
+
+    type = *p++;
+    len--;
+
+    switch (type) {
+    case MSG_FRAME:
+        return write_frame(w, tap, peer, p, len);
+
+    case MSG_FRAME | MSG_COMPRESSED:
+        if (w->lz == NULL || (len = decompress_frame(w, p, len)) < 0)
+            break;
+        return write_frame(w, tap, peer, w->lz->scratch, len);
+
+    case MSG_FRAME | MSG_ELIDED:
+        return elide_input(w, tap, peer, p, len);
+
+    case MSG_BUNDLE:
+        if (nested)
+            break;
+        while (len >= 2) {
+            int sublen = (p[0] << 8) | p[1];
+
+            if (sublen > len-2)
+                break;
+            if (deliver(w, tap, peer, p+2, sublen, 1) < 0)
+                return -1;
+            p += 2+sublen;
+            len -= 2+sublen;
+        }
+        break;
+
+    case MSG_FRAGMENT: {
+        unsigned char *msg;
+        int msglen;
+
+        if (nested)
+            break;
+        if (frag_input(w, peer, p, len, &msg, &msglen) == 1)
+            return deliver(w, tap, peer, msg, msglen, 1);
+        break;
+    }
+
+    case MSG_FEC:
+        if (nested)
+            break;
+        return fec_input(w, tap, peer, p, len);
+
+    case MSG_FEC_PARITY:
+        if (nested)
+            break;
+        return fec_parity(w, tap, peer, p, len);
+
+    case MSG_FEC_LOSS:
+        fec_loss(peer, p, len);
+        break;
+
+    case MSG_PATH_PING:
+        mp_ping(peer, p, len);
+        break;
+
+    case MSG_PATH_PONG:
+        mp_pong(peer, p, len);
+        break;
+
+    case MSG_GROUP_KEY:
+        group_learn(peer->group, p, len);
+        break;
+
+    case MSG_GROUP_ACK:
+        group_acked(w, peer, p, len);
+        break;
+
+    case MSG_SHORTCUT:
+        if (w->hub == NULL)
+            shortcut_offer(w, peer, p, len);
+        break;
+
+    case MSG_PROBE:
+        if (len >= 2) {
+            peer->probe_ack = (p[0] << 8) | p[1];
+            peer->probe_ack_due = 1;
+        }
+        break;
+
+    case MSG_PROBE_ACK:
+        if (len == 2 && w->opts->pmtud)
+            pmtud_ack(w, peer, (p[0] << 8) | p[1]);
+        break;
+
+    case MSG_SESSION:
+        if (len == 1 && peer->session.ours != 0 &&
+            p[0] == peer->session.ours)
+            peer->session.acked = 1;
+        break;
+
+    case MSG_HDR_ACK:
+        elide_ack(w, peer, p, len);
+        break;
+
+    case MSG_HDR_RESET:
+        elide_reset(w, peer);
+        break;
+
+    case MSG_KEEPALIVE:
+        if (len == 2) {
+            uint16_t size = (p[0] << 8) | p[1];
+
+            if (peer->biggest_sent < size)
+                peer->biggest_sent = size;
+        }
+        break;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Sends the datagram in the wire area of *bp through the AF_XDP socket
+ * if we have one and can use it, or else through the UDP socket (with
+ * MSG_ZEROCOPY, if enabled). The buffer may be replaced if the kernel
+ * keeps it. Returns the same values as udp_write().
+ */
+
+int send_datagram(struct worker *w, int udp, struct pktbuf **bp, int len,
+                  const struct sockaddr *addr, socklen_t addrlen)
+{
+    int n;
+
+    if (w->xdp) {
+        n = xdp_write(w->xdp, PKTBUF_WIRE(*bp), len, addr, addrlen);
+        if (n != -2)
+            return n;
+        w->xdp->tx_kernel++;
+    }
+
+    return zc_write(&w->zc, udp, &w->pool, bp, len, addr, addrlen);
+}
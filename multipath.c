@@ -0,0 +1,465 @@
+#include "tappet.h"
+
+/*
+ * Multipath: the client sends through one UDP socket per uplink (bound
+ * to a local address, or to an interface), all to the same server, and
+ * the server learns each of the client's paths from the source address
+ * of the datagrams it receives, and replies through all of them.
+ *
+ * Each side pings each of its paths every MP_PING_USEC, and the other
+ * side answers through the path the ping arrived on, which tells us the
+ * path's round-trip time, and (from the pings that go unanswered) its
+ * loss rate. A path we haven't heard from in MP_DEAD_USEC is down, and
+ * we send through it only if all paths are down. Datagrams are spread
+ * over the paths that are up, in proportion to their weights (using
+ * smooth weighted round-robin), or all sent through the path with the
+ * lowest round-trip time.
+ *
+ * Since paths have different latencies, datagrams will arrive out of
+ * order, so we check nonces against a replay window (see wire.c)
+ * rather than insisting that each be bigger than the last.
+ */
+
+#define MP_PING_USEC 200000
+#define MP_DEAD_USEC 3000000
+#define MP_RATE_USEC 1000000
+#define MP_PING_LEN (1+1+8)
+
+
+/*
+ * Opens a UDP socket for sending datagrams to the given server through
+ * the given local address or interface. Returns the socket on success,
+ * or prints an error and returns -1 on failure.
+ */
+
+static int path_socket(const char *local, const struct sockaddr *server)
+{
+    struct sockaddr_storage ss;
+    struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &ss;
+    socklen_t len;
+    int s, val;
+
+    s = socket(server->sa_family, SOCK_DGRAM, 0);
+    if (s < 0) {
+        fprintf(stderr, "Couldn't create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&ss, 0, sizeof(ss));
+    if (server->sa_family == AF_INET6 &&
+        inet_pton(AF_INET6, local, &sin6->sin6_addr) == 1)
+    {
+        sin6->sin6_family = AF_INET6;
+        len = sizeof(*sin6);
+    }
+    else if (server->sa_family == AF_INET &&
+             inet_pton(AF_INET, local, &sin->sin_addr) == 1)
+    {
+        sin->sin_family = AF_INET;
+        len = sizeof(*sin);
+    }
+    else {
+        len = 0;
+    }
+
+    /*
+     * If it isn't an address (of the right family), it must be the
+     * name of an interface.
+     */
+
+    if (len > 0 && bind(s, (struct sockaddr *) &ss, len) < 0) {
+        fprintf(stderr, "Can't bind socket to %s: %s\n", local,
+                strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    if (len == 0 && setsockopt(s, SOL_SOCKET, SO_BINDTODEVICE, local,
+                               strlen(local)+1) < 0)
+    {
+        fprintf(stderr, "Can't bind socket to interface %s: %s\n", local,
+                strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    val = IP_PMTUDISC_DO;
+    (void) setsockopt(s, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+
+    return s;
+}
+
+
+/*
+ * Sets up the given peer's paths: one for each local address or
+ * interface we were given (each with its own socket), or none for now
+ * if we are to learn them from the datagrams we receive on udp. Returns
+ * 0 on success, or prints an error and returns -1 on failure.
+ */
+
+int mp_init(struct worker *w, struct peer *peer, int udp,
+            const struct sockaddr *server, socklen_t srvlen)
+{
+    const struct options *opts = w->opts;
+    struct multipath *mp;
+    uint64_t now = monotonic_usec();
+    int i;
+
+    mp = arena_alloc(&w->arena, sizeof(struct multipath));
+    if (mp == NULL) {
+        fprintf(stderr, "Couldn't allocate multipath state\n");
+        return -1;
+    }
+
+    memset(mp, 0, sizeof(*mp));
+    mp->schedule = opts->schedule;
+    mp->udp = udp;
+    mp->force = -1;
+    mp->last_rate = now;
+    timer_init(&mp->ping, TIMER_PING, peer);
+    timer_arm(w->wheel, &mp->ping, now);
+
+    for (i = 0; i < opts->npaths; i++) {
+        struct path *p = &mp->paths[i];
+
+        p->fd = path_socket(opts->paths[i], server);
+        if (p->fd < 0)
+            return -1;
+
+        p->name = opts->paths[i];
+        p->weight = opts->weights[i];
+        memcpy(&p->addr, server, srvlen);
+        p->addrlen = srvlen;
+        p->last_rx = now;
+        p->up = 1;
+    }
+
+    mp->npaths = opts->npaths;
+    mp->learn = opts->npaths == 0;
+
+    peer->mp = mp;
+    return replay_init(w, peer);
+}
+
+
+/*
+ * Stores the file descriptors of the sockets that datagrams from the
+ * given peer may arrive on in fds (which has room for MP_PATHS), and
+ * returns their number.
+ */
+
+int mp_sockets(const struct peer *peer, int udp, int *fds)
+{
+    const struct multipath *mp = peer->mp;
+    int i;
+
+    if (mp == NULL || mp->learn) {
+        fds[0] = udp;
+        return 1;
+    }
+
+    for (i = 0; i < mp->npaths; i++)
+        fds[i] = mp->paths[i].fd;
+
+    return mp->npaths;
+}
+
+
+/*
+ * Takes note of a len-byte authenticated datagram from the given address
+ * on the socket fd, and remembers which of the peer's paths it arrived
+ * through (learning a new path if need be, in place of one that is down
+ * or has been quiet longest).
+ */
+
+void mp_received(struct peer *peer, int fd, const struct sockaddr *addr,
+                 socklen_t addrlen, int len)
+{
+    struct multipath *mp = peer->mp;
+    struct path *p = NULL;
+    int i;
+
+    for (i = 0; i < mp->npaths; i++) {
+        struct path *t = &mp->paths[i];
+
+        if (mp->learn ? t->addrlen == addrlen &&
+                        memcmp(&t->addr, addr, addrlen) == 0 : t->fd == fd)
+        {
+            p = t;
+            break;
+        }
+    }
+
+    if (p == NULL && !mp->learn) {
+        mp->rx_path = MP_PATHS;
+        return;
+    }
+
+    if (p == NULL) {
+        if (mp->npaths < MP_PATHS) {
+            i = mp->npaths++;
+        }
+        else {
+            int j;
+
+            for (i = 0, j = 1; j < MP_PATHS; j++) {
+                if (mp->paths[j].last_rx < mp->paths[i].last_rx)
+                    i = j;
+            }
+        }
+
+        p = &mp->paths[i];
+        memset(p, 0, sizeof(*p));
+        p->fd = mp->udp;
+        p->weight = 1;
+        memcpy(&p->addr, addr, addrlen);
+        p->addrlen = addrlen;
+        mp->learned++;
+    }
+
+    p->last_rx = monotonic_usec();
+    p->up = 1;
+    p->rx_packets++;
+    p->rx_bytes += len;
+    mp->rx_path = i;
+}
+
+
+/*
+ * Chooses the path through which to send the next datagram to the
+ * peer. Returns NULL if we don't know of any path yet.
+ */
+
+struct path *mp_select(struct peer *peer)
+{
+    struct multipath *mp = peer->mp;
+    struct path *best = NULL;
+    int i, any, total = 0;
+
+    if (mp->force >= 0) {
+        i = mp->force;
+        mp->force = -1;
+        if (i < mp->npaths)
+            return &mp->paths[i];
+    }
+
+    any = 1;
+    for (i = 0; i < mp->npaths; i++) {
+        if (mp->paths[i].up)
+            any = 0;
+    }
+
+    for (i = 0; i < mp->npaths; i++) {
+        struct path *p = &mp->paths[i];
+
+        if (!p->up && !any)
+            continue;
+
+        if (mp->schedule == MP_LATENCY) {
+            if (best == NULL || p->srtt < best->srtt)
+                best = p;
+        }
+        else {
+            p->credit += p->weight;
+            total += p->weight;
+            if (best == NULL || p->credit > best->credit)
+                best = p;
+        }
+    }
+
+    if (best && mp->schedule == MP_WEIGHTED)
+        best->credit -= total;
+
+    return best;
+}
+
+
+/*
+ * Pings each of the peer's paths, takes note of the pings that went
+ * unanswered, and updates the paths' states and rates. Returns 0 on
+ * success, or -1 on failure.
+ */
+
+int mp_timer(struct worker *w, int udp, struct peer *peer)
+{
+    struct multipath *mp = peer->mp;
+    uint64_t now = monotonic_usec();
+    int i;
+
+    timer_arm(w->wheel, &mp->ping, now + MP_PING_USEC);
+
+    for (i = 0; i < mp->npaths; i++) {
+        struct path *p = &mp->paths[i];
+        struct pktbuf *b;
+        int j, n;
+
+        p->up = now - p->last_rx < MP_DEAD_USEC;
+
+        /*
+         * The loss rate (in thousandths) is a moving average with a
+         * weight of 1/8 for each ping.
+         */
+
+        if (p->ping_stamp) {
+            p->loss += (1000 - p->loss) / 8;
+            p->ping_stamp = 0;
+        }
+
+        b = pool_get(&w->pool, BUF_UDP_TX);
+        if (b == NULL)
+            continue;
+
+        b->data[0] = MSG_PATH_PING;
+        b->data[1] = i;
+        for (j = 0; j < 8; j++)
+            b->data[2+j] = now >> (56 - 8*j);
+
+        p->ping_stamp = now;
+        p->pings++;
+
+        mp->force = i;
+        n = send_message(w, udp, peer, &b, MP_PING_LEN);
+        pool_put(&w->pool, b);
+        if (n < 0)
+            return -1;
+    }
+
+    if (now - mp->last_rate >= MP_RATE_USEC) {
+        uint64_t usec = now - mp->last_rate;
+
+        for (i = 0; i < mp->npaths; i++) {
+            struct path *p = &mp->paths[i];
+
+            p->tx_rate = (p->tx_bytes - p->tx_mark) * 1000000 / usec;
+            p->rx_rate = (p->rx_bytes - p->rx_mark) * 1000000 / usec;
+            p->tx_mark = p->tx_bytes;
+            p->rx_mark = p->rx_bytes;
+        }
+
+        mp->last_rate = now;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Takes note of a ping (in the len-byte body of a MSG_PATH_PING) that
+ * arrived through the path of the datagram we just received, so that
+ * we answer it through the same path.
+ */
+
+void mp_ping(struct peer *peer, const unsigned char *p, int len)
+{
+    struct multipath *mp = peer->mp;
+    struct path *path;
+
+    if (mp == NULL || len != MP_PING_LEN-1 || mp->rx_path >= mp->npaths)
+        return;
+
+    path = &mp->paths[mp->rx_path];
+    memcpy(path->pong, p, MP_PING_LEN-1);
+    path->pong_due = 1;
+}
+
+
+/*
+ * Takes note of the answer (in the len-byte body of a MSG_PATH_PONG) to
+ * one of our pings, and updates the smoothed round-trip time and loss
+ * rate of the path it was sent through.
+ */
+
+void mp_pong(struct peer *peer, const unsigned char *p, int len)
+{
+    struct multipath *mp = peer->mp;
+    struct path *path;
+    uint64_t stamp = 0, rtt;
+    int j;
+
+    if (mp == NULL || len != MP_PING_LEN-1 || p[0] >= mp->npaths)
+        return;
+
+    for (j = 0; j < 8; j++)
+        stamp = (stamp << 8) | p[1+j];
+
+    path = &mp->paths[p[0]];
+    if (path->ping_stamp == 0 || stamp != path->ping_stamp)
+        return;
+
+    rtt = monotonic_usec() - stamp;
+    path->srtt = path->srtt ? (7*path->srtt + rtt) / 8 : rtt;
+    path->loss -= path->loss / 8;
+    path->ping_stamp = 0;
+    path->pongs++;
+}
+
+
+/*
+ * Answers the pings that have arrived since we last did, each through
+ * the path it arrived on. Returns 0 on success, or -1 on failure.
+ */
+
+int mp_send_pongs(struct worker *w, int udp, struct peer *peer,
+                  struct pktbuf **bp)
+{
+    struct multipath *mp = peer->mp;
+    int i;
+
+    for (i = 0; i < mp->npaths; i++) {
+        struct path *p = &mp->paths[i];
+
+        if (!p->pong_due)
+            continue;
+
+        p->pong_due = 0;
+        (*bp)->data[0] = MSG_PATH_PONG;
+        memcpy((*bp)->data + 1, p->pong, MP_PING_LEN-1);
+
+        mp->force = i;
+        if (send_message(w, udp, peer, bp, MP_PING_LEN) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Prints a summary of each of the peer's paths, and of all of them
+ * together, to the given file.
+ */
+
+void mp_report(const struct peer *peer, FILE *f)
+{
+    const struct multipath *mp = peer->mp;
+    unsigned long tx = 0, rx = 0;
+    int i, up = 0;
+
+    for (i = 0; i < mp->npaths; i++) {
+        const struct path *p = &mp->paths[i];
+        char desc[128];
+
+        describe_sockaddr((const struct sockaddr *) &p->addr, desc,
+                          sizeof(desc) - 32);
+
+        fprintf(f, "path %d (%s%s%s): %s, weight %d, rtt %.1f ms, loss "
+                "%.1f%%, %lu pings; sent %lu datagrams (%lu bytes, %.2f "
+                "Mbit/s), received %lu (%lu bytes, %.2f Mbit/s)\n", i,
+                p->name ? p->name : "", p->name ? " to " : "from ", desc,
+                p->up ? "up" : "down", p->weight, p->srtt / 1000.0,
+                p->loss / 10.0, p->pings, p->tx_packets, p->tx_bytes,
+                p->tx_rate * 8 / 1e6, p->rx_packets, p->rx_bytes,
+                p->rx_rate * 8 / 1e6);
+
+        tx += p->tx_rate;
+        rx += p->rx_rate;
+        up += p->up;
+    }
+
+    fprintf(f, "multipath: %d of %d paths up (%lu learned), scheduled by "
+            "%s; %.2f Mbit/s sent and %.2f Mbit/s received in all; %lu "
+            "datagrams accepted out of order\n", up, mp->npaths,
+            mp->learned, mp->schedule == MP_LATENCY ? "latency" : "weight",
+            tx * 8 / 1e6, rx * 8 / 1e6, peer->replay->late);
+}
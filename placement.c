@@ -0,0 +1,296 @@
+#include "tappet.h"
+
+#include <dirent.h>
+#include <sys/syscall.h>
+
+/*
+ * Worker placement: each thread that moves packets is pinned to a set
+ * of CPUs, and the arena that holds its buffers is bound to the NUMA
+ * node those CPUs belong to, so that a frame is never read, encrypted,
+ * and sent by CPUs on different sockets, or from memory on the far
+ * side of the interconnect.
+ *
+ * We read the topology from sysfs and make the mbind() system call
+ * directly, rather than depending on libnuma.
+ */
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+#ifndef MPOL_MF_STRICT
+#define MPOL_MF_STRICT (1<<0)
+#define MPOL_MF_MOVE (1<<1)
+#endif
+
+
+/*
+ * Parses a list of CPUs in the kernel's cpulist format (e.g., "0-3,8")
+ * into the given set. Returns 0 on success, or -1 if the list cannot be
+ * parsed. Does not print any error message.
+ */
+
+int parse_cpulist(const char *s, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+
+    while (*s && *s != '\n') {
+        char *end;
+        long a, b;
+
+        a = strtol(s, &end, 10);
+        if (end == s || a < 0 || a >= CPU_SETSIZE)
+            return -1;
+
+        b = a;
+        s = end;
+        if (*s == '-') {
+            s++;
+            b = strtol(s, &end, 10);
+            if (end == s || b < a || b >= CPU_SETSIZE)
+                return -1;
+            s = end;
+        }
+
+        while (a <= b)
+            CPU_SET(a++, set);
+
+        if (*s == ',')
+            s++;
+        else if (*s && *s != '\n')
+            return -1;
+    }
+
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+
+/*
+ * Returns the NUMA node that the given CPU belongs to, or 0 if the
+ * system does not describe its topology (i.e., it is not NUMA).
+ */
+
+int cpu_node(int cpu)
+{
+    DIR *d;
+    struct dirent *e;
+    char path[64];
+    int node = 0;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    d = opendir(path);
+    if (d == NULL)
+        return 0;
+
+    while ((e = readdir(d)) != NULL) {
+        if (strncmp(e->d_name, "node", 4) == 0 &&
+            e->d_name[4] >= '0' && e->d_name[4] <= '9')
+        {
+            node = atoi(e->d_name + 4);
+            break;
+        }
+    }
+
+    (void) closedir(d);
+    return node;
+}
+
+
+/*
+ * Stores the CPUs that belong to the given NUMA node into the given
+ * set. If the topology is unknown, every CPU we may run on is taken to
+ * belong to node 0. Returns 0 on success, -1 on failure.
+ */
+
+int node_cpus(int node, cpu_set_t *set)
+{
+    FILE *f;
+    char path[64];
+    char line[1024];
+    int n = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    f = fopen(path, "r");
+    if (f == NULL) {
+        if (node != 0)
+            return -1;
+        return sched_getaffinity(0, sizeof(*set), set);
+    }
+
+    if (fgets(line, sizeof(line), f) != NULL)
+        n = parse_cpulist(line, set);
+
+    (void) fclose(f);
+    return n;
+}
+
+
+/*
+ * Binds the given memory to a NUMA node. The pages must not have been
+ * touched yet. Returns 0 on success, or prints a warning and returns -1
+ * on failure.
+ */
+
+int bind_memory(void *p, size_t len, int node)
+{
+    unsigned long mask;
+
+    if (node < 0 || node >= (int) (8*sizeof(mask)))
+        return -1;
+
+    mask = 1UL << node;
+    if (syscall(SYS_mbind, p, len, MPOL_BIND, &mask, 8*sizeof(mask)+1,
+                0) < 0)
+    {
+        fprintf(stderr, "Couldn't bind memory to node %d: %s\n", node,
+                strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Binds the given memory, which may already be in use, to a NUMA node,
+ * and moves its pages there. Returns 0 on success, or prints a warning
+ * and returns -1 if any page could not be moved.
+ */
+
+static int move_memory(void *p, size_t len, int node)
+{
+    unsigned long mask;
+
+    if (node < 0 || node >= (int) (8*sizeof(mask)))
+        return -1;
+
+    mask = 1UL << node;
+    if (syscall(SYS_mbind, p, len, MPOL_BIND, &mask, 8*sizeof(mask)+1,
+                MPOL_MF_MOVE|MPOL_MF_STRICT) < 0)
+    {
+        fprintf(stderr, "Couldn't move memory to node %d: %s\n", node,
+                strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Returns the CPU that last processed a packet received on the given
+ * socket, or -1 if the kernel cannot tell us.
+ */
+
+int udp_incoming_cpu(int udp)
+{
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+
+    if (getsockopt(udp, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0)
+        return -1;
+
+    return cpu;
+}
+
+
+/*
+ * Pins the calling thread to the given CPUs (or, if the set is empty,
+ * to the CPUs of the node it is running on now), and records where it
+ * ended up in the worker, along with the CPUs that worker_follow() may
+ * later move it to: the given ones, or any we may run on now. The
+ * worker's arena should be set up after this, so that it is allocated
+ * on the local node. Returns 0 on success, or prints an error and
+ * returns -1 on failure.
+ */
+
+int worker_place(struct worker *w, const cpu_set_t *cpus)
+{
+    cpu_set_t set;
+
+    if (CPU_COUNT(cpus) > 0)
+        memcpy(&w->allowed, cpus, sizeof(w->allowed));
+    else if (sched_getaffinity(0, sizeof(w->allowed), &w->allowed) < 0) {
+        fprintf(stderr, "Couldn't get CPU affinity: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (CPU_COUNT(cpus) > 0)
+        memcpy(&set, cpus, sizeof(set));
+    else if (node_cpus(cpu_node(sched_getcpu()), &set) < 0)
+        return -1;
+
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        fprintf(stderr, "Couldn't pin worker %d to CPUs: %s\n", w->id,
+                strerror(errno));
+        return -1;
+    }
+
+    memcpy(&w->cpus, &set, sizeof(set));
+    w->cpu = sched_getcpu();
+    w->node = cpu_node(w->cpu);
+
+    return 0;
+}
+
+
+/*
+ * Moves the calling thread to the CPUs, among those it may run on, that
+ * share a node with the CPU that is processing its socket's incoming
+ * packets, and moves its arena (and so its buffers and peer state) to
+ * that node too. If none of the CPUs are on that node, or the arena
+ * can't be moved, the thread stays where it is. Returns 0 on success
+ * (or if the thread stays), or -1 on failure.
+ */
+
+int worker_follow(struct worker *w, int rx_cpu)
+{
+    int i, node;
+    cpu_set_t cpus, set;
+
+    w->rx_cpu = rx_cpu;
+
+    node = cpu_node(rx_cpu);
+    if (node_cpus(node, &cpus) < 0)
+        return -1;
+
+    CPU_AND(&set, &cpus, &w->allowed);
+    if (CPU_COUNT(&set) == 0)
+        return 0;
+
+    i = sched_getcpu();
+    if (i >= 0 && CPU_ISSET(i, &set))
+        return 0;
+
+    if (w->arena.node >= 0 && w->arena.node != node) {
+        if (move_memory(w->arena.base, w->arena.size, node) < 0)
+            return 0;
+        w->arena.node = node;
+    }
+
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        fprintf(stderr, "Couldn't move worker %d to CPU %d's node: %s\n",
+                w->id, rx_cpu, strerror(errno));
+        return -1;
+    }
+
+    memcpy(&w->cpus, &set, sizeof(set));
+    w->cpu = sched_getcpu();
+    w->node = cpu_node(w->cpu);
+    w->migrations++;
+
+    return 0;
+}
+
+
+/*
+ * Prints a one-line summary of the worker's placement to the given
+ * file.
+ */
+
+void worker_report(const struct worker *w, FILE *f)
+{
+    fprintf(f, "worker %d: cpu %d (node %d), %d cpus allowed, "
+            "incoming cpu %d, %lu migrations\n", w->id, sched_getcpu(),
+            w->node, CPU_COUNT(&w->cpus), w->rx_cpu, w->migrations);
+}
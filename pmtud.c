@@ -0,0 +1,364 @@
+#include "tappet.h"
+
+/*
+ * Packetization-layer path MTU discovery (after RFC 8899): rather than
+ * trusting ICMP messages to reach us, we find out how big a datagram
+ * gets through to the peer by sending it padded, encrypted probes of
+ * different sizes, which it acknowledges. Until a size is confirmed,
+ * we send nothing bigger than PMTUD_BASE bytes (at the IP level).
+ *
+ * The search starts by probing the largest size the kernel thinks the
+ * path can take (IP_MTU on a socket connected to the peer, which takes
+ * into account any ICMP "fragmentation needed" messages the kernel has
+ * already acted on). If that gets through, we're done. Otherwise, we
+ * search between the largest confirmed size and the smallest size that
+ * failed until they are at most PMTUD_STEP bytes apart. A probe size
+ * fails if PMTUD_TRIES probes of that size all go unacknowledged, or at
+ * once if the kernel refuses to send it (EMSGSIZE).
+ *
+ * Once the search is complete, we probe again every PMTUD_RAISE_USEC
+ * to see if the path has grown, or at once if the peer's address
+ * changes. If a datagram that we thought would fit is refused by the
+ * kernel, we fall back to what the kernel now says is the path MTU.
+ *
+ * The confirmed size is what fragmentation and aggregation aim for,
+ * and we print the corresponding TAP MTU whenever it changes.
+ */
+
+#define PMTUD_BASE 1200
+#define PMTUD_STEP 8
+#define PMTUD_TRIES 3
+#define PMTUD_PROBE_USEC 500000
+#define PMTUD_RAISE_USEC (600*1000000ULL)
+
+#ifndef IP_MTU
+#define IP_MTU 14
+#endif
+
+
+/*
+ * Arranges for pmtud_timer() to be called after the given number of
+ * microseconds (or as soon as possible, if it is 0).
+ */
+
+static void pmtud_due(struct worker *w, struct peer *peer, uint64_t usec)
+{
+    timer_arm(w->wheel, &peer->pmtud->timer, monotonic_usec() + usec);
+}
+
+
+/*
+ * Returns the number of bytes of IP and UDP headers that precede our
+ * datagrams to the given peer.
+ */
+
+static int overhead(const struct peer *peer)
+{
+    const struct sockaddr *sa = (const struct sockaddr *) &peer->addr;
+
+    return sa->sa_family == AF_INET6 ? 40+8 : 20+8;
+}
+
+
+/*
+ * Returns the MTU that the kernel believes the path to the given
+ * address has, or -1 if it won't tell us.
+ */
+
+int route_mtu(const struct sockaddr *addr, socklen_t addrlen)
+{
+    int s, mtu = -1;
+    socklen_t len = sizeof(mtu);
+
+    s = socket(addr->sa_family, SOCK_DGRAM, 0);
+    if (s < 0)
+        return -1;
+
+    if (connect(s, addr, addrlen) < 0 ||
+        (addr->sa_family == AF_INET6 ?
+         getsockopt(s, IPPROTO_IPV6, IPV6_MTU, &mtu, &len) :
+         getsockopt(s, IPPROTO_IP, IP_MTU, &mtu, &len)) < 0)
+        mtu = -1;
+
+    (void) close(s);
+    return mtu;
+}
+
+
+/*
+ * Sets the largest datagram we will send to the peer, and reports the
+ * corresponding TAP MTU if it has changed.
+ */
+
+static void pmtud_set(struct worker *w, struct peer *peer, int size)
+{
+    struct pmtud *p = peer->pmtud;
+
+    peer->maxdgram = size;
+    if (p->state != PMTUD_DONE || p->reported == size)
+        return;
+
+    p->reported = size;
+    fprintf(stderr, "Path MTU to peer is %d bytes; set TAP MTU to at most "
+            "%d\n", size + overhead(peer), pmtud_tap_mtu(w, peer));
+}
+
+
+/*
+ * Returns the largest TAP MTU at which frames will fit into datagrams
+ * that we know will reach the peer. (A TUN device's packets have no
+ * Ethernet header.)
+ */
+
+int pmtud_tap_mtu(const struct worker *w, const struct peer *peer)
+{
+    return message_limit(w, peer) - 1 - (w->opts->tun ? 0 : 14);
+}
+
+
+/*
+ * Finds out what the kernel thinks of the path to the peer, and bounds
+ * the search by it (and by how much fits into a packet buffer).
+ */
+
+static void pmtud_ceiling(struct worker *w, struct peer *peer)
+{
+    struct pmtud *p = peer->pmtud;
+    int mtu, max;
+
+    mtu = route_mtu((struct sockaddr *) &peer->addr, peer->addrlen);
+    if (mtu < 0)
+        mtu = 1500;
+
+    max = peer->hdrmax + ZEROBYTES + pktbuf_room(&w->pool);
+    p->ceiling = mtu - overhead(peer);
+    if (p->ceiling > max)
+        p->ceiling = max;
+    if (p->ceiling < p->base)
+        p->ceiling = p->base;
+}
+
+
+/*
+ * Sets up the given peer's search state, allocated from the worker's
+ * arena. Returns 0 on success, or prints an error and returns -1 on
+ * failure.
+ */
+
+int pmtud_init(struct worker *w, struct peer *peer)
+{
+    struct pmtud *p;
+
+    p = arena_alloc(&w->arena, sizeof(struct pmtud));
+    if (p == NULL) {
+        fprintf(stderr, "Couldn't allocate path MTU discovery state\n");
+        return -1;
+    }
+
+    memset(p, 0, sizeof(*p));
+    timer_init(&p->timer, TIMER_PROBE, peer);
+    peer->pmtud = p;
+
+    return 0;
+}
+
+
+/*
+ * (Re)starts the search for the peer's path MTU from scratch, e.g., at
+ * startup, or when the peer's address has changed.
+ */
+
+void pmtud_start(struct worker *w, struct peer *peer)
+{
+    struct pmtud *p = peer->pmtud;
+
+    p->base = PMTUD_BASE - overhead(peer);
+    pmtud_ceiling(w, peer);
+
+    p->state = PMTUD_SEARCH;
+    p->lo = p->base;
+    p->hi = p->ceiling + 1;
+    p->probe = 0;
+    pmtud_due(w, peer, 0);
+    p->searches++;
+
+    pmtud_set(w, peer, p->lo);
+}
+
+
+/*
+ * Sends a probe of the given size. Returns 0 on success, or -1 on
+ * failure.
+ */
+
+static int pmtud_probe(struct worker *w, int udp, struct peer *peer,
+                       int size)
+{
+    struct pmtud *p = peer->pmtud;
+    struct pktbuf *b;
+    int n, len;
+
+    b = pool_get(&w->pool, BUF_UDP_TX);
+    if (b == NULL)
+        return 0;
+
+    if (size != p->probe) {
+        p->probe = size;
+        p->tries = 0;
+        p->id++;
+    }
+
+    p->tries++;
+    p->probes++;
+
+    len = size - peer->hdrmax - ZEROBYTES;
+    memset(b->data, 0, len);
+    b->data[0] = MSG_PROBE;
+    b->data[1] = p->id >> 8;
+    b->data[2] = p->id;
+
+    /*
+     * Probes always carry the full wire header, so that they are as big
+     * as the biggest datagram we might send.
+     */
+
+    peer->session.last_full = 0;
+
+    n = send_message(w, udp, peer, &b, len);
+    pool_put(&w->pool, b);
+
+    return n < 0 ? -1 : 0;
+}
+
+
+/*
+ * Decides what to do next, after a probe has succeeded or failed (or
+ * before the first one). Returns 0 on success, -1 on failure.
+ */
+
+static int pmtud_next(struct worker *w, int udp, struct peer *peer)
+{
+    struct pmtud *p = peer->pmtud;
+
+    p->probe = 0;
+
+    if (p->hi - p->lo <= PMTUD_STEP) {
+        p->state = PMTUD_DONE;
+        pmtud_due(w, peer, PMTUD_RAISE_USEC);
+        pmtud_set(w, peer, p->lo);
+        return 0;
+    }
+
+    pmtud_due(w, peer, PMTUD_PROBE_USEC);
+
+    if (p->hi > p->ceiling)
+        return pmtud_probe(w, udp, peer, p->ceiling);
+
+    return pmtud_probe(w, udp, peer, (p->lo + p->hi) / 2);
+}
+
+
+/*
+ * Does whatever is due: retransmits a probe, gives up on a probe size,
+ * or starts looking for a bigger path MTU. Returns 0 on success, or -1
+ * on failure.
+ */
+
+int pmtud_timer(struct worker *w, int udp, struct peer *peer)
+{
+    struct pmtud *p = peer->pmtud;
+
+    if (p->state == PMTUD_DONE) {
+        pmtud_ceiling(w, peer);
+        p->state = PMTUD_SEARCH;
+        p->hi = p->ceiling + 1;
+        p->searches++;
+        return pmtud_next(w, udp, peer);
+    }
+
+    if (p->probe == 0)
+        return pmtud_next(w, udp, peer);
+
+    if (p->tries < PMTUD_TRIES) {
+        pmtud_due(w, peer, PMTUD_PROBE_USEC);
+        return pmtud_probe(w, udp, peer, p->probe);
+    }
+
+    p->lost++;
+    p->hi = p->probe;
+    return pmtud_next(w, udp, peer);
+}
+
+
+/*
+ * Takes note of the peer's acknowledgement of the given probe.
+ */
+
+void pmtud_ack(struct worker *w, struct peer *peer, uint16_t id)
+{
+    struct pmtud *p = peer->pmtud;
+
+    if (p->state != PMTUD_SEARCH || p->probe == 0 || id != p->id)
+        return;
+
+    p->acks++;
+    p->lo = p->probe;
+    if (p->hi <= p->lo)
+        p->hi = p->lo + 1;
+
+    pmtud_set(w, peer, p->lo);
+
+    /*
+     * The next probe is sent from the tunnel loop, which calls
+     * pmtud_timer() when the probe timer expires.
+     */
+
+    p->probe = 0;
+    pmtud_due(w, peer, 0);
+}
+
+
+/*
+ * Takes note of the kernel's refusal to send a datagram of the given
+ * size to the peer because it is bigger than the path MTU it knows of.
+ */
+
+void pmtud_too_big(struct worker *w, struct peer *peer, int size)
+{
+    struct pmtud *p = peer->pmtud;
+
+    p->too_big++;
+    pmtud_ceiling(w, peer);
+
+    if (p->hi > size)
+        p->hi = size;
+    if (p->hi > p->ceiling + 1)
+        p->hi = p->ceiling + 1;
+    if (p->lo >= p->hi)
+        p->lo = p->hi - 1 > p->base ? p->hi - 1 : p->base;
+
+    if (p->probe >= size || peer->maxdgram >= size) {
+        p->state = PMTUD_SEARCH;
+        p->probe = 0;
+        pmtud_due(w, peer, 0);
+        pmtud_set(w, peer, p->lo);
+    }
+}
+
+
+/*
+ * Prints a one-line summary of path MTU discovery to the given file.
+ */
+
+void pmtud_report(const struct worker *w, const struct peer *peer,
+                  FILE *f)
+{
+    const struct pmtud *p = peer->pmtud;
+
+    fprintf(f, "pmtud: %s, %d-byte datagrams confirmed (ceiling %d, "
+            "TAP MTU %d), %lu searches, %lu probes, %lu acknowledged, "
+            "%lu sizes failed, %lu refused by the kernel\n",
+            p->state == PMTUD_DONE ? "complete" : "searching",
+            peer->maxdgram, p->ceiling, pmtud_tap_mtu(w, peer),
+            p->searches, p->probes, p->acks, p->lost, p->too_big);
+}
@@ -0,0 +1,150 @@
+#include "tappet.h"
+
+/*
+ * Packet buffers are fixed-size slabs carved out of one contiguous,
+ * cache-line-aligned allocation. Each slab reserves some headroom in
+ * front of the frame, so that the nonce and the crypto_box zero bytes
+ * can be prepended in place, and the whole datagram sent or received
+ * without copying the frame between plaintext and ciphertext buffers:
+ *
+ *     |<--------------- headroom --------------->|
+ *     [ ... | header | ZEROBYTES (tag after encryption) | frame ... ]
+ *                                                 ^ data
+ *
+ * The header is usually just the nonce, but its length is recorded in
+ * each buffer, because a compact header may be shorter.
+ *
+ * A buffer is owned by exactly one pipeline stage at a time. Taking a
+ * buffer from the pool or handing it to another stage records the new
+ * owner, and returning a buffer that is already free is reported as a
+ * bug rather than silently corrupting the free list.
+ */
+
+int pool_init(struct pktpool *pool, struct arena *arena, int count,
+              int size, int headroom)
+{
+    int i;
+    struct pktbuf *b;
+
+    headroom = (headroom + CACHELINE - 1) & ~(CACHELINE - 1);
+    size = (headroom + size + CACHELINE - 1) & ~(CACHELINE - 1);
+
+    if (headroom < WIRE_MAXHDR+ZEROBYTES) {
+        fprintf(stderr, "Packet buffer headroom must be at least %d bytes\n",
+                WIRE_MAXHDR+ZEROBYTES);
+        return -1;
+    }
+
+    pool->bufs = arena_alloc(arena, count * sizeof(struct pktbuf));
+    pool->slabs = arena_alloc(arena, (size_t) count * size);
+    if (pool->bufs == NULL || pool->slabs == NULL) {
+        fprintf(stderr, "Couldn't allocate %d packet buffers\n", count);
+        return -1;
+    }
+
+    pool->count = count;
+    pool->size = size;
+    pool->headroom = headroom;
+    pool->available = count;
+    pool->lowest = count;
+    pool->exhausted = 0;
+    pool->free = NULL;
+
+    i = count;
+    while (i-- > 0) {
+        b = &pool->bufs[i];
+        b->data = pool->slabs + (size_t) i * size + headroom;
+        b->len = 0;
+        b->hdrlen = NONCEBYTES;
+        b->owner = BUF_FREE;
+        b->next = pool->free;
+        pool->free = b;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Returns the number of bytes that pool_init() will allocate for the
+ * given number of buffers.
+ */
+
+size_t pool_size(int count, int size, int headroom)
+{
+    headroom = (headroom + CACHELINE - 1) & ~(CACHELINE - 1);
+    size = (headroom + size + CACHELINE - 1) & ~(CACHELINE - 1);
+
+    return (size_t) count * (size + sizeof(struct pktbuf)) + 2 * CACHELINE;
+}
+
+
+/*
+ * Takes a buffer from the pool on behalf of the given stage. Returns
+ * NULL if the pool is exhausted.
+ */
+
+struct pktbuf *pool_get(struct pktpool *pool, int owner)
+{
+    struct pktbuf *b;
+
+    b = pool->free;
+    if (b == NULL) {
+        pool->exhausted++;
+        return NULL;
+    }
+
+    pool->free = b->next;
+    pool->available--;
+    if (pool->lowest > pool->available)
+        pool->lowest = pool->available;
+
+    b->next = NULL;
+    b->len = 0;
+    b->hdrlen = NONCEBYTES;
+    b->owner = owner;
+    b->flow = 0;
+
+    return b;
+}
+
+
+/*
+ * Returns a buffer to the pool.
+ */
+
+void pool_put(struct pktpool *pool, struct pktbuf *b)
+{
+    if (b->owner == BUF_FREE) {
+        fprintf(stderr, "Packet buffer %p returned to pool twice\n",
+                (void *) b);
+        return;
+    }
+
+    b->owner = BUF_FREE;
+    b->next = pool->free;
+    pool->free = b;
+    pool->available++;
+}
+
+
+/*
+ * Returns the number of bytes that can be stored at b->data.
+ */
+
+int pktbuf_room(const struct pktpool *pool)
+{
+    return pool->size - pool->headroom;
+}
+
+
+/*
+ * Prints a one-line summary of buffer usage to the given file.
+ */
+
+void pool_report(const struct pktpool *pool, FILE *f)
+{
+    fprintf(f, "packet buffers: %d of %d free (lowest %d), %lu times "
+            "exhausted\n", pool->available, pool->count, pool->lowest,
+            pool->exhausted);
+}
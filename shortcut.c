@@ -0,0 +1,531 @@
+#include "tappet.h"
+
+/*
+ * Shortcuts between the spokes of a hub: a frame from one spoke to
+ * another is decrypted and encrypted again by the hub, and takes two
+ * trips across the network instead of one. When the hub sees a spoke
+ * sending a lot to another (SHORTCUT_BYTES in a second), it tells each
+ * of them about the other, under the key it shares with them:
+ *
+ *     [ MSG_SHORTCUT | public key (32) | port (2) | family (1) |
+ *       address (16) | MAC address (6) ]
+ *
+ * The address is the one the hub last heard the other spoke from, and
+ * the MAC address that of the host behind it that the frames were
+ * for (or from). Each spoke then sends keepalives straight to the
+ * other, which opens a path through any NAT that allows it, and once
+ * it hears from the other, it sends the frames for the hosts the hub
+ * has named straight there. (The source addresses of the frames that
+ * come through the shortcut are whatever the other spoke says, so we
+ * don't learn from them: that would let the other spoke claim any
+ * host, e.g., the gateway, and have its traffic sent there.)
+ *
+ * A spoke identifies the datagrams of a shortcut by the peer id in
+ * their nonces (see hub.c). A shortcut that doesn't come up within
+ * SHORTCUT_SETUP_USEC is given up, and one that goes quiet for
+ * SHORTCUT_DEAD_USEC falls back to the hub (while we keep trying it),
+ * until it comes back, or SHORTCUT_IDLE_USEC pass. If a shortcut can't
+ * be made, traffic goes through the hub as before, and the hub offers
+ * the shortcut again after SHORTCUT_RETRY_SEC.
+ */
+
+#define SHORTCUT_BYTES (64*1024)
+#define SHORTCUT_RETRY_SEC 30
+#define SHORTCUT_MSGLEN (1 + KEYBYTES + 2 + 1 + 16 + 6)
+
+#define SHORTCUT_PING_USEC 1000000ULL
+#define SHORTCUT_SETUP_USEC (10*1000000ULL)
+#define SHORTCUT_DEAD_USEC (3*1000000ULL)
+#define SHORTCUT_IDLE_USEC (30*1000000ULL)
+
+enum { SC_FREE, SC_PENDING, SC_UP, SC_DOWN };
+
+
+/*
+ * Sets up a spoke's (empty) set of shortcuts, allocated from its arena,
+ * to be offered only by the given peer (the hub). Returns 0 on success,
+ * or prints an error and returns -1 on failure.
+ */
+
+int shortcut_init(struct worker *w, const struct peer *hub,
+                  const unsigned char oursk[KEYBYTES], uint32_t nonce_prefix)
+{
+    struct shortcuts *s = arena_alloc(&w->arena, sizeof(struct shortcuts));
+
+    if (s == NULL) {
+        fprintf(stderr, "Couldn't allocate shortcut state\n");
+        return -1;
+    }
+
+    memset(s, 0, sizeof(*s));
+    s->hub = hub;
+    memcpy(s->sk, oursk, KEYBYTES);
+    s->prefix = nonce_prefix;
+    w->sc = s;
+
+    return 0;
+}
+
+
+/*
+ * Returns the peer id of the spoke with the given public key, as it
+ * appears in the spoke's nonces.
+ */
+
+static uint64_t spoke_id(const unsigned char *pk)
+{
+    uint64_t id;
+
+    memcpy(&id, pk, sizeof(id));
+    return id;
+}
+
+
+/*
+ * Writes the given address in the form a MSG_SHORTCUT message carries
+ * it (port, family, and 16 address bytes) at p.
+ */
+
+static void put_addr(unsigned char *p, const union peeraddr *pa)
+{
+    memset(p, 0, 19);
+
+    if (pa->sa.sa_family == AF_INET) {
+        memcpy(p, &pa->in.sin_port, 2);
+        p[2] = 4;
+        memcpy(p + 3, &pa->in.sin_addr, 4);
+    }
+    else if (pa->sa.sa_family == AF_INET6) {
+        memcpy(p, &pa->in6.sin6_port, 2);
+        p[2] = 6;
+        memcpy(p + 3, &pa->in6.sin6_addr, 16);
+    }
+}
+
+
+/*
+ * Reads an address written by put_addr(). Returns its length, or 0 if
+ * it isn't one.
+ */
+
+static socklen_t get_addr(const unsigned char *p, union peeraddr *pa)
+{
+    memset(pa, 0, sizeof(*pa));
+
+    if (p[2] == 4) {
+        pa->in.sin_family = AF_INET;
+        memcpy(&pa->in.sin_port, p, 2);
+        memcpy(&pa->in.sin_addr, p + 3, 4);
+        return sizeof(pa->in);
+    }
+
+    if (p[2] == 6) {
+        pa->in6.sin6_family = AF_INET6;
+        memcpy(&pa->in6.sin6_port, p, 2);
+        memcpy(&pa->in6.sin6_addr, p + 3, 16);
+        return sizeof(pa->in6);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Sends the given peer of the hub a MSG_SHORTCUT message about the
+ * other, naming the given MAC address. Returns 0 on success, or -1 on
+ * failure.
+ */
+
+static int offer(struct worker *w, struct peer *peer,
+                 const struct peer *other, const unsigned char *mac)
+{
+    struct hub *hub = w->hub;
+    unsigned char *p = hub->out->data;
+
+    p[0] = MSG_SHORTCUT;
+    memcpy(p + 1, hub->keys.pk[other - hub->peers], KEYBYTES);
+    put_addr(p + 1 + KEYBYTES, &other->addr);
+    memcpy(p + 1 + KEYBYTES + 19, mac, 6);
+
+    return send_message(w, hub->udp, peer, &hub->out, SHORTCUT_MSGLEN) < 0 ?
+        -1 : 0;
+}
+
+
+/*
+ * Called by a hub for each len-byte frame that it switches from one of
+ * its peers to another: offers them a shortcut if the first has been
+ * sending the second a lot. Returns 0 on success, or -1 on failure.
+ */
+
+int shortcut_note(struct worker *w, struct peer *from, struct peer *to,
+                  const unsigned char *frame, int len)
+{
+    struct hub *hub = w->hub;
+    struct shortcut_watch *sw = &hub->watch[from - hub->peers];
+    uint32_t n = to - hub->peers + 1;
+    uint32_t now = w->wheel->tick * WHEEL_TICK_USEC / 1000000;
+
+    if (sw->to != n || now != sw->since) {
+        sw->to = n;
+        sw->since = now;
+        sw->bytes = 0;
+    }
+
+    sw->bytes += len;
+    if (sw->bytes < SHORTCUT_BYTES ||
+        (sw->offered && now - sw->offered < SHORTCUT_RETRY_SEC))
+        return 0;
+
+    sw->offered = now ? now : 1;
+    hub->stats.shortcuts++;
+
+    if (offer(w, from, to, frame) < 0 || offer(w, to, from, frame + 6) < 0)
+        return -1;
+
+    return 0;
+}
+
+
+/*
+ * Returns 1 if the hub has named the given MAC address as one behind
+ * the given shortcut, or 0 otherwise.
+ */
+
+static int is_behind(const struct shortcut *sc, const unsigned char *mac)
+{
+    int i;
+
+    for (i = 0; i < sc->nmacs; i++) {
+        if (memcmp(sc->macs[i], mac, 6) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Adds the given MAC address, which the hub has named, to those behind
+ * the given shortcut (in place of the oldest, if it has as many as it
+ * can hold).
+ */
+
+static void learn(struct shortcut *sc, const unsigned char *mac)
+{
+    if ((mac[0] & 1) || is_behind(sc, mac))
+        return;
+
+    if (sc->nmacs < SHORTCUT_MACS) {
+        memcpy(sc->macs[sc->nmacs++], mac, 6);
+    } else {
+        memcpy(sc->macs[sc->oldest], mac, 6);
+        sc->oldest = (sc->oldest + 1) % SHORTCUT_MACS;
+    }
+}
+
+
+/*
+ * Takes note of a MSG_SHORTCUT message (the len-byte body at p) from
+ * the given peer: if that is the hub, sets up a shortcut to the spoke
+ * it names, or updates the one we have. (Anyone else could use it to
+ * divert traffic to itself.)
+ */
+
+void shortcut_offer(struct worker *w, const struct peer *from,
+                    const unsigned char *p, int len)
+{
+    struct shortcuts *s = w->sc;
+    struct shortcut *sc = NULL, *spare = NULL;
+    union peeraddr addr;
+    socklen_t addrlen;
+    uint64_t id, now = monotonic_usec();
+    int i;
+
+    if (s == NULL || from != s->hub || len != SHORTCUT_MSGLEN - 1)
+        return;
+
+    addrlen = get_addr(p + KEYBYTES, &addr);
+    if (addrlen == 0)
+        return;
+
+    s->stats.offers++;
+    id = spoke_id(p);
+
+    for (i = 0; i < SHORTCUT_MAX; i++) {
+        if (s->sc[i].state != SC_FREE && s->sc[i].id == id)
+            sc = &s->sc[i];
+        else if (s->sc[i].state == SC_FREE && spare == NULL)
+            spare = &s->sc[i];
+    }
+
+    if (sc == NULL && spare == NULL) {
+        s->stats.full++;
+        return;
+    }
+
+    /*
+     * A new shortcut's peer has a nonce with our id in it, like the
+     * one we use with the hub, and the key we share with the spoke.
+     */
+
+    if (sc == NULL) {
+        sc = spare;
+        memset(sc, 0, sizeof(*sc));
+        sc->id = id;
+        generate_nonce(s->prefix, sc->peer.ournonce);
+        hub_set_id(sc->peer.ournonce, s->sk);
+        crypto_box_beforenm(sc->peer.k, p, s->sk);
+        wire_init(&sc->peer, 0);
+        sc->peer.maxdgram = 1500-48;
+        sc->peer.fd = -1;
+        timer_init(&sc->peer.timer, TIMER_SHORTCUT, &sc->peer);
+        sc->state = SC_PENDING;
+        sc->since = now;
+    }
+    else if (sc->state != SC_UP) {
+        sc->state = SC_PENDING;
+        sc->since = now;
+    }
+
+    memcpy(&sc->peer.addr, &addr, addrlen);
+    sc->peer.addrlen = addrlen;
+    sc->used = now;
+    learn(sc, p + KEYBYTES + 19);
+
+    timer_arm(w->wheel, &sc->peer.timer, now);
+}
+
+
+/*
+ * Returns the shortcut that the datagram with the given nonce came
+ * through (judging by the peer id in it), or NULL if none did.
+ */
+
+struct shortcut *shortcut_find(struct shortcuts *s,
+                               const unsigned char *nonce)
+{
+    uint64_t id;
+    int i;
+
+    memcpy(&id, nonce + HUB_IDOFF, sizeof(id));
+
+    for (i = 0; i < SHORTCUT_MAX; i++) {
+        if (s->sc[i].state != SC_FREE && s->sc[i].id == id)
+            return &s->sc[i];
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Decrypts and delivers the datagram (of n bytes after the nonce) at
+ * wire, which came through the given shortcut from the given address.
+ * Returns 0 on success (or if the datagram was dropped), or -1 on
+ * failure.
+ */
+
+int shortcut_input(struct worker *w, int tap, struct shortcut *sc,
+                   unsigned char *wire, int n, const struct sockaddr *addr,
+                   socklen_t addrlen)
+{
+    struct shortcuts *s = w->sc;
+    unsigned char *ct = wire + NONCEBYTES;
+
+    if (!nonce_fresh(&sc->peer, wire))
+        return 0;
+
+    n = decrypt(sc->peer.k, wire, ct, n, ct);
+    if (n == -1)
+        return 0;
+    if (n < -2)
+        return -1;
+
+    nonce_accept(&sc->peer, wire);
+
+    /*
+     * We send to whichever address the spoke's datagrams come from,
+     * which may not be the one the hub saw.
+     */
+
+    memcpy(&sc->peer.addr, addr, addrlen);
+    sc->peer.addrlen = addrlen;
+    sc->heard = monotonic_usec();
+
+    if (sc->state != SC_UP) {
+        if (!sc->opened)
+            s->stats.opened++;
+        else
+            s->stats.recovered++;
+        sc->opened = 1;
+        sc->state = SC_UP;
+    }
+
+    n -= ZEROBYTES;
+    ct += ZEROBYTES;
+    if (n > 1 + 12 && ct[0] == MSG_FRAME) {
+        if (is_behind(sc, ct + 1 + 6))
+            sc->used = sc->heard;
+        sc->rx_frames++;
+        sc->rx_bytes += n - 1;
+    }
+
+    /*
+     * A spoke sends nothing but frames and keepalives through a
+     * shortcut, and we take nothing else from it.
+     */
+
+    if (n < 1 || (ct[0] != MSG_FRAME && ct[0] != (MSG_FRAME|MSG_COMPRESSED) &&
+                  ct[0] != MSG_KEEPALIVE))
+        return 0;
+
+    return deliver(w, tap, &sc->peer, ct, n, 0);
+}
+
+
+/*
+ * Returns the shortcut (that is up) to the spoke behind which the host
+ * with the destination MAC address of the given frame is, or NULL if
+ * there is none.
+ */
+
+struct shortcut *shortcut_route(struct shortcuts *s,
+                                const unsigned char *frame, int len)
+{
+    int i;
+
+    if (len < 14 || (frame[0] & 1))
+        return NULL;
+
+    for (i = 0; i < SHORTCUT_MAX; i++) {
+        struct shortcut *sc = &s->sc[i];
+
+        if (sc->state == SC_UP && is_behind(sc, frame))
+            return sc;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Sends the len-byte message at (*bp)->data (a frame) through the given
+ * shortcut. Returns 0 on success, or -1 on failure.
+ */
+
+int shortcut_send(struct worker *w, int udp, struct shortcut *sc,
+                  struct pktbuf **bp, int len)
+{
+    sc->used = monotonic_usec();
+    sc->tx_frames++;
+    sc->tx_bytes += len - 1;
+
+    return send_message(w, udp, &sc->peer, bp, len) < 0 ? -1 : 0;
+}
+
+
+/*
+ * Closes the given shortcut, keeping its counters.
+ */
+
+static void shortcut_close(struct worker *w, struct shortcut *sc)
+{
+    struct shortcuts *s = w->sc;
+
+    s->tx_frames += sc->tx_frames;
+    s->tx_bytes += sc->tx_bytes;
+    s->rx_frames += sc->rx_frames;
+    s->rx_bytes += sc->rx_bytes;
+
+    timer_cancel(w->wheel, &sc->peer.timer);
+    sc->state = SC_FREE;
+}
+
+
+/*
+ * Called when the timer of the given shortcut's peer expires: gives up
+ * on the shortcut, falls back to the hub, or closes it, if it's time
+ * to, or otherwise sends a keepalive through it. Returns 0 on success,
+ * or -1 on failure.
+ */
+
+int shortcut_timer(struct worker *w, int udp, struct peer *peer,
+                   struct pktbuf **bp)
+{
+    struct shortcuts *s = w->sc;
+    struct shortcut *sc = (struct shortcut *) peer;
+    uint64_t now = monotonic_usec();
+
+    if (sc->state == SC_PENDING && now - sc->since > SHORTCUT_SETUP_USEC) {
+        s->stats.failed++;
+        shortcut_close(w, sc);
+        return 0;
+    }
+
+    if (sc->state == SC_UP && now - sc->heard > SHORTCUT_DEAD_USEC) {
+        s->stats.fallbacks++;
+        sc->state = SC_DOWN;
+    }
+
+    if (now - sc->used > SHORTCUT_IDLE_USEC) {
+        s->stats.closed++;
+        shortcut_close(w, sc);
+        return 0;
+    }
+
+    timer_arm(w->wheel, &peer->timer, now + SHORTCUT_PING_USEC);
+
+    return send_keepalive(w, udp, peer, bp, peer->biggest_rcvd);
+}
+
+
+/*
+ * Prints a summary of the shortcuts to the given file: a line for all
+ * of them, and one for each that is open.
+ */
+
+void shortcut_report(const struct shortcuts *s, FILE *f)
+{
+    static const char *states[] = { "free", "setting up", "up", "down" };
+    const struct shortcut_stats *st = &s->stats;
+    unsigned long txf = s->tx_frames, txb = s->tx_bytes;
+    unsigned long rxf = s->rx_frames, rxb = s->rx_bytes;
+    int i;
+
+    /*
+     * A closed shortcut's counters have been added to the totals
+     * already (see shortcut_close()).
+     */
+
+    for (i = 0; i < SHORTCUT_MAX; i++) {
+        if (s->sc[i].state == SC_FREE)
+            continue;
+        txf += s->sc[i].tx_frames;
+        txb += s->sc[i].tx_bytes;
+        rxf += s->sc[i].rx_frames;
+        rxb += s->sc[i].rx_bytes;
+    }
+
+    fprintf(f, "shortcuts: %lu offered, %lu opened, %lu failed, %lu fell "
+            "back to the hub (%lu recovered), %lu closed, %lu not kept "
+            "(full); %lu frames (%lu bytes) sent and %lu frames (%lu "
+            "bytes) received through them\n", st->offers, st->opened,
+            st->failed, st->fallbacks, st->recovered, st->closed, st->full,
+            txf, txb, rxf, rxb);
+
+    for (i = 0; i < SHORTCUT_MAX; i++) {
+        const struct shortcut *sc = &s->sc[i];
+        char desc[64];
+
+        if (sc->state == SC_FREE)
+            continue;
+
+        describe_sockaddr((const struct sockaddr *) &sc->peer.addr, desc,
+                          sizeof(desc));
+        fprintf(f, "  shortcut to %s: %s, %d hosts, %lu frames (%lu "
+                "bytes) sent, %lu frames (%lu bytes) received\n", desc,
+                states[sc->state], sc->nmacs, sc->tx_frames, sc->tx_bytes,
+                sc->rx_frames, sc->rx_bytes);
+    }
+}
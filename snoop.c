@@ -0,0 +1,678 @@
+#include "tappet.h"
+
+/*
+ * IGMP and MLD snooping, for a hub that switches Ethernet frames: rather
+ * than flood every multicast frame to all its peers, the hub watches the
+ * membership reports that hosts send (IGMPv1/v2/v3 for IPv4, MLDv1/v2
+ * for IPv6) on each port, and sends a frame for a group only to the
+ * ports on which some host has asked for it, and to the ports on which
+ * a multicast router (one that sends queries) was seen.
+ *
+ * Groups are told apart by the MAC address that their frames are sent
+ * to, which is what the hub switches on anyway (up to 32 IPv4 groups
+ * share each such address, and a port that wants one of them gets them
+ * all). Frames for a group that no one has reported, and for the groups
+ * whose frames carry link-local control traffic (224.0.0.x, and IPv6
+ * groups such as ff02::1 whose addresses end in 00:00:00:xx), are
+ * flooded as before. A frame is always written to the TAP device, which
+ * costs no encryption, and where the kernel filters it anyway.
+ *
+ * A membership lasts SNOOP_MEMBER_SEC (the group membership interval of
+ * RFC 3376) unless it is reported again, and a router port lasts
+ * SNOOP_ROUTER_SEC. When a host leaves a group, its port's membership
+ * is cut short to SNOOP_LEAVE_SEC, in which other hosts behind the same
+ * port can answer the router's query for the group and keep it.
+ *
+ * The memberships are kept in a slab, on a doubly-linked list for each
+ * group, so that the members of a group can be found without looking at
+ * anyone else. Two open-addressed tables, like the forwarding table's,
+ * find a group's list, and a port's membership of a group.
+ */
+
+#define SNOOP_PER_PEER 4
+#define SNOOP_MIN 1024
+
+#define SNOOP_MEMBER_SEC 260
+#define SNOOP_ROUTER_SEC 255
+#define SNOOP_LEAVE_SEC 2
+
+#define SNOOP_NONE UINT32_MAX
+
+/*
+ * The router ports are kept as the members of a group whose key no MAC
+ * address has.
+ */
+
+#define SNOOP_ROUTERS 1
+
+#define IGMP_QUERY 0x11
+#define IGMP_V1_REPORT 0x12
+#define IGMP_V2_REPORT 0x16
+#define IGMP_LEAVE 0x17
+#define IGMP_V3_REPORT 0x22
+
+#define MLD_QUERY 130
+#define MLD_V1_REPORT 131
+#define MLD_DONE 132
+#define MLD_V2_REPORT 143
+
+/*
+ * Group record types (RFC 3376 and RFC 3810).
+ */
+
+#define MODE_IS_INCLUDE 1
+#define CHANGE_TO_INCLUDE 3
+#define BLOCK_OLD_SOURCES 6
+
+
+static uint64_t mac_key(const unsigned char *mac)
+{
+    return 1ULL << 48 | (uint64_t) mac[0] << 40 | (uint64_t) mac[1] << 32 |
+        (uint64_t) mac[2] << 24 | (uint64_t) mac[3] << 16 |
+        (uint64_t) mac[4] << 8 | mac[5];
+}
+
+
+static uint32_t hash(uint64_t key, uint32_t port, uint32_t mask)
+{
+    return (uint32_t) (((key ^ (uint64_t) port << 49) *
+                        0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+
+/*
+ * Returns the number of slots (a power of two) in a table for at least
+ * the given number of entries, which it is never more than half full
+ * of.
+ */
+
+static uint32_t snoop_slots(uint32_t entries)
+{
+    uint32_t slots;
+
+    for (slots = 64; slots < 2 * entries; slots *= 2)
+        ;
+
+    return slots;
+}
+
+
+/*
+ * Returns the number of memberships that a hub with the given number of
+ * peers keeps.
+ */
+
+static uint32_t snoop_entries(uint32_t peers)
+{
+    uint32_t entries = SNOOP_PER_PEER * peers;
+
+    return entries < SNOOP_MIN ? SNOOP_MIN : entries;
+}
+
+
+/*
+ * Returns the number of bytes that snoop_init() will allocate for a hub
+ * with the given number of peers.
+ */
+
+size_t snoop_size(uint32_t peers)
+{
+    uint32_t entries = snoop_entries(peers), slots = snoop_slots(entries);
+
+    return entries * sizeof(struct snoopmember) +
+        slots * (sizeof(struct snoopgroup) + sizeof(struct snoopindex)) +
+        (peers + 1) * sizeof(uint32_t) + 4 * CACHELINE;
+}
+
+
+/*
+ * Sets up empty tables for a hub with the given number of peers,
+ * allocated from the given arena. Returns 0 on success, or prints an
+ * error and returns -1 on failure.
+ */
+
+int snoop_init(struct snoop *sn, struct arena *arena, uint32_t peers)
+{
+    uint32_t entries = snoop_entries(peers), slots = snoop_slots(entries);
+    uint32_t i;
+
+    memset(sn, 0, sizeof(*sn));
+    sn->members = arena_alloc(arena, entries * sizeof(struct snoopmember));
+    sn->groups = arena_alloc(arena, slots * sizeof(struct snoopgroup));
+    sn->index = arena_alloc(arena, slots * sizeof(struct snoopindex));
+    sn->ports = arena_alloc(arena, (peers + 1) * sizeof(uint32_t));
+    if (sn->members == NULL || sn->groups == NULL || sn->index == NULL ||
+        sn->ports == NULL)
+    {
+        fprintf(stderr, "Couldn't allocate multicast snooping tables\n");
+        return -1;
+    }
+
+    memset(sn->groups, 0, slots * sizeof(struct snoopgroup));
+    memset(sn->index, 0, slots * sizeof(struct snoopindex));
+    sn->mask = slots - 1;
+    sn->capacity = entries;
+
+    for (i = 0; i < entries; i++) {
+        sn->members[i].port = SNOOP_NONE;
+        sn->members[i].next = i + 1 < entries ? i + 1 : SNOOP_NONE;
+    }
+    sn->free = 0;
+
+    return 0;
+}
+
+
+/*
+ * Returns the index of the given group's entry, or of the free slot
+ * where it would go.
+ */
+
+static uint32_t find_group(const struct snoop *sn, uint64_t key)
+{
+    uint32_t i = hash(key, 0, sn->mask);
+
+    while (sn->groups[i].key && sn->groups[i].key != key)
+        i = (i+1) & sn->mask;
+
+    return i;
+}
+
+
+/*
+ * Returns the index of the given port's membership of the given group
+ * in the index, or of the free slot where it would go.
+ */
+
+static uint32_t find_index(const struct snoop *sn, uint64_t key,
+                           uint32_t port)
+{
+    uint32_t i = hash(key, port, sn->mask);
+
+    while (sn->index[i].key &&
+           (sn->index[i].key != key || sn->index[i].port != port))
+        i = (i+1) & sn->mask;
+
+    return i;
+}
+
+
+/*
+ * Removes the given port's membership of the given group from the
+ * index, moving back any later entries that would otherwise no longer
+ * be found (as fdb_remove() does).
+ */
+
+static void unindex(struct snoop *sn, uint64_t key, uint32_t port)
+{
+    uint32_t i = find_index(sn, key, port), j = i;
+
+    while (1) {
+        uint32_t k;
+
+        j = (j+1) & sn->mask;
+        if (sn->index[j].key == 0)
+            break;
+
+        k = hash(sn->index[j].key, sn->index[j].port, sn->mask);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+
+        sn->index[i] = sn->index[j];
+        i = j;
+    }
+
+    memset(&sn->index[i], 0, sizeof(sn->index[i]));
+}
+
+
+/*
+ * Removes the entry of a group that has no members left.
+ */
+
+static void remove_group(struct snoop *sn, uint64_t key)
+{
+    uint32_t i = find_group(sn, key), j = i;
+
+    while (1) {
+        uint32_t k;
+
+        j = (j+1) & sn->mask;
+        if (sn->groups[j].key == 0)
+            break;
+
+        k = hash(sn->groups[j].key, 0, sn->mask);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+
+        sn->groups[i] = sn->groups[j];
+        i = j;
+    }
+
+    memset(&sn->groups[i], 0, sizeof(sn->groups[i]));
+    sn->ngroups--;
+}
+
+
+/*
+ * Adds the given port to the given group (or renews its membership),
+ * which lasts until the given time (in seconds). A group whose members
+ * we have no room for is flooded until it has none.
+ */
+
+static void join(struct snoop *sn, uint64_t key, uint32_t port,
+                 uint32_t expires)
+{
+    struct snoopgroup *g;
+    struct snoopmember *m;
+    uint32_t i, n;
+
+    i = find_index(sn, key, port);
+    if (sn->index[i].key) {
+        sn->members[sn->index[i].member].expires = expires;
+        return;
+    }
+
+    g = &sn->groups[find_group(sn, key)];
+    if (sn->free == SNOOP_NONE) {
+        if (g->key)
+            g->overflow = 1;
+        sn->stats.full++;
+        return;
+    }
+
+    if (g->key == 0) {
+        g->key = key;
+        g->head = SNOOP_NONE;
+        sn->ngroups++;
+    }
+
+    n = sn->free;
+    m = &sn->members[n];
+    sn->free = m->next;
+
+    m->port = port;
+    m->expires = expires;
+    m->key = key;
+    m->prev = SNOOP_NONE;
+    m->next = g->head;
+    if (g->head != SNOOP_NONE)
+        sn->members[g->head].prev = n;
+    g->head = n;
+    g->count++;
+
+    sn->index[i].key = key;
+    sn->index[i].port = port;
+    sn->index[i].member = n;
+    sn->count++;
+    sn->stats.joined++;
+}
+
+
+/*
+ * Cuts short the given port's membership of the given group, if it is
+ * a member.
+ */
+
+static void leave(struct snoop *sn, uint64_t key, uint32_t port,
+                  uint32_t now)
+{
+    uint32_t i = find_index(sn, key, port);
+    struct snoopmember *m;
+
+    if (sn->index[i].key == 0)
+        return;
+
+    m = &sn->members[sn->index[i].member];
+    if (m->expires > now + SNOOP_LEAVE_SEC)
+        m->expires = now + SNOOP_LEAVE_SEC;
+}
+
+
+/*
+ * Removes the membership at index n of the slab.
+ */
+
+static void drop_member(struct snoop *sn, uint32_t n)
+{
+    struct snoopmember *m = &sn->members[n];
+    struct snoopgroup *g = &sn->groups[find_group(sn, m->key)];
+
+    if (m->prev != SNOOP_NONE)
+        sn->members[m->prev].next = m->next;
+    else
+        g->head = m->next;
+    if (m->next != SNOOP_NONE)
+        sn->members[m->next].prev = m->prev;
+
+    unindex(sn, m->key, m->port);
+
+    if (--g->count == 0)
+        remove_group(sn, m->key);
+
+    m->port = SNOOP_NONE;
+    m->next = sn->free;
+    sn->free = n;
+    sn->count--;
+}
+
+
+/*
+ * Returns the key of the MAC address that frames for the given IPv4
+ * group are sent to, or 0 if it isn't a group we keep track of.
+ */
+
+static uint64_t ipv4_group(const unsigned char *addr)
+{
+    unsigned char mac[6] = { 0x01, 0x00, 0x5E };
+
+    if ((addr[0] & 0xF0) != 0xE0 ||
+        (addr[0] == 224 && addr[1] == 0 && addr[2] == 0))
+        return 0;
+
+    mac[3] = addr[1] & 0x7F;
+    mac[4] = addr[2];
+    mac[5] = addr[3];
+    return mac_key(mac);
+}
+
+
+/*
+ * Returns the key of the MAC address that frames for the given IPv6
+ * group are sent to, or 0 if it isn't a group we keep track of.
+ */
+
+static uint64_t ipv6_group(const unsigned char *addr)
+{
+    unsigned char mac[6] = { 0x33, 0x33 };
+
+    if (addr[0] != 0xFF)
+        return 0;
+
+    memcpy(mac + 2, addr + 12, 4);
+    if (mac[2] == 0 && mac[3] == 0 && mac[4] == 0)
+        return 0;
+
+    return mac_key(mac);
+}
+
+
+/*
+ * Takes note of the nrec group records (IGMPv3 or MLDv2) in the len
+ * bytes at p, whose group addresses are alen bytes long, from the given
+ * port.
+ */
+
+static void records(struct snoop *sn, const unsigned char *p, int len,
+                    int nrec, int alen, uint32_t port, uint32_t now)
+{
+    while (nrec-- > 0 && len >= 4 + alen) {
+        int type = p[0], nsrc = p[2] << 8 | p[3];
+        int size = 4 + alen + nsrc * alen + p[1] * 4;
+        uint64_t key = alen == 4 ? ipv4_group(p + 4) : ipv6_group(p + 4);
+
+        if (size > len)
+            break;
+
+        /*
+         * A host that wants only the given sources of a group (or none
+         * of them) has left the group if it names none.
+         */
+
+        if (key && (type == MODE_IS_INCLUDE || type == CHANGE_TO_INCLUDE ||
+                    type == BLOCK_OLD_SOURCES) && nsrc == 0)
+        {
+            leave(sn, key, port, now);
+            sn->stats.leaves++;
+        }
+        else if (key && type != BLOCK_OLD_SOURCES) {
+            join(sn, key, port, now + SNOOP_MEMBER_SEC);
+        }
+
+        p += size;
+        len -= size;
+    }
+}
+
+
+/*
+ * Takes note of the len-byte IGMP message at p, from the given port.
+ */
+
+static void igmp(struct snoop *sn, const unsigned char *p, int len,
+                 uint32_t port, uint32_t now)
+{
+    uint64_t key;
+
+    if (len < 8)
+        return;
+
+    switch (p[0]) {
+    case IGMP_QUERY:
+        join(sn, SNOOP_ROUTERS, port, now + SNOOP_ROUTER_SEC);
+        sn->stats.queries++;
+        break;
+
+    case IGMP_V1_REPORT:
+    case IGMP_V2_REPORT:
+        key = ipv4_group(p + 4);
+        if (key)
+            join(sn, key, port, now + SNOOP_MEMBER_SEC);
+        sn->stats.reports++;
+        break;
+
+    case IGMP_LEAVE:
+        key = ipv4_group(p + 4);
+        if (key)
+            leave(sn, key, port, now);
+        sn->stats.leaves++;
+        break;
+
+    case IGMP_V3_REPORT:
+        records(sn, p + 8, len - 8, p[6] << 8 | p[7], 4, port, now);
+        sn->stats.reports++;
+        break;
+    }
+}
+
+
+/*
+ * Takes note of the len-byte ICMPv6 message at p (which may be an MLD
+ * message), from the given port.
+ */
+
+static void mld(struct snoop *sn, const unsigned char *p, int len,
+                uint32_t port, uint32_t now)
+{
+    uint64_t key;
+
+    if (len < 8)
+        return;
+
+    switch (p[0]) {
+    case MLD_QUERY:
+        join(sn, SNOOP_ROUTERS, port, now + SNOOP_ROUTER_SEC);
+        sn->stats.queries++;
+        break;
+
+    case MLD_V1_REPORT:
+        if (len < 24)
+            return;
+        key = ipv6_group(p + 8);
+        if (key)
+            join(sn, key, port, now + SNOOP_MEMBER_SEC);
+        sn->stats.reports++;
+        break;
+
+    case MLD_DONE:
+        if (len < 24)
+            return;
+        key = ipv6_group(p + 8);
+        if (key)
+            leave(sn, key, port, now);
+        sn->stats.leaves++;
+        break;
+
+    case MLD_V2_REPORT:
+        records(sn, p + 8, len - 8, p[6] << 8 | p[7], 16, port, now);
+        sn->stats.reports++;
+        break;
+    }
+}
+
+
+/*
+ * Looks for an IGMP or MLD message in the len-byte multicast frame at p,
+ * which came from the given port at the given time (in seconds), and
+ * takes note of it.
+ */
+
+void snoop_learn(struct snoop *sn, const unsigned char *frame, int len,
+                 uint32_t port, uint32_t now)
+{
+    const unsigned char *p = frame + 14;
+    int type, hlen, next;
+
+    if (len < 14)
+        return;
+
+    len -= 14;
+    type = frame[12] << 8 | frame[13];
+    if (type == 0x8100 && len >= 4) {
+        type = p[2] << 8 | p[3];
+        p += 4;
+        len -= 4;
+    }
+
+    if (type == 0x0800 && len >= 20 && (p[0] >> 4) == 4 && p[9] == 2) {
+        hlen = (p[0] & 0x0F) * 4;
+        if ((p[6] & 0x3F) != 0 || p[7] != 0 || hlen < 20 || hlen > len)
+            return;
+        igmp(sn, p + hlen, len - hlen, port, now);
+    }
+
+    /*
+     * An MLD message follows a hop-by-hop options header (with the
+     * router alert option).
+     */
+
+    if (type == 0x86DD && len >= 40 && (p[0] >> 4) == 6) {
+        next = p[6];
+        p += 40;
+        len -= 40;
+
+        if (next == 0 && len >= 8) {
+            hlen = (p[1] + 1) * 8;
+            if (hlen > len)
+                return;
+            next = p[0];
+            p += hlen;
+            len -= hlen;
+        }
+
+        if (next == 58)
+            mld(sn, p, len, port, now);
+    }
+}
+
+
+/*
+ * Finds the ports to send the multicast frame at p to, given the time
+ * (in seconds): the members of its group, and the router ports. Returns
+ * how many there are, with their numbers in sn->ports, or -1 if the
+ * frame should be flooded to every port.
+ */
+
+int snoop_ports(struct snoop *sn, const unsigned char *frame,
+                uint32_t now)
+{
+    const struct snoopgroup *g, *r;
+    uint64_t key = mac_key(frame);
+    uint32_t n;
+    int count = 0;
+
+    if (frame[0] == 0x01 && frame[1] == 0x00 && frame[2] == 0x5E) {
+        if (frame[3] == 0 && frame[4] == 0)
+            return -1;
+    }
+    else if (frame[0] == 0x33 && frame[1] == 0x33) {
+        if (frame[2] == 0 && frame[3] == 0 && frame[4] == 0)
+            return -1;
+    }
+    else {
+        return -1;
+    }
+
+    g = &sn->groups[find_group(sn, key)];
+    if (g->key == 0 || g->overflow) {
+        sn->stats.flooded++;
+        return -1;
+    }
+
+    for (n = g->head; n != SNOOP_NONE; n = sn->members[n].next) {
+        if (sn->members[n].expires > now)
+            sn->ports[count++] = sn->members[n].port;
+    }
+
+    /*
+     * A router port that is also a member is on the list already.
+     */
+
+    r = &sn->groups[find_group(sn, SNOOP_ROUTERS)];
+    for (n = r->key ? r->head : SNOOP_NONE; n != SNOOP_NONE;
+         n = sn->members[n].next)
+    {
+        const struct snoopmember *m = &sn->members[n];
+        uint32_t i;
+
+        if (m->expires <= now)
+            continue;
+
+        i = find_index(sn, key, m->port);
+        if (sn->index[i].key == 0 ||
+            sn->members[sn->index[i].member].expires <= now)
+            sn->ports[count++] = m->port;
+    }
+
+    sn->stats.pruned++;
+    return count;
+}
+
+
+/*
+ * Removes the memberships that have expired by the given time (in
+ * microseconds). Called every few seconds, from the forwarding table's
+ * sweep.
+ */
+
+void snoop_sweep(struct snoop *sn, uint64_t now_usec)
+{
+    uint32_t n, now = now_usec / 1000000;
+
+    for (n = 0; n < sn->capacity && sn->count > 0; n++) {
+        if (sn->members[n].port != SNOOP_NONE &&
+            sn->members[n].expires <= now)
+        {
+            drop_member(sn, n);
+            sn->stats.aged++;
+        }
+    }
+}
+
+
+/*
+ * Prints a one-line summary of the snooping tables to the given file.
+ */
+
+void snoop_report(const struct snoop *sn, FILE *f)
+{
+    const struct snoop_stats *s = &sn->stats;
+
+    fprintf(f, "snooping: %u memberships of %u groups (room for %u), %lu "
+            "reports, %lu leaves, %lu queries seen, %lu joined, %lu aged "
+            "out, %lu not kept (full); %lu multicast frames sent to "
+            "members only (%lu copies saved), %lu unknown groups "
+            "flooded\n", sn->count, sn->ngroups, sn->capacity, s->reports,
+            s->leaves, s->queries, s->joined, s->aged, s->full, s->pruned,
+            s->saved, s->flooded);
+}
@@ -0,0 +1,246 @@
+#include "tappet.h"
+
+/*
+ * Source-port entropy: all of a tunnel's traffic shares one outer UDP
+ * 5-tuple, so routers hash it onto a single ECMP link, and the peer's
+ * NIC steers it (with RSS) to a single queue and CPU, no matter how
+ * many flows it carries. Instead, we send each message that carries a
+ * frame (or a bundle, fragment, or FEC message containing one) from a
+ * port in a range picked by a hash of the frame's flow, so that each
+ * inner flow keeps to its own link and queue (and its frames stay in
+ * order), while different flows are spread across them.
+ *
+ * The client binds a socket to each port in the range and sends from
+ * the one that the flow picks (and everything else from the first).
+ * The server, which has only one socket, sends to the port in the range
+ * that the flow picks instead, which spreads the traffic on the way
+ * back just as well. Both sides treat the peer's address as unchanged
+ * if only its port moves within the range. Since datagrams from
+ * different ports may be delivered out of order, nonces are checked
+ * against a replay window.
+ */
+
+
+/*
+ * Returns a pointer to the port number in the given address.
+ */
+
+static in_port_t *sock_port(const struct sockaddr *addr)
+{
+    if (addr->sa_family == AF_INET6)
+        return &((struct sockaddr_in6 *) addr)->sin6_port;
+
+    return &((struct sockaddr_in *) addr)->sin_port;
+}
+
+
+/*
+ * Returns 1 if the given port is in the peer's range, or 0 otherwise.
+ */
+
+static int in_range(const struct sports *sp, in_port_t port)
+{
+    int p = ntohs(port);
+
+    return p >= sp->lo && p < sp->lo + sp->n;
+}
+
+
+/*
+ * Binds the given socket to the given port on the wildcard address of
+ * the server's family. Returns 0 on success, or prints an error and
+ * returns -1 on failure.
+ */
+
+static int bind_port(int s, const struct sockaddr *server, int port)
+{
+    struct sockaddr_storage ss;
+    socklen_t len;
+
+    memset(&ss, 0, sizeof(ss));
+    ss.ss_family = server->sa_family;
+    if (server->sa_family == AF_INET6) {
+        ((struct sockaddr_in6 *) &ss)->sin6_addr = in6addr_any;
+        len = sizeof(struct sockaddr_in6);
+    }
+    else {
+        ((struct sockaddr_in *) &ss)->sin_addr.s_addr = htonl(INADDR_ANY);
+        len = sizeof(struct sockaddr_in);
+    }
+    *sock_port((struct sockaddr *) &ss) = htons(port);
+
+    if (bind(s, (struct sockaddr *) &ss, len) < 0) {
+        fprintf(stderr, "Can't bind socket to port %d: %s\n", port,
+                strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Sets up the given peer's port range. The client binds udp to the
+ * first port, and opens a socket bound to each of the others. Returns 0
+ * on success, or prints an error and returns -1 on failure.
+ */
+
+int sport_init(struct worker *w, struct peer *peer, int udp,
+               const struct sockaddr *server)
+{
+    const struct options *opts = w->opts;
+    struct sports *sp;
+    int i;
+
+    sp = arena_alloc(&w->arena, sizeof(struct sports));
+    if (sp == NULL) {
+        fprintf(stderr, "Couldn't allocate source port state\n");
+        return -1;
+    }
+
+    memset(sp, 0, sizeof(*sp));
+    sp->lo = opts->sport_lo;
+    sp->n = opts->sport_n;
+    sp->listen = opts->listen;
+    sp->fds[0] = udp;
+
+    if (!sp->listen) {
+        if (bind_port(udp, server, sp->lo) < 0)
+            return -1;
+
+        for (i = 1; i < sp->n; i++) {
+            int val = IP_PMTUDISC_DO;
+
+            sp->fds[i] = socket(server->sa_family, SOCK_DGRAM, 0);
+            if (sp->fds[i] < 0) {
+                fprintf(stderr, "Couldn't create socket: %s\n",
+                        strerror(errno));
+                return -1;
+            }
+
+            if (bind_port(sp->fds[i], server, sp->lo + i) < 0)
+                return -1;
+
+            (void) setsockopt(sp->fds[i], IPPROTO_IP, IP_MTU_DISCOVER,
+                              &val, sizeof(val));
+        }
+    }
+
+    peer->sports = sp;
+    return replay_init(w, peer);
+}
+
+
+/*
+ * Stores the file descriptors of the sockets that datagrams from the
+ * given peer may arrive on in fds (which has room for SPORT_MAX), and
+ * returns their number.
+ */
+
+int sport_sockets(const struct peer *peer, int udp, int *fds)
+{
+    const struct sports *sp = peer->sports;
+    int i;
+
+    if (sp->listen) {
+        fds[0] = udp;
+        return 1;
+    }
+
+    for (i = 0; i < sp->n; i++)
+        fds[i] = sp->fds[i];
+
+    return sp->n;
+}
+
+
+/*
+ * Decides which port the message in b should go through, before it is
+ * encrypted. Returns the socket to send it from. If it should be sent
+ * to a different port than the peer's, the address is written to ss,
+ * and *addr is pointed to it.
+ */
+
+int sport_select(struct peer *peer, const struct pktbuf *b, int udp,
+                 struct sockaddr_storage *ss, struct sockaddr **addr)
+{
+    struct sports *sp = peer->sports;
+    int type = b->data[0];
+    int i;
+
+    if (type > MSG_FRAGMENT && type != MSG_FEC) {
+        sp->control++;
+        return sp->listen ? udp : sp->fds[0];
+    }
+
+    i = b->flow % sp->n;
+    sp->sent[i]++;
+
+    if (!sp->listen)
+        return sp->fds[i];
+
+    /*
+     * If the client's port isn't in the range (e.g., because of NAT),
+     * we can't choose another.
+     */
+
+    if (in_range(sp, *sock_port(*addr))) {
+        memcpy(ss, *addr, peer->addrlen);
+        *sock_port((struct sockaddr *) ss) = htons(sp->lo + i);
+        *addr = (struct sockaddr *) ss;
+    }
+
+    return udp;
+}
+
+
+/*
+ * Returns 1 if the given address differs from the peer's only in that
+ * both have (possibly different) ports in the range, or 0 otherwise.
+ */
+
+int sport_same_peer(const struct peer *peer, const struct sockaddr *addr,
+                    socklen_t addrlen)
+{
+    const struct sockaddr *old = (const struct sockaddr *) &peer->addr;
+    const struct sports *sp = peer->sports;
+
+    if (addrlen != peer->addrlen || addr->sa_family != old->sa_family ||
+        !in_range(sp, *sock_port(addr)) || !in_range(sp, *sock_port(old)))
+        return 0;
+
+    if (addr->sa_family == AF_INET6)
+        return memcmp(&((struct sockaddr_in6 *) addr)->sin6_addr,
+                      &((struct sockaddr_in6 *) old)->sin6_addr,
+                      sizeof(struct in6_addr)) == 0;
+
+    return ((struct sockaddr_in *) addr)->sin_addr.s_addr ==
+        ((struct sockaddr_in *) old)->sin_addr.s_addr;
+}
+
+
+/*
+ * Prints a one-line summary of how messages were spread across ports
+ * to the given file.
+ */
+
+void sport_report(const struct peer *peer, FILE *f)
+{
+    const struct sports *sp = peer->sports;
+    unsigned long total = 0, busiest = 0;
+    int i, used = 0;
+
+    for (i = 0; i < sp->n; i++) {
+        total += sp->sent[i];
+        if (sp->sent[i] > 0)
+            used++;
+        if (sp->sent[i] > busiest)
+            busiest = sp->sent[i];
+    }
+
+    fprintf(f, "ports %d-%d: %lu messages spread over %d ports by flow "
+            "(busiest %.1f%%), %lu other messages; %lu datagrams accepted "
+            "out of order\n", sp->lo, sp->lo + sp->n - 1, total, used,
+            total ? 100.0 * busiest / total : 0.0, sp->control,
+            peer->replay->late);
+}
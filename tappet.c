@@ -5,36 +5,61 @@
 
 #include "tappet.h"
 
-int tunnel(int listen, const struct sockaddr *server, socklen_t srvlen,
-           int tap, int udp, uint32_t nonce_prefix,
+#include <signal.h>
+#include <sys/epoll.h>
+
+#define HUB_EVENTS 64
+
+int parse_options(int argc, char *argv[], int n, struct options *opts);
+int tunnel(const struct options *opts, const struct sockaddr *server,
+           socklen_t srvlen, int tap, int udp, uint32_t nonce_prefix,
            unsigned char oursk[KEYBYTES],
            unsigned char theirpk[KEYBYTES]);
-int send_keepalive(int listen, int udp, uint16_t size, const struct sockaddr *peer,
-                   socklen_t peerlen, unsigned char nonce[NONCEBYTES],
-                   unsigned char k[crypto_box_BEFORENMBYTES]);
+int hub_tunnel(const struct options *opts, int tap, int udp,
+               uint32_t nonce_prefix, unsigned char oursk[KEYBYTES],
+               const char *dir);
+void report_stats(const struct worker *w, const struct peer *peer);
+
+static volatile sig_atomic_t stats_requested;
+
+static void request_stats(int sig)
+{
+    stats_requested = 1;
+}
 
 int main(int argc, char *argv[])
 {
-    int n, tap, udp, listen;
+    int n, tap, udp;
     uint32_t nonce_prefix;
     unsigned char oursk[KEYBYTES];
     unsigned char theirpk[KEYBYTES];
     struct sockaddr *server;
     socklen_t srvlen;
+    struct options opts;
 
     setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
     setvbuf(stderr, NULL, _IOLBF, BUFSIZ);
 
     if (argc < 7) {
         fprintf(stderr, "Usage: tappet ifaceN nonce-file /our/privkey"
-                "/their/pubkey address port [-l]\n");
+                "/their/pubkey address port [-l] [options]\n");
         return -1;
     }
 
     /*
-     * The first argument is the name of a TAP interface, which must be
-     * created and configured beforehand. We want to attach to it as an
-     * ordinary user so that we can't create it by mistake.
+     * Anything after the six positional arguments is an option. We
+     * parse these first, because some of them affect how we treat the
+     * positional arguments (e.g., whether the keys are locked).
+     */
+
+    if (parse_options(argc, argv, 7, &opts) < 0)
+        return -1;
+
+    /*
+     * The first argument is the name of a TAP interface (or a TUN
+     * interface, with --tun), which must be created and configured
+     * beforehand. We want to attach to it as an ordinary user so that
+     * we can't create it by mistake.
      */
 
     if (geteuid() == 0) {
@@ -43,7 +68,7 @@ int main(int argc, char *argv[])
     }
 
     n = 1;
-    tap = tap_attach(argv[n]);
+    tap = tap_attach(argv[n], opts.tun);
     if (tap < 0)
         return -1;
 
@@ -60,14 +85,19 @@ int main(int argc, char *argv[])
     /*
      * Load our own secret key and the other side's public key from the
      * given files. We assume the keys were generated by tappet-keygen.
+     * If asked to, we make sure the secret key never reaches swap. (A
+     * hub loads its peers' keys from the given directory later.)
      */
 
+    if ((opts.arena_flags & ARENA_MLOCK) != 0)
+        (void) lock_memory(oursk, sizeof(oursk));
+
     n++;
     if (read_key(argv[n], oursk) < 0)
         return -1;
 
     n++;
-    if (read_key(argv[n], theirpk) < 0)
+    if (!(opts.hub && opts.listen) && read_key(argv[n], theirpk) < 0)
         return -1;
 
     /*
@@ -81,86 +111,787 @@ int main(int argc, char *argv[])
         return -1;
 
     /*
-     * If an optional -l is specified, we will listen for incoming
-     * packets on the given address:port.
+     * Now we create a UDP socket, and bind the server sockaddr to it if
+     * we are going to listen for incoming packets.
+     */
+
+    udp = udp_socket(opts.listen, server, srvlen, opts.connect);
+    if (udp < 0)
+        return -1;
+
+    /*
+     * Now we start the encrypted tunnel and let it run.
+     */
+
+    if (opts.hub && opts.listen)
+        return hub_tunnel(&opts, tap, udp, nonce_prefix, oursk, argv[4]);
+
+    return tunnel(&opts, server, srvlen, tap, udp, nonce_prefix,
+                  oursk, theirpk);
+}
+
+
+/*
+ * Parses the options that follow the positional arguments, starting at
+ * argv[n], into opts. Returns 0 on success, or prints an error and
+ * returns -1 on failure.
+ */
+
+int parse_options(int argc, char *argv[], int n, struct options *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->key_threads = -1;
+
+    while (n < argc) {
+        const char *opt = argv[n++];
+
+        /*
+         * If -l is specified, we will listen for incoming packets on
+         * the given address:port.
+         */
+
+        if (strcmp(opt, "-l") == 0)
+            opts->listen = 1;
+
+        /*
+         * --huge-pages backs packet buffers and peer state with huge
+         * pages, and --mlock locks them (and the secret key) into
+         * memory.
+         */
+
+        else if (strcmp(opt, "--huge-pages") == 0)
+            opts->arena_flags |= ARENA_HUGEPAGES;
+        else if (strcmp(opt, "--mlock") == 0)
+            opts->arena_flags |= ARENA_MLOCK;
+
+        /*
+         * --cpus pins the tunnel to the given CPUs (or, with "auto",
+         * to the CPUs of the node it starts on) and allocates its
+         * buffers on their node. --follow-rx-cpu moves it to the node
+         * of whichever CPU the kernel uses to receive its packets.
+         */
+
+        else if (strcmp(opt, "--cpus") == 0 && n < argc) {
+            const char *list = argv[n++];
+
+            opts->place = 1;
+            if (strcmp(list, "auto") == 0)
+                CPU_ZERO(&opts->cpus);
+            else if (parse_cpulist(list, &opts->cpus) < 0) {
+                fprintf(stderr, "Couldn't parse '%s' as a list of CPUs\n",
+                        list);
+                return -1;
+            }
+        }
+        else if (strcmp(opt, "--follow-rx-cpu") == 0) {
+            opts->place = 1;
+            opts->follow_rx_cpu = 1;
+        }
+
+        /*
+         * --zerocopy sends datagrams of at least the given size with
+         * MSG_ZEROCOPY.
+         */
+
+        else if (strcmp(opt, "--zerocopy") == 0 && n < argc) {
+            opts->zerocopy = atoi(argv[n++]);
+            if (opts->zerocopy <= 0) {
+                fprintf(stderr, "Couldn't parse '%s' as a size\n", argv[n-1]);
+                return -1;
+            }
+        }
+
+        /*
+         * --xdp sends and receives datagrams through an AF_XDP socket
+         * bound to the given queue of the given interface.
+         */
+
+        else if (strcmp(opt, "--xdp") == 0 && n < argc) {
+            char *colon = strrchr(argv[n], ':'), *end;
+            long queue = -1;
+
+            opts->xdp_ifname = argv[n++];
+            if (colon != NULL && colon != opts->xdp_ifname &&
+                colon[1] >= '0' && colon[1] <= '9')
+            {
+                errno = 0;
+                queue = strtol(colon+1, &end, 10);
+                if (*end != '\0' || errno != 0 || queue > 65535)
+                    queue = -1;
+            }
+            if (queue < 0) {
+                fprintf(stderr, "Expected interface:queue after --xdp\n");
+                return -1;
+            }
+            *colon = '\0';
+            opts->xdp_queue = queue;
+        }
+
+        /*
+         * --aggregate bundles frames together into as few datagrams as
+         * possible, holding them back for at most the given number of
+         * microseconds to wait for more.
+         */
+
+        else if (strcmp(opt, "--aggregate") == 0 && n < argc) {
+            const char *usec = argv[n++];
+            char *end;
+            long hold;
+
+            errno = 0;
+            hold = strtol(usec, &end, 10);
+            if (end == usec || *end != '\0' || errno != 0 || hold < 0 ||
+                hold > 1000000)
+            {
+                fprintf(stderr, "--aggregate must be from 0 to 1000000 "
+                        "microseconds\n");
+                return -1;
+            }
+
+            opts->aggregate = hold;
+            opts->aggregate_on = 1;
+            opts->framed = 1;
+        }
+
+        /*
+         * --compact-header sends only a session index and the counter
+         * part of the nonce once the peer knows the rest of it.
+         */
+
+        else if (strcmp(opt, "--compact-header") == 0) {
+            opts->compact = 1;
+            opts->framed = 1;
+        }
+
+        /*
+         * --fragment splits frames too big for the path into fragments
+         * that the peer reassembles, rather than dropping them.
+         */
+
+        else if (strcmp(opt, "--fragment") == 0) {
+            opts->fragment = 1;
+            opts->framed = 1;
+        }
+
+        /*
+         * --pmtud probes for the biggest datagram that reaches the
+         * peer, and sizes fragments and bundles to fit.
+         */
+
+        else if (strcmp(opt, "--pmtud") == 0) {
+            opts->pmtud = 1;
+            opts->framed = 1;
+        }
+
+        /*
+         * --compress compresses frames that are worth compressing.
+         */
+
+        else if (strcmp(opt, "--compress") == 0) {
+            opts->compress = 1;
+            opts->framed = 1;
+        }
+
+        /*
+         * --elide-headers replaces the Ethernet header of a frame with
+         * an index into a table of headers the peer already knows.
+         */
+
+        else if (strcmp(opt, "--elide-headers") == 0) {
+            opts->elide = 1;
+            opts->framed = 1;
+        }
+
+        /*
+         * --tun attaches to a TUN interface and carries bare IP packets
+         * rather than Ethernet frames.
+         */
+
+        else if (strcmp(opt, "--tun") == 0) {
+            opts->tun = 1;
+        }
+
+        /*
+         * --fec k:m follows every group of k messages with m parity
+         * messages, from which the peer can rebuild up to m that were
+         * lost. --fec-adapt sends between 1 and m of them, depending on
+         * the loss rate the peer reports.
+         */
+
+        else if (strcmp(opt, "--fec") == 0 && n < argc) {
+            if (sscanf(argv[n++], "%d:%d", &opts->fec_k, &opts->fec_m) != 2 ||
+                opts->fec_k < 1 || opts->fec_k > FEC_MAXK ||
+                opts->fec_m < 1 || opts->fec_m > FEC_MAXM)
+            {
+                fprintf(stderr, "Expected k:m (with k at most %d and m at "
+                        "most %d) after --fec\n", FEC_MAXK, FEC_MAXM);
+                return -1;
+            }
+            opts->framed = 1;
+        }
+
+        else if (strcmp(opt, "--fec-adapt") == 0) {
+            opts->fec_adapt = 1;
+        }
+
+        /*
+         * --path sends datagrams through each of the given local
+         * addresses (or interfaces), in proportion to their weights
+         * (1 by default). --multipath accepts datagrams from all of the
+         * client's paths and replies through each of them. --schedule
+         * latency sends everything through the path with the lowest
+         * round-trip time instead.
+         */
+
+        else if (strcmp(opt, "--path") == 0 && n < argc) {
+            char *comma = strchr(argv[n], ',');
+
+            if (opts->npaths == MP_PATHS) {
+                fprintf(stderr, "At most %d paths may be given\n",
+                        MP_PATHS);
+                return -1;
+            }
+
+            opts->weights[opts->npaths] = 1;
+            if (comma) {
+                *comma = '\0';
+                opts->weights[opts->npaths] = atoi(comma+1);
+                if (opts->weights[opts->npaths] < 1) {
+                    fprintf(stderr, "Expected a positive weight after "
+                            "'%s,'\n", argv[n]);
+                    return -1;
+                }
+            }
+
+            opts->paths[opts->npaths++] = argv[n++];
+            opts->multipath = 1;
+            opts->framed = 1;
+        }
+
+        else if (strcmp(opt, "--multipath") == 0) {
+            opts->multipath = 1;
+            opts->framed = 1;
+        }
+
+        else if (strcmp(opt, "--schedule") == 0 && n < argc) {
+            const char *sched = argv[n++];
+
+            if (strcmp(sched, "weighted") == 0) {
+                opts->schedule = MP_WEIGHTED;
+            }
+            else if (strcmp(sched, "latency") == 0) {
+                opts->schedule = MP_LATENCY;
+            }
+            else {
+                fprintf(stderr, "Expected weighted or latency after "
+                        "--schedule\n");
+                return -1;
+            }
+        }
+
+        /*
+         * --source-ports sends each inner flow from (or, on the server,
+         * to) its own port in the given range, so that the network can
+         * tell flows apart.
+         */
+
+        else if (strcmp(opt, "--source-ports") == 0 && n < argc) {
+            int lo, hi;
+            char c;
+
+            if (sscanf(argv[n], "%d-%d%c", &lo, &hi, &c) != 2 || lo < 1 ||
+                hi > 65535 || hi <= lo || hi - lo >= SPORT_MAX)
+            {
+                fprintf(stderr, "Expected a range of 2 to %d ports (e.g., "
+                        "40000-40015) after --source-ports\n", SPORT_MAX);
+                return -1;
+            }
+
+            opts->sport_lo = lo;
+            opts->sport_n = hi - lo + 1;
+            opts->framed = 1;
+            n++;
+        }
+
+        /*
+         * --hub -l serves every peer whose public key is in the
+         * directory given instead of the peer's public key. A client
+         * needs --hub to tell the hub which peer it is.
+         */
+
+        else if (strcmp(opt, "--hub") == 0) {
+            opts->hub = 1;
+        }
+
+        /*
+         * --key-threads n has a hub compute its peers' keys with n
+         * threads at startup (and the rest as they get in touch).
+         */
+
+        else if (strcmp(opt, "--key-threads") == 0 && n < argc) {
+            opts->key_threads = atoi(argv[n++]);
+            if (opts->key_threads < 0) {
+                fprintf(stderr, "--key-threads can't be negative\n");
+                return -1;
+            }
+        }
+
+        /*
+         * --group-key has a hub encrypt the frames it floods (such as
+         * broadcasts) once for all its peers, with a key it sends them,
+         * rather than once for each. The hub and its peers must all
+         * use it.
+         */
+
+        else if (strcmp(opt, "--group-key") == 0) {
+            opts->group_key = 1;
+            opts->framed = 1;
+        }
+
+        /*
+         * --snoop has a hub send multicast frames only to the peers
+         * behind which a host has joined the group (as IGMP and MLD
+         * reports tell it).
+         */
+
+        else if (strcmp(opt, "--snoop") == 0) {
+            opts->snoop = 1;
+        }
+
+        /*
+         * --shortcuts has a hub tell two of its peers about each other
+         * when one sends the other a lot, and has them send the frames
+         * for each other straight there. The hub and its peers must
+         * all use it.
+         */
+
+        else if (strcmp(opt, "--shortcuts") == 0) {
+            opts->shortcuts = 1;
+            opts->framed = 1;
+        }
+
+        /*
+         * --connect sends to the peer (or to each of a hub's peers)
+         * through a socket connected to it, so that the kernel needn't
+         * look up the route for every datagram.
+         */
+
+        else if (strcmp(opt, "--connect") == 0) {
+            opts->connect = 1;
+        }
+
+        /*
+         * --quantum n has a hub queue the frames for each peer when
+         * its socket has no room, and send from the queues in turn,
+         * n bytes at a time (times each peer's weight). --weight
+         * name,w gives the peer whose key is in the named file in the
+         * hub's directory a weight of w (1 by default).
+         */
+
+        else if (strcmp(opt, "--quantum") == 0 && n < argc) {
+            opts->quantum = atoi(argv[n++]);
+            if (opts->quantum < 64 || opts->quantum > 65536) {
+                fprintf(stderr, "--quantum must be from 64 to 65536 "
+                        "bytes\n");
+                return -1;
+            }
+        }
+
+        else if (strcmp(opt, "--weight") == 0 && n < argc) {
+            char *comma = strchr(argv[n], ',');
+            int weight = comma ? atoi(comma+1) : 0;
+
+            if (opts->nweights == HUB_WEIGHTS) {
+                fprintf(stderr, "At most %d weights may be given\n",
+                        HUB_WEIGHTS);
+                return -1;
+            }
+
+            if (weight < 1 || weight > 1000) {
+                fprintf(stderr, "Expected a weight from 1 to 1000 after "
+                        "'%s,'\n", argv[n]);
+                return -1;
+            }
+
+            *comma = '\0';
+            opts->weight_names[opts->nweights] = argv[n++];
+            opts->peer_weights[opts->nweights++] = weight;
+        }
+
+        else {
+            fprintf(stderr, "Unknown option: %s\n", opt);
+            return -1;
+        }
+    }
+
+    if (opts->fec_adapt && opts->fec_k == 0) {
+        fprintf(stderr, "--fec-adapt needs --fec\n");
+        return -1;
+    }
+
+    if (opts->npaths > 0 && opts->listen) {
+        fprintf(stderr, "--path is for the client; the server learns "
+                "the client's paths with --multipath\n");
+        return -1;
+    }
+
+    /*
+     * Some things assume a single path, with datagrams arriving in the
+     * order they were sent.
+     */
+
+    if (opts->multipath &&
+        (opts->pmtud || opts->elide || opts->fec_k || opts->zerocopy ||
+         opts->xdp_ifname))
+    {
+        fprintf(stderr, "--pmtud, --elide-headers, --fec, --zerocopy, and "
+                "--xdp can't be used with multipath\n");
+        return -1;
+    }
+
+    if (opts->sport_n &&
+        (opts->multipath || opts->elide || opts->fec_k || opts->zerocopy ||
+         opts->xdp_ifname))
+    {
+        fprintf(stderr, "--multipath, --elide-headers, --fec, --zerocopy, "
+                "and --xdp can't be used with --source-ports\n");
+        return -1;
+    }
+
+    if (opts->group_key && !opts->hub) {
+        fprintf(stderr, "--group-key needs --hub\n");
+        return -1;
+    }
+
+    if ((opts->quantum || opts->nweights) && !(opts->hub && opts->listen)) {
+        fprintf(stderr, "--quantum and --weight are for a hub (-l --hub)\n");
+        return -1;
+    }
+
+    if (opts->nweights && !opts->quantum) {
+        fprintf(stderr, "--weight needs --quantum\n");
+        return -1;
+    }
+
+    if (opts->shortcuts && (!opts->hub || opts->tun)) {
+        fprintf(stderr, "--shortcuts needs --hub, and can't be used with "
+                "--tun\n");
+        return -1;
+    }
+
+    if (opts->shortcuts && !opts->listen &&
+        (opts->multipath || opts->sport_n || opts->xdp_ifname))
+    {
+        fprintf(stderr, "--shortcuts can't be used with --path, "
+                "--source-ports, or --xdp\n");
+        return -1;
+    }
+
+    if (opts->connect &&
+        (opts->multipath || opts->sport_n || opts->zerocopy ||
+         opts->xdp_ifname))
+    {
+        fprintf(stderr, "--connect can't be used with --path, "
+                "--source-ports, --zerocopy, or --xdp\n");
+        return -1;
+    }
+
+    if (opts->connect && opts->quantum) {
+        fprintf(stderr, "--connect can't be used with --quantum, which "
+                "needs every datagram to go through one socket\n");
+        return -1;
+    }
+
+    if (opts->snoop && (!opts->hub || !opts->listen || opts->tun)) {
+        fprintf(stderr, "--snoop is for a hub (-l --hub) with a TAP "
+                "device\n");
+        return -1;
+    }
+
+    if (opts->hub && opts->compact) {
+        fprintf(stderr, "--compact-header can't be used with --hub, "
+                "which needs the full nonce to find the peer\n");
+        return -1;
+    }
+
+    if (opts->hub && opts->listen &&
+        (opts->aggregate_on || opts->fragment || opts->pmtud ||
+         opts->elide || opts->fec_k || opts->multipath || opts->sport_n ||
+         opts->xdp_ifname))
+    {
+        fprintf(stderr, "A hub can't use --aggregate, --fragment, --pmtud, "
+                "--elide-headers, --fec, --multipath, --source-ports, or "
+                "--xdp\n");
+        return -1;
+    }
+
+    /*
+     * A hub keeps no reassembly, header, FEC, or path state for its
+     * clients (nor a window of recent nonces), so it would drop what a
+     * client sent with these, or take each change of port or path for
+     * the client moving.
+     */
+
+    if (opts->hub && !opts->listen &&
+        (opts->fragment || opts->elide || opts->fec_k || opts->multipath ||
+         opts->sport_n))
+    {
+        fprintf(stderr, "A hub's client can't use --fragment, "
+                "--elide-headers, --fec, --path, or --source-ports\n");
+        return -1;
+    }
+
+    if (opts->tun && opts->elide) {
+        fprintf(stderr, "--elide-headers can't be used with --tun, "
+                "which carries no Ethernet headers\n");
+        return -1;
+    }
+
+    if (opts->elide && opts->fec_k) {
+        fprintf(stderr, "--elide-headers can't be used with --fec, "
+                "which delivers rebuilt messages out of order\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Does what the given timer, which has expired, is for. Returns 0 on
+ * success, or -1 on failure.
+ */
+
+static int run_timer(struct worker *w, int udp, struct timer *t,
+                     struct pktbuf **bp)
+{
+    struct peer *peer = t->peer;
+
+    switch (t->kind) {
+    case TIMER_KEEPALIVE:
+        return keepalive_timer(w, udp, peer, bp);
+
+    case TIMER_EXPIRE:
+        hub_expire(w, peer);
+        return 0;
+
+    case TIMER_REASM:
+        frag_expire(w, peer);
+        return 0;
+
+    case TIMER_PROBE:
+        return peer->pmtud->state ? pmtud_timer(w, udp, peer) : 0;
+
+    case TIMER_PING:
+        return mp_timer(w, udp, peer);
+
+    case TIMER_SHORTCUT:
+        return shortcut_timer(w, udp, peer, bp);
+
+    case TIMER_SWEEP:
+        fdb_sweep(&w->hub->fdb, monotonic_usec());
+        if (w->hub->snoop.members)
+            snoop_sweep(&w->hub->snoop, monotonic_usec());
+        timer_arm(w->wheel, t, w->hub->fdb.next_sweep);
+        return 0;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Stays in a loop reading packets from both the TAP device and the UDP
+ * socket. Encrypts and forwards packets from TAP→UDP, and decrypts and
+ * forwards in the other direction.
+ */
+
+int tunnel(const struct options *opts, const struct sockaddr *server,
+           socklen_t srvlen, int tap, int udp, uint32_t nonce_prefix,
+           unsigned char oursk[KEYBYTES],
+           unsigned char theirpk[KEYBYTES])
+{
+    int i, maxfd, nrxfds;
+    int rxfds[SPORT_MAX];
+    struct worker w;
+    struct pktpool *pool = &w.pool;
+    struct pktbuf *rx, *tx;
+    struct peer *peer;
+    struct shortcut *sc;
+    struct sockaddr *peeraddr;
+    struct sigaction sa;
+    struct wheel wheel;
+
+    /*
+     * If asked to, pin ourselves to the right CPUs before we allocate
+     * anything, so that our memory comes from the local node.
+     */
+
+    memset(&w, 0, sizeof(w));
+    w.opts = opts;
+    w.cpu = w.node = w.rx_cpu = -1;
+
+    if (opts->place && worker_place(&w, &opts->cpus) < 0)
+        return -1;
+
+    /*
+     * Allocate the packet buffers and the peer's state from an arena,
+     * which (depending on the options) may be backed by huge pages and
+     * locked into memory.
+     */
+
+    if (arena_init(&w.arena, ARENA_SIZE, opts->arena_flags, w.node) < 0)
+        return -1;
+
+    peer = arena_alloc(&w.arena, sizeof(struct peer));
+    if (peer == NULL) {
+        fprintf(stderr, "Couldn't allocate peer state\n");
+        return -1;
+    }
+    memset(peer, 0, sizeof(*peer));
+    peer->fd = -1;
+
+    /*
+     * Set aside packet buffers. Frames read from the TAP device and
+     * datagrams read from the UDP socket are each kept in a buffer of
+     * their own, and encrypted or decrypted in place.
+     */
+
+    if (pool_init(pool, &w.arena, PKTBUF_COUNT, PKTBUF_SIZE, HEADROOM) < 0)
+        return -1;
+
+    rx = pool_get(pool, BUF_UDP_RX);
+    tx = pool_get(pool, BUF_TAP_RX);
+
+    /*
+     * Our timers are kept in a timing wheel, which wakes us up through
+     * a timerfd.
+     */
+
+    if (wheel_init(&wheel, monotonic_usec()) < 0)
+        return -1;
+
+    w.wheel = &wheel;
+    timer_init(&peer->timer, TIMER_KEEPALIVE, peer);
+
+    if (opts->zerocopy && zc_init(&w.zc, udp, opts->zerocopy) < 0)
+        return -1;
+
+    /*
+     * If we are to bypass the kernel's UDP stack, set up the AF_XDP
+     * socket (which has its own arena, on the same node as ours).
+     */
+
+    if (opts->xdp_ifname) {
+        w.xdp = arena_alloc(&w.arena, sizeof(struct xdp_port));
+        if (w.xdp == NULL) {
+            fprintf(stderr, "Couldn't allocate AF_XDP state\n");
+            return -1;
+        }
+
+        if (xdp_init(w.xdp, opts->xdp_ifname, opts->xdp_queue, udp,
+                     server, opts->arena_flags, w.node) < 0)
+            return -1;
+    }
+
+    /*
+     * A SIGUSR1 asks us to print our counters.
+     */
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stats;
+    sigemptyset(&sa.sa_mask);
+    (void) sigaction(SIGUSR1, &sa, NULL);
+
+    /*
+     * Generate a nonce and precompute a shared secret from the two
+     * keys.
      */
 
-    n++;
-    listen = argc > 7 && strcmp(argv[n], "-l") == 0;
+    generate_nonce(nonce_prefix, peer->ournonce);
+    if (opts->hub)
+        hub_set_id(peer->ournonce, oursk);
+    memset(peer->theirnonce, 0, NONCEBYTES);
+    crypto_box_beforenm(peer->k, theirpk, oursk);
+    wire_init(peer, opts->compact);
+    rx->hdrlen = peer->hdrmax;
 
     /*
-     * Now we create a UDP socket, and bind the server sockaddr to it if
-     * we are going to listen for incoming packets.
+     * With multipath, the client sends through a socket of its own for
+     * each path, and with a range of source ports, through a socket for
+     * each port (including its first keepalive, so that the server
+     * learns no other path or port).
      */
 
-    udp = udp_socket(listen, server, srvlen);
-    if (udp < 0)
+    if (opts->multipath && mp_init(&w, peer, udp, server, srvlen) < 0)
+        return -1;
+
+    if (opts->sport_n && sport_init(&w, peer, udp, server) < 0)
         return -1;
 
     /*
-     * Now we start the encrypted tunnel and let it run.
+     * A peer of a hub that floods frames with a group key must learn
+     * the key before it can read them.
      */
 
-    return tunnel(listen, server, srvlen, tap, udp, nonce_prefix,
-                  oursk, theirpk);
-}
+    if (opts->group_key) {
+        peer->group = arena_alloc(&w.arena, sizeof(struct group));
+        if (peer->group == NULL) {
+            fprintf(stderr, "Couldn't allocate group key state\n");
+            return -1;
+        }
+        if (group_init(&w, peer->group, nonce_prefix) < 0)
+            return -1;
+    }
 
-/*
- * Stays in a loop reading packets from both the TAP device and the UDP
- * socket. Encrypts and forwards packets from TAP→UDP, and decrypts and
- * forwards in the other direction.
- */
+    if (opts->shortcuts &&
+        shortcut_init(&w, peer, oursk, nonce_prefix) < 0)
+        return -1;
 
-int tunnel(int listen, const struct sockaddr *server, socklen_t srvlen,
-           int tap, int udp, uint32_t nonce_prefix,
-           unsigned char oursk[KEYBYTES],
-           unsigned char theirpk[KEYBYTES])
-{
-    int maxfd;
-    uint16_t biggest_rcvd;
-    uint16_t biggest_sent;
-    uint16_t biggest_tried;
-    unsigned char ptbuf[2048];
-    unsigned char ctbuf[2048];
-    unsigned char ournonce[NONCEBYTES];
-    unsigned char theirnonce[NONCEBYTES];
-    unsigned char k[crypto_box_BEFORENMBYTES];
-    struct sockaddr_storage peeraddr;
-    struct sockaddr *peer;
-    socklen_t peerlen;
+    if (peer->sports)
+        nrxfds = sport_sockets(peer, udp, rxfds);
+    else
+        nrxfds = mp_sockets(peer, udp, rxfds);
 
     /*
-     * Generate a nonce, zero bytes that should be zero, and precompute
-     * a shared secret from the two keys.
+     * With --connect, we send through a socket connected to the peer,
+     * on which the peer's datagrams arrive too.
      */
 
-    generate_nonce(nonce_prefix, ournonce);
-    memset(ptbuf, 0, ZEROBYTES);
-    memset(theirnonce, 0, sizeof(theirnonce));
-    crypto_box_beforenm(k, theirpk, oursk);
+    if (opts->connect) {
+        if (conn_open(&w, peer, udp, -1) < 0) {
+            fprintf(stderr, "Couldn't create connected socket: %s\n",
+                    strerror(errno));
+            return -1;
+        }
+        rxfds[nrxfds++] = peer->fd;
+    }
 
     /*
      * Each side remembers its peer: for the client, it's the server.
      * For the server, it's whoever sends it valid encrypted packets.
      */
 
-    peer = (struct sockaddr *) &peeraddr;
-    peerlen = sizeof(peeraddr);
-    memset(peer, 0, peerlen);
+    peeraddr = (struct sockaddr *) &peer->addr;
+    peer->addrlen = sizeof(peer->addr);
+    memset(peeraddr, 0, peer->addrlen);
 
-    if (listen == 0) {
-        memcpy(peer, server, srvlen);
-        peerlen = srvlen;
+    if (opts->listen == 0) {
+        memcpy(peeraddr, server, srvlen);
+        peer->addrlen = srvlen;
+        conn_update(&w, peer, 0);
 
         /*
          * Speed things up by telling the server who we are
          * straightaway, before any traffic needs to be sent.
          */
 
-        if (send_keepalive(listen, udp, 0, peer, peerlen, ournonce, k) < 0)
+        if (send_keepalive(&w, udp, peer, &tx, 0) < 0)
             return -1;
     }
 
+    timer_arm(&wheel, &peer->timer, monotonic_usec() + KEEPALIVE_USEC);
+
     /*
      * We set DF on outgoing UDP packets, but we cannot rely solely upon
      * path MTU discovery working correctly. So each side keeps track of
@@ -170,63 +901,219 @@ int tunnel(int listen, const struct sockaddr *server, socklen_t srvlen,
      * should be the other side's biggest_rcvd.
      */
 
-    biggest_tried = biggest_sent = biggest_rcvd = 0;
+    peer->biggest_tried = peer->biggest_sent = peer->biggest_rcvd = 0;
+
+    /*
+     * Frames may be held back for a while to be bundled together into
+     * datagrams no bigger than we think will fit through the path.
+     */
+
+    peer->maxdgram = server->sa_family == AF_INET6 ? 1500-48 : 1500-28;
+    peer->agg.hold = opts->aggregate;
+
+    if (opts->fragment && frag_init(&w, peer) < 0)
+        return -1;
+
+    if (opts->pmtud && pmtud_init(&w, peer) < 0)
+        return -1;
+
+    if (opts->pmtud && peeraddr->sa_family != 0)
+        pmtud_start(&w, peer);
+
+    if (opts->compress && compress_init(&w) < 0)
+        return -1;
+
+    if (opts->elide && elide_init(&w, peer) < 0)
+        return -1;
+
+    if (opts->fec_k &&
+        fec_init(&w, peer, opts->fec_k, opts->fec_m, opts->fec_adapt) < 0)
+        return -1;
 
     /*
      * Now both sides loop waiting for readability events on their fds.
      */
 
     maxfd = tap > udp ? tap : udp;
+    if (wheel.fd > maxfd)
+        maxfd = wheel.fd;
+    if (w.xdp && w.xdp->fd > maxfd)
+        maxfd = w.xdp->fd;
+    for (i = 0; i < nrxfds; i++) {
+        if (rxfds[i] > maxfd)
+            maxfd = rxfds[i];
+    }
 
     while (1) {
         fd_set r;
         int n, nfds;
-        struct timeval tv;
+        uint64_t now, wake = UINT64_MAX;
+        struct timer *t;
+
+        /*
+         * The timerfd wakes us up when one of our timers expires (to
+         * send a keepalive, probe the path MTU, ping our paths, or give
+         * up on a fragmented message), or when it's time to send a
+         * bundle of frames that we have held back long enough, or to
+         * close an FEC group (which can't wait for the next tick).
+         */
+
+        if (peer->agg.pending)
+            wake = peer->agg.deadline;
+        if (peer->fec && peer->fec->count && peer->fec->deadline < wake)
+            wake = peer->fec->deadline;
 
-        tv.tv_sec = 10;
-        tv.tv_usec = 0;
+        if (wheel_schedule(&wheel, wake) < 0)
+            return -1;
 
         FD_ZERO(&r);
-        FD_SET(udp, &r);
+        FD_SET(wheel.fd, &r);
+        for (i = 0; i < nrxfds; i++)
+            FD_SET(rxfds[i], &r);
+        if (w.xdp)
+            FD_SET(w.xdp->fd, &r);
 
         /*
          * Don't listen for TAP packets unless we know where to send
          * them (which the client always does).
          */
 
-        if (peer->sa_family != 0)
+        if (peeraddr->sa_family != 0)
             FD_SET(tap, &r);
 
-        nfds = select(maxfd+1, &r, NULL, NULL, &tv);
+        nfds = select(maxfd+1, &r, NULL, NULL, NULL);
+
+        if (stats_requested) {
+            stats_requested = 0;
+            report_stats(&w, peer);
+        }
+
+        if (nfds < 0 && errno == EINTR)
+            continue;
         if (nfds < 0) {
             fprintf(stderr, "select() failed: %s\n", strerror(errno));
             return nfds;
         }
 
+        /*
+         * The wheel is brought up to date before anything else, so
+         * that its time is now.
+         */
+
+        if (FD_ISSET(wheel.fd, &r))
+            wheel_wakeup(&wheel);
+
+        now = monotonic_usec();
+        wheel_advance(&wheel, now);
+
         /*
          * We read a packet from the UDP socket and try to decrypt it.
          * If that fails, we discard the packet silently. Otherwise we
          * write the decrypted result to the TAP device.
          */
 
-        if (FD_ISSET(udp, &r)) {
+        for (i = 0; i < nrxfds && !FD_ISSET(rxfds[i], &r); i++)
+            ;
+
+        if (i < nrxfds || (w.xdp && FD_ISSET(w.xdp->fd, &r))) {
+            int rxi = 0;
+
+            if (zc_reap(&w.zc, udp, pool) < 0)
+                return -1;
+
             while (1) {
                 unsigned char newnonce[NONCEBYTES];
-                struct sockaddr_storage newpeer;
+                unsigned char *wire = PKTBUF_WIRE(rx);
+                unsigned char *ct = NULL;
+                union peeraddr newpeer;
                 socklen_t newpeerlen = sizeof(newpeer);
+                int len = peer->hdrmax+ZEROBYTES+pktbuf_room(pool);
+                int via_xdp = 0;
+                int moved;
                 uint16_t rcvd;
 
-                n = udp_read(udp, newnonce, ctbuf, sizeof(ctbuf),
-                             (struct sockaddr *) &newpeer, &newpeerlen);
+                /*
+                 * Datagrams may arrive through the AF_XDP socket, or
+                 * (if the NIC delivers them to a different queue) the
+                 * UDP socket.
+                 */
+
+                n = 0;
+                if (w.xdp)
+                    n = xdp_read(w.xdp, wire, len,
+                                 (struct sockaddr *) &newpeer, &newpeerlen);
+                if (n != 0)
+                    via_xdp = 1;
+                else
+                    n = udp_read(rxfds[rxi], wire, len,
+                                 (struct sockaddr *) &newpeer, &newpeerlen);
+
+                /*
+                 * With several sockets (one per path or port), we read
+                 * from each in turn until nothing is left on any.
+                 */
+
+                if (n == 0 && ++rxi < nrxfds)
+                    continue;
 
                 if (n == 0)
                     break;
 
+                /*
+                 * A datagram from another peer of our hub comes through
+                 * a shortcut, and is all there is to it.
+                 */
+
+                if (n > 0 && w.sc &&
+                    (sc = shortcut_find(w.sc, wire)) != NULL)
+                {
+                    if (shortcut_input(&w, tap, sc, wire, n,
+                                       (struct sockaddr *) &newpeer,
+                                       newpeerlen) < 0)
+                        return -1;
+                    continue;
+                }
+
+                /*
+                 * The wire header tells us the nonce, and where the
+                 * ciphertext begins.
+                 */
+
                 rcvd = n;
-                if (n > 0 && memcmp(theirnonce, newnonce, NONCEBYTES) >= 0)
+                if (n > 0) {
+                    int hdr = wire_parse(peer, wire, n+NONCEBYTES, newnonce);
+
+                    if (hdr < 0) {
+                        n = -1;
+                    } else {
+                        ct = wire + hdr;
+                        n += NONCEBYTES - hdr;
+                    }
+                }
+
+                /*
+                 * A frame the hub flooded to all its peers is encrypted
+                 * with the group key, and is all there is to it.
+                 */
+
+                if (n > 0 && peer->group &&
+                    group_nonce(peer->group, newnonce))
+                {
+                    n = group_open(peer->group, newnonce, ct, n);
+                    if (n == -1)
+                        continue;
+                    if (n < -2)
+                        return n;
+                    if (deliver(&w, tap, peer, ct+ZEROBYTES, n-ZEROBYTES,
+                                0) < 0)
+                        return -1;
+                    continue;
+                }
+
+                if (n > 0 && !nonce_fresh(peer, newnonce))
                     n = -1;
                 if (n > 0)
-                    n = decrypt(k, newnonce, ctbuf, n, ptbuf);
+                    n = decrypt(peer->k, newnonce, ct, n, ct);
 
                 /*
                  * For some errors, we can drop the packet and carry on.
@@ -244,46 +1131,77 @@ int tunnel(int listen, const struct sockaddr *server, socklen_t srvlen,
                  * update our record of the peer's address and nonce.
                  */
 
-                memcpy(theirnonce, newnonce, sizeof(newnonce));
-                memcpy(peer, &newpeer, newpeerlen);
-                peerlen = newpeerlen;
+                moved = newpeerlen != peer->addrlen ||
+                    memcmp(peeraddr, &newpeer, newpeerlen) != 0;
+                if (moved && peer->sports)
+                    moved = !sport_same_peer(peer,
+                                             (struct sockaddr *) &newpeer,
+                                             newpeerlen);
+
+                nonce_accept(peer, newnonce);
+                memcpy(peeraddr, &newpeer, newpeerlen);
+                peer->addrlen = newpeerlen;
+                conn_update(&w, peer, moved);
 
-                if (biggest_rcvd < rcvd)
-                    biggest_rcvd = rcvd;
+                if (peer->mp)
+                    mp_received(peer, rxfds[rxi],
+                                (struct sockaddr *) &newpeer, newpeerlen,
+                                rcvd + NONCEBYTES);
 
                 /*
-                 * If the decrypted packet is not long enough to be an
-                 * Ethernet frame, we treat it as a keepalive and ignore
-                 * it. Otherwise we inject it into the local network.
+                 * The path to a new address may not be the same as the
+                 * old one, so we must find out its MTU afresh.
                  */
 
-                if (n < 64) {
-                    unsigned char *p = ptbuf + ZEROBYTES;
-                    if (n-ZEROBYTES == 3 && *p++ == 0xFE) {
-                        uint16_t size = (*p << 8) | *(p+1);
-                        if (biggest_sent < size)
-                            biggest_sent = size;
-                    }
-                    continue;
-                }
+                if (moved && opts->pmtud)
+                    pmtud_start(&w, peer);
+                wire_accept(peer, wire, newnonce);
+
+                if (via_xdp)
+                    xdp_learn(w.xdp);
 
-                if (tap_write(tap, ptbuf+ZEROBYTES, n-ZEROBYTES) < 0)
+                if (peer->biggest_rcvd < rcvd)
+                    peer->biggest_rcvd = rcvd;
+
+                if (deliver(&w, tap, peer, ct+ZEROBYTES, n-ZEROBYTES, 0) < 0)
+                    return -1;
+
+                /*
+                 * If the peer announced a session we didn't know about
+                 * (or we haven't acknowledged it for a while), we tell
+                 * it that we now know the nonce it is using. We also
+                 * acknowledge its path MTU probes.
+                 */
+
+                if (send_replies(&w, udp, peer, &tx) < 0)
                     return -1;
             }
+
+            /*
+             * If we are following the CPU that receives our packets,
+             * check whether it has changed.
+             */
+
+            if (opts->follow_rx_cpu) {
+                n = udp_incoming_cpu(udp);
+                if (n >= 0 && n != w.rx_cpu)
+                    (void) worker_follow(&w, n);
+            }
         }
 
         /*
          * Similarly, we read ethernet frames from the TAP device and
-         * write them to the UDP socket after encryption.
+         * write them to the UDP socket after encryption. With framed
+         * payloads, each frame is preceded by a type byte, and frames
+         * may be compressed (or have their headers elided), and bundled
+         * together before they are sent.
          */
 
         if (FD_ISSET(tap, &r)) {
+            int off = opts->framed ? 1 : 0;
+
             while (1) {
-                n = tap_read(tap, ptbuf+ZEROBYTES, sizeof(ptbuf)-ZEROBYTES);
-                if (n > 0) {
-                    update_nonce(ournonce);
-                    n = encrypt(k, ournonce, ptbuf, n+ZEROBYTES, ctbuf);
-                }
+                n = tap_read(tap, tx->data+off, pktbuf_room(pool)-off);
 
                 if (n == 0)
                     break;
@@ -291,24 +1209,77 @@ int tunnel(int listen, const struct sockaddr *server, socklen_t srvlen,
                 if (n < 0)
                     return n;
 
-                if (biggest_tried < n+NONCEBYTES)
-                    biggest_tried = n+NONCEBYTES;
+                if (peer->sports)
+                    tx->flow = flow_hash(tx->data+off, n, opts->tun);
+
+                sc = w.sc ? shortcut_route(w.sc, tx->data+off, n) : NULL;
+
+                n += off;
+                if (off)
+                    tx->data[0] = MSG_FRAME;
+
+                if (opts->compress)
+                    n = compress_message(&w, &tx, n);
+
+                /*
+                 * A frame for a host behind a peer of the hub that we
+                 * have a shortcut to goes straight there.
+                 */
+
+                if (sc) {
+                    if (shortcut_send(&w, udp, sc, &tx, n) < 0)
+                        return -1;
+                    continue;
+                }
+
+                if (opts->elide)
+                    n = elide_message(&w, peer, tx, n);
 
-                if (udp_write(udp, ournonce, ctbuf, n, peer, peerlen) < 0)
+                if (opts->aggregate_on)
+                    n = agg_message(&w, udp, peer, &tx, n);
+                else
+                    n = frag_message(&w, udp, peer, &tx, n);
+
+                if (n < 0)
                     return -1;
             }
+
+            /*
+             * Once we have read everything the TAP device had for us,
+             * we send any bundle that isn't worth holding back.
+             */
+
+            if (peer->agg.pending && peer->agg.hold == 0 &&
+                agg_flush(&w, udp, peer, AGG_DRAINED) < 0)
+                return -1;
         }
 
         /*
-         * If 10 seconds have elapsed without any traffic, we send a
-         * keepalive packet to our peer. (This will ensure that both
-         * peers find out about IP address changes.)
+         * Send a bundle that we have held back as long as we may.
+         */
+
+        if (peer->agg.pending && peer->agg.deadline <= now &&
+            agg_flush(&w, udp, peer, AGG_EXPIRED) < 0)
+            return -1;
+
+        /*
+         * Send the parity for an FEC group that has waited long enough
+         * for more messages.
          */
 
-        if (nfds == 0 && peer->sa_family != 0) {
-            update_nonce(ournonce);
-            if (send_keepalive(listen, udp, biggest_rcvd, peer, peerlen,
-                               ournonce, k) < 0)
+        if (peer->fec && peer->fec->count && peer->fec->deadline <= now &&
+            fec_flush(&w, udp, peer) < 0)
+            return -1;
+
+        /*
+         * Do whatever our timers say is due. If 10 seconds have elapsed
+         * without our sending anything, we send a keepalive packet to
+         * our peer. (This will ensure that both peers find out about IP
+         * address changes.)
+         */
+
+        while ((t = wheel_expired(&wheel)) != NULL) {
+            if (run_timer(&w, udp, t, &tx) < 0)
                 return -1;
         }
     }
@@ -316,32 +1287,308 @@ int tunnel(int listen, const struct sockaddr *server, socklen_t srvlen,
 
 
 /*
- * Sends an encrypted keepalive packet with the given size to the peer.
- * Uses the nonce without updating it. Returns 0 on success, -1 on
+ * Reads datagrams from the given socket (a hub's UDP socket, or one of
+ * its connected sockets) until there are none left, and delivers the
+ * frames in them. Each datagram's nonce tells us which peer sent it,
+ * and so which key to decrypt it with. Returns 0 on success, or -1 on
  * failure.
  */
 
-int send_keepalive(int listen, int udp, uint16_t size,
-                   const struct sockaddr *peer, socklen_t peerlen,
-                   unsigned char nonce[NONCEBYTES],
-                   unsigned char k[crypto_box_BEFORENMBYTES])
+static int hub_read(struct worker *w, int tap, int fd, struct pktbuf *rx,
+                    struct pktbuf **replies)
 {
+    struct hub *hub = w->hub;
+    struct pktpool *pool = &w->pool;
     int n;
-    unsigned char p[ZEROBYTES+3];
-    unsigned char c[ZEROBYTES+3];
 
-    n = ZEROBYTES;
-    memset(p, 0, n);
-    p[n++] = 0xFE;
-    p[n++] = size >> 8;
-    p[n++] = size & 0xFF;
+    while (1) {
+        unsigned char *wire = PKTBUF_WIRE(rx);
+        unsigned char *ct = wire + NONCEBYTES;
+        union peeraddr from;
+        socklen_t fromlen = sizeof(from);
+        struct peer *peer = NULL;
+        int len = NONCEBYTES+ZEROBYTES+pktbuf_room(pool);
+
+        n = udp_read(fd, wire, len, &from.sa, &fromlen);
+
+        if (n == 0)
+            return 0;
+
+        if (n > 0) {
+            hub->stats.received++;
+            peer = hub_lookup(hub, wire, n+NONCEBYTES);
+        }
+        if (peer == NULL)
+            n = -1;
+        if (n > 0 && !nonce_fresh(peer, wire))
+            n = -1;
+        if (n > 0)
+            n = decrypt(peer->k, wire, ct, n, ct);
+
+        if (n == -1) {
+            if (peer)
+                hub->stats.rejected++;
+            continue;
+        }
+
+        if (n < -2)
+            return -1;
+
+        nonce_accept(peer, wire);
+        hub_received(w, peer, &from.sa, fromlen);
+
+        if (peer->biggest_rcvd < n + NONCEBYTES)
+            peer->biggest_rcvd = n + NONCEBYTES;
+
+        if (deliver(w, tap, peer, ct+ZEROBYTES, n-ZEROBYTES, 0) < 0)
+            return -1;
+
+        if (send_replies(w, hub->udp, peer, replies) < 0)
+            return -1;
+    }
+}
+
+
+/*
+ * Runs a hub: like tunnel(), but for every peer whose public key is in
+ * the given directory. Datagrams from each peer are decrypted with its
+ * key, and frames from the peers and the TAP device are switched among
+ * them (see hub.c). A hub only listens, and leaves keepalives to its
+ * peers.
+ *
+ * Returns only on failure.
+ */
 
-    n = encrypt(k, nonce, p, sizeof (p), c);
-    if (n < 0)
+int hub_tunnel(const struct options *opts, int tap, int udp,
+               uint32_t nonce_prefix, unsigned char oursk[KEYBYTES],
+               const char *dir)
+{
+    int maxfd;
+    struct worker w;
+    struct pktpool *pool = &w.pool;
+    struct pktbuf *rx, *tx, *replies;
+    struct hub hub;
+    struct wheel wheel;
+    struct sigaction sa;
+
+    memset(&w, 0, sizeof(w));
+    w.opts = opts;
+    w.cpu = w.node = w.rx_cpu = -1;
+
+    if (opts->place && worker_place(&w, &opts->cpus) < 0)
         return -1;
 
-    if (udp_write(udp, nonce, c, n, peer, peerlen) < 0)
+    if (arena_init(&w.arena, ARENA_SIZE, opts->arena_flags, w.node) < 0)
         return -1;
 
-    return 0;
+    if (pool_init(pool, &w.arena, PKTBUF_COUNT, PKTBUF_SIZE, HEADROOM) < 0)
+        return -1;
+
+    rx = pool_get(pool, BUF_UDP_RX);
+    tx = pool_get(pool, BUF_TAP_RX);
+    replies = pool_get(pool, BUF_UDP_TX);
+
+    if (wheel_init(&wheel, monotonic_usec()) < 0)
+        return -1;
+    w.wheel = &wheel;
+
+    if (opts->zerocopy && zc_init(&w.zc, udp, opts->zerocopy) < 0)
+        return -1;
+
+    if (opts->compress && compress_init(&w) < 0)
+        return -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stats;
+    sigemptyset(&sa.sa_mask);
+    (void) sigaction(SIGUSR1, &sa, NULL);
+
+    /*
+     * Load our peers' keys, and start computing the secret we share
+     * with each of them.
+     */
+
+    if (hub_init(&w, &hub, dir, udp, oursk, nonce_prefix) < 0)
+        return -1;
+
+    fprintf(stderr, "Serving %d peers\n", hub.npeers);
+
+    /*
+     * Old entries are swept out of the forwarding table from time to
+     * time.
+     */
+
+    timer_init(&hub.sweep, TIMER_SWEEP, NULL);
+    if (hub.fdb.table)
+        timer_arm(&wheel, &hub.sweep, hub.fdb.next_sweep);
+
+    maxfd = tap > udp ? tap : udp;
+    if (wheel.fd > maxfd)
+        maxfd = wheel.fd;
+    if (hub.epfd > maxfd)
+        maxfd = hub.epfd;
+
+    while (1) {
+        fd_set r, wr;
+        int n, nfds;
+        struct timer *t;
+
+        /*
+         * The timerfd wakes us up when one of our timers expires: to
+         * forget a peer we haven't heard from, or to sweep the
+         * forwarding table.
+         */
+
+        if (wheel_schedule(&wheel, UINT64_MAX) < 0)
+            return -1;
+
+        FD_ZERO(&r);
+        FD_SET(udp, &r);
+        FD_SET(wheel.fd, &r);
+        if (hub.epfd >= 0)
+            FD_SET(hub.epfd, &r);
+        if (hub.active > 0)
+            FD_SET(tap, &r);
+
+        /*
+         * With fair queueing, we wait for the socket to have room for
+         * the frames we have queued.
+         */
+
+        FD_ZERO(&wr);
+        if (hub.drr.blocked)
+            FD_SET(udp, &wr);
+
+        nfds = select(maxfd+1, &r, &wr, NULL, NULL);
+
+        if (stats_requested) {
+            stats_requested = 0;
+            report_stats(&w, NULL);
+            hub_report(&hub, stderr);
+        }
+
+        if (nfds < 0 && errno == EINTR)
+            continue;
+        if (nfds < 0) {
+            fprintf(stderr, "select() failed: %s\n", strerror(errno));
+            return nfds;
+        }
+
+        /*
+         * The wheel is brought up to date first, so that hub_received()
+         * knows when we heard from each peer.
+         */
+
+        if (FD_ISSET(wheel.fd, &r))
+            wheel_wakeup(&wheel);
+
+        wheel_advance(&wheel, monotonic_usec());
+
+        if (nfds > 0 && FD_ISSET(udp, &wr) && drr_run(&w) < 0)
+            return -1;
+
+        /*
+         * Datagrams from the peers arrive on our UDP socket.
+         */
+
+        if (FD_ISSET(udp, &r)) {
+            if (zc_reap(&w.zc, udp, pool) < 0)
+                return -1;
+
+            if (hub_read(&w, tap, udp, rx, &replies) < 0)
+                return -1;
+        }
+
+        /*
+         * With --connect, each peer's datagrams arrive on its own socket
+         * (see connect.c).
+         */
+
+        if (hub.epfd >= 0 && FD_ISSET(hub.epfd, &r)) {
+            struct epoll_event ev[HUB_EVENTS];
+            int i;
+
+            n = epoll_wait(hub.epfd, ev, HUB_EVENTS, 0);
+            for (i = 0; i < n; i++) {
+                if (hub_read(&w, tap, ev[i].data.fd, rx, &replies) < 0)
+                    return -1;
+            }
+        }
+
+        /*
+         * Frames from the TAP device go to the peer (or peers) they are
+         * meant for.
+         */
+
+        if (FD_ISSET(tap, &r)) {
+            while (1) {
+                n = tap_read(tap, tx->data, pktbuf_room(pool));
+
+                if (n == 0)
+                    break;
+
+                if (n < 0)
+                    return n;
+
+                if (hub_switch(&w, tap, NULL, tx->data, n) < 0)
+                    return -1;
+            }
+        }
+
+        while ((t = wheel_expired(&wheel)) != NULL) {
+            if (run_timer(&w, udp, t, &replies) < 0)
+                return -1;
+        }
+    }
+}
+
+
+/*
+ * Prints our counters to stderr (in response to SIGUSR1).
+ */
+
+void report_stats(const struct worker *w, const struct peer *peer)
+{
+    if (w->cpu >= 0)
+        worker_report(w, stderr);
+    arena_report(&w->arena, "buffer", stderr);
+    pool_report(&w->pool, stderr);
+    if (w->zc.enabled)
+        zc_report(&w->zc, stderr);
+    if (w->xdp)
+        xdp_report(w->xdp, stderr);
+    if (w->opts->aggregate_on)
+        agg_report(&w->agg_stats, stderr);
+    if (w->opts->fragment)
+        frag_report(&w->frag_stats, stderr);
+    if (w->lz)
+        compress_report(&w->lz->stats, stderr);
+    if (w->opts->elide)
+        elide_report(&w->elide_stats, stderr);
+    if (w->opts->connect)
+        conn_report(&w->conn_stats, stderr);
+    if (w->wheel)
+        wheel_report(w->wheel, stderr);
+
+    /*
+     * A hub reports on its peers itself.
+     */
+
+    if (peer == NULL)
+        return;
+
+    if (w->opts->pmtud)
+        pmtud_report(w, peer, stderr);
+    if (w->opts->compact)
+        wire_report(&peer->session, stderr);
+    if (peer->fec)
+        fec_report(w, peer, stderr);
+    if (peer->mp)
+        mp_report(peer, stderr);
+    if (peer->sports)
+        sport_report(peer, stderr);
+    if (peer->group)
+        group_report(peer->group, stderr);
+    if (w->sc)
+        shortcut_report(w->sc, stderr);
 }
@@ -3,6 +3,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,25 +26,1224 @@
 #define ZEROBYTES crypto_box_ZEROBYTES
 #define NONCEBYTES crypto_box_NONCEBYTES
 
-int tap_attach(const char *name);
+/*
+ * Packet buffers: fixed-size, cache-line-aligned slabs with room in
+ * front of the frame for the wire header (usually just the nonce) and
+ * the crypto_box zero bytes.
+ */
+
+#define CACHELINE 64
+#define PKTBUF_SIZE 2048
+#define PKTBUF_COUNT 64
+#define WIRE_MAXHDR (1+NONCEBYTES)
+#define HEADROOM (WIRE_MAXHDR+ZEROBYTES)
+
+/* The wire header and ciphertext of a buffer's datagram start here */
+#define PKTBUF_WIRE(b) ((b)->data - ZEROBYTES - (b)->hdrlen)
+
+enum { BUF_FREE, BUF_TAP_RX, BUF_UDP_RX, BUF_UDP_TX, BUF_KERNEL };
+
+struct pktbuf {
+    struct pktbuf *next;
+    unsigned char *data;
+    int len;
+    int hdrlen;
+    int owner;
+    uint32_t seq;
+    uint32_t flow;
+};
+
+struct pktpool {
+    struct pktbuf *free;
+    struct pktbuf *bufs;
+    unsigned char *slabs;
+    int count;
+    int size;
+    int headroom;
+    int available;
+    int lowest;
+    unsigned long exhausted;
+};
+
+/*
+ * Arenas: one mapping, optionally huge-page backed and locked, from
+ * which packet buffers and per-peer state are allocated at startup.
+ */
+
+#define ARENA_SIZE (2*1024*1024)
+
+enum { ARENA_HUGEPAGES = 1, ARENA_MLOCK = 2 };
+enum { ARENA_PAGES, ARENA_THP, ARENA_HUGETLB };
+
+struct arena {
+    unsigned char *base;
+    size_t size;
+    size_t used;
+    unsigned long failures;
+    int backing;
+    int locked;
+    int node;
+};
+
+int arena_init(struct arena *a, size_t size, int flags, int node);
+void *arena_alloc(struct arena *a, size_t size);
+void arena_free(struct arena *a);
+void arena_report(const struct arena *a, const char *name, FILE *f);
+int lock_memory(const void *p, size_t len);
+
+int pool_init(struct pktpool *pool, struct arena *arena, int count,
+              int size, int headroom);
+size_t pool_size(int count, int size, int headroom);
+struct pktbuf *pool_get(struct pktpool *pool, int owner);
+void pool_put(struct pktpool *pool, struct pktbuf *b);
+int pktbuf_room(const struct pktpool *pool);
+void pool_report(const struct pktpool *pool, FILE *f);
+
+/*
+ * MSG_ZEROCOPY transmission: buffers the kernel is still sending from,
+ * in the order they were sent, and counters.
+ */
+
+struct zerocopy {
+    int enabled;
+    int threshold;
+    uint32_t next;
+    int inflight;
+    struct pktbuf *head;
+    struct pktbuf *tail;
+    unsigned long sent;
+    unsigned long completed;
+    unsigned long copied;
+    unsigned long no_buffer;
+};
+
+int zc_init(struct zerocopy *zc, int udp, int threshold);
+int zc_write(struct zerocopy *zc, int udp, struct pktpool *pool,
+             struct pktbuf **bp, int len, const struct sockaddr *addr,
+             socklen_t addrlen);
+int zc_reap(struct zerocopy *zc, int udp, struct pktpool *pool);
+void zc_report(const struct zerocopy *zc, FILE *f);
+
+/*
+ * AF_XDP transport: a socket bound to one NIC queue, its rings, the
+ * packet memory it shares with the kernel, and the addresses we need to
+ * build outer headers ourselves.
+ */
+
+#define XDP_FRAME_SIZE 2048
+#define XDP_FRAMES 4096
+
+struct xdp_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *ring;
+    uint32_t mask;
+};
+
+struct xdp_port {
+    int fd;
+    int ifindex;
+    int queue;
+    int zerocopy;
+    int native;
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+    char ifname[IFNAMSIZ];
+    struct arena umem;
+    struct xdp_ring fill;
+    struct xdp_ring comp;
+    struct xdp_ring rx;
+    struct xdp_ring tx;
+    uint64_t frames[XDP_FRAMES];
+    int nframes;
+    struct sockaddr_in local;
+    struct in_addr target;
+    unsigned char mac[6];
+    unsigned char rxmac[6];
+    unsigned char nexthop[6];
+    int have_nexthop;
+    uint16_t ip_id;
+    unsigned long lookups;
+    unsigned long rx_frames;
+    unsigned long rx_bad;
+    unsigned long tx_frames;
+    unsigned long tx_kernel;
+    unsigned long tx_full;
+};
+
+int xdp_init(struct xdp_port *x, const char *ifname, int queue, int udp,
+             const struct sockaddr *server, int arena_flags, int node);
+int xdp_read(struct xdp_port *x, unsigned char *buf, int len,
+             struct sockaddr *addr, socklen_t *addrlen);
+void xdp_learn(struct xdp_port *x);
+int xdp_write(struct xdp_port *x, unsigned char *buf, int len,
+              const struct sockaddr *addr, socklen_t addrlen);
+void xdp_report(const struct xdp_port *x, FILE *f);
+
+/*
+ * Framed payloads: when both ends are configured to use them, every
+ * decrypted message starts with a type byte. (Without framing, anything
+ * shorter than an Ethernet frame is a keepalive, and the rest are
+ * frames; in TUN mode, anything that isn't an IPv4 or IPv6 packet is a
+ * keepalive.) A keepalive looks the same either way.
+ */
+
+enum {
+    MSG_FRAME = 0x00,
+    MSG_COMPRESSED = 0x01,
+    MSG_ELIDED = 0x02,
+    MSG_BUNDLE = 0x10,
+    MSG_FRAGMENT = 0x11,
+    MSG_PROBE = 0x12,
+    MSG_PROBE_ACK = 0x13,
+    MSG_SESSION = 0x14,
+    MSG_HDR_ACK = 0x15,
+    MSG_HDR_RESET = 0x16,
+    MSG_FEC = 0x17,
+    MSG_FEC_PARITY = 0x18,
+    MSG_FEC_LOSS = 0x19,
+    MSG_PATH_PING = 0x1A,
+    MSG_PATH_PONG = 0x1B,
+    MSG_GROUP_KEY = 0x1C,
+    MSG_GROUP_ACK = 0x1D,
+    MSG_SHORTCUT = 0x1E,
+    MSG_KEEPALIVE = 0xFE
+};
+
+#define KEEPALIVE_USEC (10*1000000ULL)
+
+/*
+ * Timers, kept in a hierarchical timing wheel of WHEEL_LEVELS levels of
+ * WHEEL_SLOTS slots each (see timer.c). A timer is armed if pprev is not
+ * NULL. Its kind says what to do when it expires, and for which peer.
+ */
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+#define WHEEL_TICK_USEC 1000
+
+enum {
+    TIMER_KEEPALIVE,
+    TIMER_EXPIRE,
+    TIMER_REASM,
+    TIMER_PROBE,
+    TIMER_PING,
+    TIMER_SWEEP,
+    TIMER_SHORTCUT
+};
+
+struct timer {
+    struct timer *next;
+    struct timer **pprev;
+    uint64_t expires;
+    uint8_t level;
+    uint8_t slot;
+    uint8_t kind;
+    struct peer *peer;
+};
+
+struct wheel_stats {
+    unsigned long armed;
+    unsigned long cancelled;
+    unsigned long fired;
+    unsigned long cascaded;
+    unsigned long scheduled;
+    unsigned long wakeups;
+};
+
+struct wheel {
+    struct timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t bitmap[WHEEL_LEVELS];
+    uint64_t tick;
+    uint32_t pending;
+    struct timer *expired;
+    int fd;
+    uint64_t armed;
+    struct wheel_stats stats;
+};
+
+/*
+ * Frame aggregation: small messages are held back and packed into one
+ * bundle (each preceded by its two-byte length) until the bundle is as
+ * big as the path allows, there is nothing more to read, or the oldest
+ * of them has waited long enough.
+ */
+
+enum { AGG_FULL, AGG_DRAINED, AGG_EXPIRED, AGG_PORT, AGG_REASONS };
+
+struct aggregate {
+    struct pktbuf *pending;
+    int count;
+    int hold;
+    uint64_t deadline;
+};
+
+struct agg_stats {
+    unsigned long messages;
+    unsigned long datagrams;
+    unsigned long bundled;
+    unsigned long flushes[AGG_REASONS];
+};
+
+/*
+ * In-tunnel fragmentation: messages too big for the path are sent in
+ * fragments, which the peer reassembles in one of a few slots, each
+ * reclaimed if the message isn't complete in FRAG_TIMEOUT_USEC.
+ */
+
+#define FRAG_SLOTS 8
+#define FRAG_TIMEOUT_USEC 1000000
+
+struct fragslot {
+    int used;
+    uint16_t id;
+    int have;
+    int total;
+    uint64_t deadline;
+    unsigned char *buf;
+};
+
+struct reassembly {
+    struct fragslot slots[FRAG_SLOTS];
+    struct timer timer;
+};
+
+struct frag_stats {
+    unsigned long fragmented;
+    unsigned long sent;
+    unsigned long no_buffer;
+    unsigned long rcvd;
+    unsigned long reassembled;
+    unsigned long expired;
+    unsigned long evicted;
+    unsigned long bad;
+};
+
+/*
+ * Path MTU discovery: the state of our search for the biggest datagram
+ * (UDP payload) that reaches the peer, between lo (which has) and hi
+ * (which hasn't, or is one more than the most we would try).
+ */
+
+enum { PMTUD_SEARCH = 1, PMTUD_DONE };
+
+struct pmtud {
+    int state;
+    int base;
+    int lo;
+    int hi;
+    int ceiling;
+    int probe;
+    int tries;
+    uint16_t id;
+    struct timer timer;
+    int reported;
+    unsigned long searches;
+    unsigned long probes;
+    unsigned long acks;
+    unsigned long lost;
+    unsigned long too_big;
+};
+
+/*
+ * Compression: an LZ hash table and a per-flow record of how many more
+ * frames to send without trying to compress them, and a buffer for
+ * decompressed frames.
+ */
+
+#define LZ_HLOG 13
+#define COMPRESS_FLOWS 256
+
+struct flowstate {
+    uint16_t skip;
+    uint16_t backoff;
+};
+
+struct compress_stats {
+    unsigned long tried;
+    unsigned long compressed;
+    unsigned long incompressible;
+    unsigned long skipped;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long decompressed;
+    unsigned long malformed;
+    uint64_t nsec;
+    uint64_t dnsec;
+};
+
+struct compressor {
+    uint16_t htab[1 << LZ_HLOG];
+    struct flowstate flows[COMPRESS_FLOWS];
+    unsigned char *scratch;
+    struct compress_stats stats;
+};
+
+/*
+ * Compact wire headers: the first 16 bytes of a nonce never change
+ * during a session, so once the peer has cached them (under a session
+ * index of our choosing), a datagram needs to carry only the index and
+ * the 8-byte counter. The full nonce is sent (with WIRE_FULL set in the
+ * first byte) until the peer acknowledges the index, and at least once
+ * every WIRE_REFRESH nanoseconds afterwards, so that a peer that has
+ * restarted relearns it.
+ */
+
+#define WIRE_FULL 0x80
+#define WIRE_CONSTBYTES (NONCEBYTES-8)
+#define WIRE_COMPACTHDR (1+8)
+#define WIRE_REFRESH 1000000000ULL
+
+struct session {
+    int ours;
+    int theirs;
+    int acked;
+    int ack_due;
+    uint64_t last_full;
+    uint64_t last_ack;
+    unsigned char theirconst[WIRE_CONSTBYTES];
+    unsigned long full_sent;
+    unsigned long compact_sent;
+    unsigned long compact_rcvd;
+    unsigned long unknown;
+};
+
+/*
+ * When datagrams may take different paths (or be sent from different
+ * ports), they may arrive out of order, so instead of insisting that
+ * nonces increase, we remember the counters of the last REPLAY_WINDOW
+ * nonces we accepted, and refuse any not newer than floor.
+ */
+
+#define REPLAY_WINDOW 64
+
+struct replay {
+    uint64_t seen[REPLAY_WINDOW];
+    int nseen;
+    uint64_t floor;
+    unsigned long late;
+};
+
+/*
+ * Ethernet header elision: a table of recent headers on each side,
+ * indexed by a hash of the header. An entry we send is DEFINED until
+ * the peer acknowledges its generation, and CONFIRMED afterwards; an
+ * entry we receive is DEFINED once we have seen it. There must be no
+ * more entries than bits in ack_due (the entries we must acknowledge).
+ */
+
+#define ELIDE_HDRLEN 14
+#define ELIDE_ENTRIES 64
+#define ELIDE_DEFINE 0x80
+
+enum { HDR_UNUSED, HDR_DEFINED, HDR_CONFIRMED };
+
+struct hdrentry {
+    unsigned char hdr[ELIDE_HDRLEN];
+    uint8_t gen;
+    uint8_t state;
+};
+
+struct hdrcache {
+    struct hdrentry tx[ELIDE_ENTRIES];
+    struct hdrentry rx[ELIDE_ENTRIES];
+    uint64_t ack_due;
+    int reset_due;
+    uint64_t last_reset;
+};
+
+struct elide_stats {
+    unsigned long elided;
+    unsigned long defined;
+    unsigned long replaced;
+    unsigned long confirmed;
+    unsigned long resets;
+    unsigned long restored;
+    unsigned long learned;
+    unsigned long missed;
+    unsigned long bad;
+};
+
+/*
+ * Forward error correction: the sender's current group of k messages
+ * (and the m it will be followed by) and its parity messages so far;
+ * and the receiver's current group, with a copy of each message (and
+ * parity message) it has received, and its measure of the loss rate.
+ */
+
+#define FEC_MAXK 16
+#define FEC_MAXM 4
+#define FEC_DATA_HDR 5
+#define FEC_PARITY_HDR 6
+
+struct fecrx {
+    int active;
+    uint16_t group;
+    int k;
+    int m;
+    int maxidx;
+    int got;
+    int repaired;
+    uint32_t have;
+    uint32_t phave;
+    unsigned char *shards[FEC_MAXK + FEC_MAXM];
+    unsigned long expected;
+    unsigned long received;
+    uint64_t last_report;
+    int loss;
+    int loss_due;
+};
+
+struct fec {
+    int k;
+    int m;
+    int maxm;
+    int adapt;
+    int reported;
+    uint16_t group;
+    int gm;
+    int count;
+    int plen;
+    uint64_t deadline;
+    struct pktbuf *parity[FEC_MAXM];
+    struct fecrx rx;
+};
+
+struct fec_stats {
+    unsigned long sent;
+    unsigned long groups;
+    unsigned long parity;
+    unsigned long unprotected;
+    unsigned long rcvd;
+    unsigned long intact;
+    unsigned long repaired;
+    unsigned long recovered;
+    unsigned long unrecoverable;
+    unsigned long vanished;
+    unsigned long bad;
+};
+
+/*
+ * Multipath: each path has a socket and the address of the other end,
+ * a weight, what we have measured about it, and counters.
+ */
+
+#define MP_PATHS 4
+
+enum { MP_WEIGHTED, MP_LATENCY };
+
+struct path {
+    int fd;
+    const char *name;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int weight;
+    int credit;
+    int up;
+    uint64_t last_rx;
+    uint64_t ping_stamp;
+    uint64_t srtt;
+    int loss;
+    int pong_due;
+    unsigned char pong[1+8];
+    unsigned long pings;
+    unsigned long pongs;
+    unsigned long tx_packets;
+    unsigned long tx_bytes;
+    unsigned long rx_packets;
+    unsigned long rx_bytes;
+    unsigned long tx_rate;
+    unsigned long rx_rate;
+    unsigned long tx_mark;
+    unsigned long rx_mark;
+};
+
+struct multipath {
+    int schedule;
+    int learn;
+    int udp;
+    int npaths;
+    int force;
+    int rx_path;
+    struct path paths[MP_PATHS];
+    struct timer ping;
+    uint64_t last_rate;
+    unsigned long learned;
+};
+
+/*
+ * Source-port entropy: a message that carries frames is sent from (or,
+ * by the server, to) the port in a range that the hash of its inner
+ * flow picks, so that ECMP and RSS keep each flow to its own link and
+ * queue. The client has a socket bound to each port (fds[0] is the UDP
+ * socket we started with), and sends everything else from the first.
+ */
+
+#define SPORT_MAX 64
+
+struct sports {
+    int lo;
+    int n;
+    int listen;
+    int fds[SPORT_MAX];
+    unsigned long sent[SPORT_MAX];
+    unsigned long control;
+};
+
+/*
+ * Hub mode: one listening tappet serves every peer whose public key is
+ * in a directory, on one socket. Each spoke puts its peer id (the first
+ * HUB_IDBYTES of its public key) into the random part of its nonces,
+ * and the hub finds the peer a datagram is from by looking its id up in
+ * an open-addressed hash table (with linear probing) that has at least
+ * twice as many slots as there are peers.
+ *
+ * A hub with a TAP device switches frames between its ports (the TAP
+ * device is port 0, and peer n is port n+1) according to a forwarding
+ * table of the source MAC addresses it has seen on each.
+ *
+ * A peer that the hub hasn't heard from in HUB_EXPIRE_USEC (i.e., that
+ * has missed several keepalives) is forgotten until it is heard from
+ * again.
+ */
+
+#define HUB_IDOFF 4
+#define HUB_IDBYTES 8
+#define HUB_EXPIRE_USEC (6*KEEPALIVE_USEC)
+
+struct fdbentry {
+    uint64_t key;
+    uint32_t port;
+    uint32_t seen;
+};
+
+struct fdb_stats {
+    unsigned long learned;
+    unsigned long moved;
+    unsigned long aged;
+    unsigned long full;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+struct fdb {
+    struct fdbentry *table;
+    uint32_t mask;
+    uint32_t count;
+    uint64_t next_sweep;
+    struct fdb_stats stats;
+};
+
+/*
+ * The multicast groups that hosts behind each of a hub's ports have
+ * joined, as far as the hub can tell from their IGMP and MLD reports
+ * (see snoop.c). Each group has a list of memberships, which are kept
+ * in a slab (and on a free list when unused), and the index finds a
+ * port's membership of a group.
+ */
+
+struct snoopmember {
+    uint64_t key;
+    uint32_t port;
+    uint32_t expires;
+    uint32_t prev;
+    uint32_t next;
+};
+
+struct snoopgroup {
+    uint64_t key;
+    uint32_t head;
+    uint32_t count;
+    uint32_t overflow;
+};
+
+struct snoopindex {
+    uint64_t key;
+    uint32_t port;
+    uint32_t member;
+};
+
+struct snoop_stats {
+    unsigned long reports;
+    unsigned long leaves;
+    unsigned long queries;
+    unsigned long joined;
+    unsigned long aged;
+    unsigned long full;
+    unsigned long pruned;
+    unsigned long saved;
+    unsigned long flooded;
+};
+
+struct snoop {
+    struct snoopmember *members;
+    struct snoopgroup *groups;
+    struct snoopindex *index;
+    uint32_t *ports;
+    uint32_t mask;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t ngroups;
+    uint32_t free;
+    struct snoop_stats stats;
+};
+
+/*
+ * The shared keys of a hub's peers, which are computed by a pool of
+ * threads in the background, or when a peer first gets in touch (see
+ * keycache.c). Fields written by the pool are accessed atomically.
+ */
+
+struct keycache {
+    unsigned char sk[KEYBYTES];
+    unsigned char (*pk)[KEYBYTES];
+    uint8_t *state;
+    struct peer *peers;
+    uint32_t count;
+    uint32_t next;
+    int threads;
+    int running;
+    uint64_t started;
+    uint64_t finished;
+    unsigned long pooled;
+    unsigned long on_contact;
+    unsigned long waited;
+};
+
+/*
+ * A group key, with which a hub encrypts the frames it floods once for
+ * all the peers that have it (see group.c), rather than once for each
+ * peer. The hub keeps the nonce it uses with the key, and each peer
+ * keeps the last nonce it accepted.
+ */
+
+struct group {
+    unsigned char k[KEYBYTES];
+    unsigned char nonce[NONCEBYTES];
+    uint32_t id;
+    int known;
+    int ack_due;
+    struct pktbuf *buf;
+    unsigned int keys;
+    unsigned long received;
+    unsigned long rejected;
+    unsigned long sealed;
+    unsigned long copies;
+    unsigned long dropped;
+    unsigned long batches;
+};
+
+/*
+ * What a hub knows of the traffic from one of its peers to another
+ * (the port it was last sent to, and how much it has sent there this
+ * second), so that it can offer them a shortcut (see shortcut.c).
+ */
+
+struct shortcut_watch {
+    uint32_t to;
+    uint32_t bytes;
+    uint32_t since;
+    uint32_t offered;
+};
+
+/*
+ * Fair queueing of a hub's datagrams to its peers (see drr.c): each peer
+ * has a queue of frames waiting for the UDP socket to have room, and
+ * the peers with frames waiting take turns in a deficit round robin.
+ */
+
+#define HUB_WEIGHTS 32
+
+struct txq {
+    struct pktbuf *head;
+    struct pktbuf *tail;
+    uint32_t next;
+    uint16_t count;
+    uint16_t weight;
+    int deficit;
+    uint8_t listed;
+    uint8_t turn;
+    uint16_t max_count;
+    unsigned long sent;
+    uint64_t waited;
+};
+
+struct drr_stats {
+    unsigned long direct;
+    unsigned long enqueued;
+    unsigned long dequeued;
+    unsigned long dropped;
+    unsigned long blocked;
+    uint64_t waited;
+    uint64_t max_wait;
+};
+
+struct drr {
+    struct pktpool pool;
+    struct txq *queues;
+    int quantum;
+    int blocked;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t backlog;
+    uint32_t max_backlog;
+    struct drr_stats stats;
+};
+
+struct hubslot {
+    uint64_t id;
+    uint32_t peer;
+};
+
+struct hub_stats {
+    unsigned long received;
+    unsigned long unknown;
+    unsigned long rejected;
+    unsigned long moved;
+    unsigned long expired;
+    unsigned long to_tap;
+    unsigned long to_peer;
+    unsigned long filtered;
+    unsigned long flooded;
+    unsigned long copies;
+    unsigned long shortcuts;
+};
+
+struct hub {
+    struct arena arena;
+    struct peer *peers;
+    int npeers;
+    int active;
+    uint32_t *live;
+    uint32_t *pos;
+    uint32_t *member;
+    struct hubslot *table;
+    uint32_t mask;
+    struct shortcut_watch *watch;
+    int udp;
+    int epfd;
+    struct pktbuf *out;
+    struct fdb fdb;
+    struct snoop snoop;
+    struct drr drr;
+    struct keycache keys;
+    struct group group;
+    struct timer sweep;
+    struct hub_stats stats;
+};
+
+/*
+ * Options given on the command line after the positional arguments.
+ */
+
+struct options {
+    int listen;
+    int arena_flags;
+    int place;
+    int follow_rx_cpu;
+    int zerocopy;
+    const char *xdp_ifname;
+    int xdp_queue;
+    int framed;
+    int aggregate_on;
+    int aggregate;
+    int compact;
+    int fragment;
+    int pmtud;
+    int compress;
+    int elide;
+    int tun;
+    int fec_k;
+    int fec_m;
+    int fec_adapt;
+    int multipath;
+    int schedule;
+    int npaths;
+    const char *paths[MP_PATHS];
+    int weights[MP_PATHS];
+    int sport_lo;
+    int sport_n;
+    int hub;
+    int key_threads;
+    int group_key;
+    int snoop;
+    int quantum;
+    int nweights;
+    const char *weight_names[HUB_WEIGHTS];
+    int peer_weights[HUB_WEIGHTS];
+    int shortcuts;
+    int connect;
+    cpu_set_t cpus;
+};
+
+/*
+ * With --connect, we send to each peer through a socket of its own,
+ * connected to it (see connect.c).
+ */
+
+struct conn_stats {
+    unsigned long opened;
+    unsigned long connected;
+    unsigned long reconnected;
+    unsigned long closed;
+    unsigned long failed;
+};
+
+/*
+ * Per-thread state: where the thread runs, and the buffers it owns.
+ * Workers are cache-line aligned so that no two threads ever write to
+ * the same line.
+ */
+
+struct worker {
+    int id;
+    const struct options *opts;
+    int cpu;
+    int node;
+    int rx_cpu;
+    unsigned long migrations;
+    cpu_set_t cpus;
+    cpu_set_t allowed;
+    struct arena arena;
+    struct pktpool pool;
+    struct zerocopy zc;
+    struct xdp_port *xdp;
+    struct agg_stats agg_stats;
+    struct frag_stats frag_stats;
+    struct compressor *lz;
+    struct elide_stats elide_stats;
+    struct fec_stats fec_stats;
+    struct conn_stats conn_stats;
+    struct hub *hub;
+    struct wheel *wheel;
+    struct shortcuts *sc;
+} __attribute__((aligned(CACHELINE)));
+
+int parse_cpulist(const char *s, cpu_set_t *set);
+int cpu_node(int cpu);
+int node_cpus(int node, cpu_set_t *set);
+int bind_memory(void *p, size_t len, int node);
+int udp_incoming_cpu(int udp);
+int worker_place(struct worker *w, const cpu_set_t *cpus);
+int worker_follow(struct worker *w, int rx_cpu);
+void worker_report(const struct worker *w, FILE *f);
+
+/*
+ * A peer's address, which (coming from a UDP socket) is IPv4 or IPv6,
+ * in 28 bytes rather than the 128 of a struct sockaddr_storage.
+ */
+
+union peeraddr {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+};
+
+/*
+ * Everything we know about the other end of the tunnel: the shared key,
+ * both nonces, where to send packets, and what we have learned about
+ * the packet sizes that get through.
+ *
+ * A hub has one of these for each of its peers, which may number in
+ * the millions, so what every datagram needs comes first, and the state
+ * of features that only some tunnels use is allocated separately (and
+ * only if they do).
+ */
+
+struct peer {
+    unsigned char k[crypto_box_BEFORENMBYTES];
+    unsigned char theirnonce[NONCEBYTES];
+    unsigned char ournonce[NONCEBYTES];
+    union peeraddr addr;
+    socklen_t addrlen;
+    uint64_t heard;
+    uint16_t biggest_rcvd;
+    uint16_t biggest_sent;
+    uint16_t biggest_tried;
+    uint16_t frag_id;
+    int maxdgram;
+    int hdrmax;
+    uint16_t probe_ack;
+    uint8_t probe_ack_due;
+    uint8_t connected;
+    int fd;
+    struct timer timer;
+    struct session session;
+    struct aggregate agg;
+    struct reassembly *reasm;
+    struct pmtud *pmtud;
+    struct hdrcache *hdrs;
+    struct fec *fec;
+    struct multipath *mp;
+    struct replay *replay;
+    struct sports *sports;
+    struct group *group;
+};
+
+/*
+ * A spoke's shortcuts to other spokes of its hub. The peer comes first,
+ * so that its timer leads back to the shortcut.
+ */
+
+#define SHORTCUT_MAX 16
+#define SHORTCUT_MACS 8
+
+struct shortcut {
+    struct peer peer;
+    uint64_t id;
+    int state;
+    int opened;
+    uint64_t since;
+    uint64_t heard;
+    uint64_t used;
+    unsigned char macs[SHORTCUT_MACS][6];
+    int nmacs;
+    int oldest;
+    unsigned long tx_frames;
+    unsigned long tx_bytes;
+    unsigned long rx_frames;
+    unsigned long rx_bytes;
+};
+
+struct shortcut_stats {
+    unsigned long offers;
+    unsigned long opened;
+    unsigned long failed;
+    unsigned long fallbacks;
+    unsigned long recovered;
+    unsigned long closed;
+    unsigned long full;
+};
+
+struct shortcuts {
+    struct shortcut sc[SHORTCUT_MAX];
+    const struct peer *hub;
+    unsigned char sk[KEYBYTES];
+    uint32_t prefix;
+    unsigned long tx_frames;
+    unsigned long tx_bytes;
+    unsigned long rx_frames;
+    unsigned long rx_bytes;
+    struct shortcut_stats stats;
+};
+
+int shortcut_init(struct worker *w, const struct peer *hub,
+                  const unsigned char oursk[KEYBYTES], uint32_t nonce_prefix);
+int shortcut_note(struct worker *w, struct peer *from, struct peer *to,
+                  const unsigned char *frame, int len);
+void shortcut_offer(struct worker *w, const struct peer *from,
+                    const unsigned char *p, int len);
+struct shortcut *shortcut_find(struct shortcuts *s,
+                               const unsigned char *nonce);
+int shortcut_input(struct worker *w, int tap, struct shortcut *sc,
+                   unsigned char *wire, int n, const struct sockaddr *addr,
+                   socklen_t addrlen);
+struct shortcut *shortcut_route(struct shortcuts *s,
+                                const unsigned char *frame, int len);
+int shortcut_send(struct worker *w, int udp, struct shortcut *sc,
+                  struct pktbuf **bp, int len);
+int shortcut_timer(struct worker *w, int udp, struct peer *peer,
+                   struct pktbuf **bp);
+void shortcut_report(const struct shortcuts *s, FILE *f);
+int conn_open(struct worker *w, struct peer *peer, int udp, int epfd);
+void conn_update(struct worker *w, struct peer *peer, int moved);
+void conn_close(struct worker *w, struct peer *peer);
+void conn_report(const struct conn_stats *s, FILE *f);
+
+uint64_t nonce_counter(const unsigned char nonce[NONCEBYTES]);
+void wire_init(struct peer *peer, int compact);
+int wire_header(struct peer *peer, unsigned char *ct);
+int wire_parse(struct peer *peer, unsigned char *wire, int len,
+               unsigned char nonce[NONCEBYTES]);
+void wire_accept(struct peer *peer, const unsigned char *wire,
+                 const unsigned char nonce[NONCEBYTES]);
+void wire_report(const struct session *s, FILE *f);
+int replay_init(struct worker *w, struct peer *peer);
+int nonce_fresh(const struct peer *peer,
+                const unsigned char nonce[NONCEBYTES]);
+void nonce_accept(struct peer *peer, const unsigned char nonce[NONCEBYTES]);
+
+int send_datagram(struct worker *w, int udp, struct pktbuf **bp, int len,
+                  const struct sockaddr *addr, socklen_t addrlen);
+int message_limit(const struct worker *w, const struct peer *peer);
+int send_message(struct worker *w, int udp, struct peer *peer,
+                 struct pktbuf **bp, int len);
+int seal_message(struct worker *w, int udp, struct peer *peer,
+                 struct pktbuf **bp, int len);
+int deliver(struct worker *w, int tap, struct peer *peer,
+            unsigned char *p, int len, int nested);
+int send_keepalive(struct worker *w, int udp, struct peer *peer,
+                   struct pktbuf **bp, uint16_t size);
+int keepalive_timer(struct worker *w, int udp, struct peer *peer,
+                    struct pktbuf **bp);
+int send_replies(struct worker *w, int udp, struct peer *peer,
+                 struct pktbuf **bp);
+int agg_message(struct worker *w, int udp, struct peer *peer,
+                struct pktbuf **bp, int len);
+int agg_flush(struct worker *w, int udp, struct peer *peer, int reason);
+void agg_report(const struct agg_stats *s, FILE *f);
+int frag_init(struct worker *w, struct peer *peer);
+int frag_message(struct worker *w, int udp, struct peer *peer,
+                 struct pktbuf **bp, int len);
+int frag_input(struct worker *w, struct peer *peer, unsigned char *p,
+               int len, unsigned char **msg, int *msglen);
+void frag_expire(struct worker *w, struct peer *peer);
+void frag_report(const struct frag_stats *s, FILE *f);
+int compress_init(struct worker *w);
+int compress_message(struct worker *w, struct pktbuf **bp, int len);
+int decompress_frame(struct worker *w, const unsigned char *p, int len);
+void compress_report(const struct compress_stats *s, FILE *f);
+int elide_init(struct worker *w, struct peer *peer);
+int elide_message(struct worker *w, struct peer *peer, struct pktbuf *b,
+                  int len);
+int elide_input(struct worker *w, int tap, struct peer *peer,
+                unsigned char *p, int len);
+void elide_ack(struct worker *w, struct peer *peer, const unsigned char *p,
+               int len);
+void elide_reset(struct worker *w, struct peer *peer);
+int elide_ack_message(struct peer *peer, unsigned char *p);
+void elide_report(const struct elide_stats *s, FILE *f);
+int fec_init(struct worker *w, struct peer *peer, int k, int m, int adapt);
+int fec_overhead(const struct peer *peer);
+int fec_message(struct worker *w, int udp, struct peer *peer,
+                struct pktbuf **bp, int len);
+int fec_flush(struct worker *w, int udp, struct peer *peer);
+int fec_input(struct worker *w, int tap, struct peer *peer,
+              unsigned char *p, int len);
+int fec_parity(struct worker *w, int tap, struct peer *peer,
+               unsigned char *p, int len);
+void fec_loss(struct peer *peer, const unsigned char *p, int len);
+int fec_loss_message(struct peer *peer, unsigned char *p);
+void fec_report(const struct worker *w, const struct peer *peer, FILE *f);
+int mp_init(struct worker *w, struct peer *peer, int udp,
+            const struct sockaddr *server, socklen_t srvlen);
+int mp_sockets(const struct peer *peer, int udp, int *fds);
+void mp_received(struct peer *peer, int fd, const struct sockaddr *addr,
+                 socklen_t addrlen, int len);
+struct path *mp_select(struct peer *peer);
+int mp_timer(struct worker *w, int udp, struct peer *peer);
+void mp_ping(struct peer *peer, const unsigned char *p, int len);
+void mp_pong(struct peer *peer, const unsigned char *p, int len);
+int mp_send_pongs(struct worker *w, int udp, struct peer *peer,
+                  struct pktbuf **bp);
+void mp_report(const struct peer *peer, FILE *f);
+int sport_init(struct worker *w, struct peer *peer, int udp,
+               const struct sockaddr *server);
+int sport_sockets(const struct peer *peer, int udp, int *fds);
+int sport_select(struct peer *peer, const struct pktbuf *b, int udp,
+                 struct sockaddr_storage *ss, struct sockaddr **addr);
+int sport_same_peer(const struct peer *peer, const struct sockaddr *addr,
+                    socklen_t addrlen);
+void sport_report(const struct peer *peer, FILE *f);
+int hub_setup(struct worker *w, struct hub *hub, uint32_t count, int udp,
+              const unsigned char oursk[KEYBYTES], uint32_t nonce_prefix);
+int hub_add(struct hub *hub, const unsigned char pk[KEYBYTES],
+            const char *name, int weight, uint32_t nonce_prefix);
+int hub_init(struct worker *w, struct hub *hub, const char *dir, int udp,
+             const unsigned char oursk[KEYBYTES], uint32_t nonce_prefix);
+void hub_set_id(unsigned char nonce[NONCEBYTES],
+                const unsigned char oursk[KEYBYTES]);
+struct peer *hub_find(const struct hub *hub, const unsigned char *nonce);
+struct peer *hub_lookup(struct hub *hub, const unsigned char *wire,
+                        int len);
+void hub_received(struct worker *w, struct peer *peer,
+                  const struct sockaddr *addr, socklen_t addrlen);
+void hub_expire(struct worker *w, struct peer *peer);
+int hub_xmit(struct worker *w, struct peer *peer, const unsigned char *p,
+             int len);
+int hub_switch(struct worker *w, int tap, struct peer *from,
+               const unsigned char *frame, int len);
+void hub_report(const struct hub *hub, FILE *f);
+int fdb_init(struct fdb *fdb, struct arena *arena, uint32_t entries);
+size_t fdb_size(uint32_t entries);
+void fdb_learn(struct fdb *fdb, const unsigned char *mac, uint32_t port,
+               uint32_t now);
+int fdb_lookup(struct fdb *fdb, const unsigned char *mac, uint32_t now);
+void fdb_sweep(struct fdb *fdb, uint64_t now_usec);
+void fdb_report(const struct fdb *fdb, FILE *f);
+size_t drr_size(uint32_t count);
+int drr_init(struct worker *w, struct drr *d, struct arena *arena, int udp,
+             uint32_t count);
+int drr_send(struct worker *w, struct peer *peer, const unsigned char *p,
+             int len);
+int drr_run(struct worker *w);
+void drr_report(const struct hub *hub, FILE *f);
+size_t snoop_size(uint32_t peers);
+int snoop_init(struct snoop *sn, struct arena *arena, uint32_t peers);
+void snoop_learn(struct snoop *sn, const unsigned char *frame, int len,
+                 uint32_t port, uint32_t now);
+int snoop_ports(struct snoop *sn, const unsigned char *frame,
+                uint32_t now);
+void snoop_sweep(struct snoop *sn, uint64_t now_usec);
+void snoop_report(const struct snoop *sn, FILE *f);
+int group_init(struct worker *w, struct group *g, uint32_t nonce_prefix);
+void group_learn(struct group *g, const unsigned char *p, int len);
+void group_acked(struct worker *w, struct peer *peer, const unsigned char *p,
+                 int len);
+int group_send_replies(struct worker *w, int udp, struct peer *peer,
+                       struct pktbuf **bp);
+int group_nonce(const struct group *g, const unsigned char *nonce);
+int group_open(struct group *g, unsigned char *nonce, unsigned char *ct,
+               int len);
+int group_is_member(const struct hub *hub, const struct peer *peer);
+int group_flood(struct worker *w, const struct peer *from,
+                const uint32_t *ports, int n, const unsigned char *frame,
+                int len);
+void group_report(const struct group *g, FILE *f);
+int wheel_init(struct wheel *wh, uint64_t now);
+void timer_init(struct timer *t, int kind, struct peer *peer);
+void timer_arm(struct wheel *wh, struct timer *t, uint64_t when);
+void timer_cancel(struct wheel *wh, struct timer *t);
+void wheel_advance(struct wheel *wh, uint64_t now);
+struct timer *wheel_expired(struct wheel *wh);
+int wheel_schedule(struct wheel *wh, uint64_t when);
+void wheel_wakeup(struct wheel *wh);
+void wheel_report(const struct wheel *wh, FILE *f);
+size_t keycache_size(uint32_t count);
+int keycache_init(struct keycache *kc, struct arena *arena,
+                  struct peer *peers, uint32_t count,
+                  const unsigned char oursk[KEYBYTES]);
+void keycache_set(struct keycache *kc, uint32_t n,
+                  const unsigned char pk[KEYBYTES]);
+int keycache_start(struct keycache *kc, int threads, int cpu);
+void keycache_get(struct keycache *kc, uint32_t n);
+void keycache_report(const struct keycache *kc, FILE *f);
+int route_mtu(const struct sockaddr *addr, socklen_t addrlen);
+int pmtud_tap_mtu(const struct worker *w, const struct peer *peer);
+int pmtud_init(struct worker *w, struct peer *peer);
+void pmtud_start(struct worker *w, struct peer *peer);
+int pmtud_timer(struct worker *w, int udp, struct peer *peer);
+void pmtud_ack(struct worker *w, struct peer *peer, uint16_t id);
+void pmtud_too_big(struct worker *w, struct peer *peer, int size);
+void pmtud_report(const struct worker *w, const struct peer *peer,
+                  FILE *f);
+
+int tap_attach(const char *name, int tun);
 int read_key(const char *name, unsigned char key[KEYBYTES]);
 uint32_t get_nonce_prefix(const char *name);
 int get_sockaddr(const char *address, const char *sport,
                  struct sockaddr **addr, socklen_t *addrlen);
 int udp_socket(int listen, const struct sockaddr *server,
-               socklen_t srvlen);
+               socklen_t srvlen, int reuseport);
 void describe_sockaddr(const struct sockaddr *addr, char *desc, int desclen);
+int set_blocking(int fd, int blocking);
 int tap_read(int tap, unsigned char *buf, int len);
 int tap_write(int tap, unsigned char *buf, int len);
-int udp_read(int udp, unsigned char nonce[NONCEBYTES],
-             unsigned char *buf, int len, struct sockaddr *addr,
+int tap_writev(int tap, const unsigned char *hdr, int hdrlen,
+               const unsigned char *buf, int len);
+uint32_t flow_hash(const unsigned char *f, int len, int tun);
+int udp_read(int udp, unsigned char *buf, int len, struct sockaddr *addr,
              socklen_t *addrlen);
-int udp_write(int udp, unsigned char nonce[NONCEBYTES],
-              unsigned char *buf, int len, const struct sockaddr *addr,
-              socklen_t addrlen);
+int udp_write(int udp, unsigned char *buf, int len,
+              const struct sockaddr *addr, socklen_t addrlen, int flags);
 
 void generate_nonce(uint32_t prefix,
                     unsigned char nonce[NONCEBYTES]);
+uint64_t monotonic_usec(void);
+
 void update_nonce(unsigned char nonce[NONCEBYTES]);
 int decrypt(unsigned char k[crypto_box_BEFORENMBYTES],
             unsigned char nonce[NONCEBYTES],
@@ -0,0 +1,352 @@
+#include "tappet.h"
+
+#include <sys/timerfd.h>
+
+/*
+ * A hierarchical timing wheel, for the timers of however many peers an
+ * event loop serves: when to send each a keepalive, when to forget it,
+ * when to give up on its fragments, when to probe its path MTU or ping
+ * its paths.
+ *
+ * Time is counted in ticks of WHEEL_TICK_USEC. Level 0 has a slot for
+ * each of the next 64 ticks, level 1 a slot for each of the next 64
+ * spans of 64 ticks, and so on. A timer is put in the slot of the
+ * lowest level that reaches its expiry time, and when the wheel reaches
+ * the start of a slot in a higher level, the timers in it are moved
+ * (cascaded) down to the levels below. Arming and cancelling a timer
+ * are O(1), and each timer is cascaded at most once per level.
+ *
+ * The wheel has a bitmap of the non-empty slots on each level, so that
+ * it can tell when the next timer may expire without looking at any of
+ * them. The event loop sets a single timerfd to go off then, and skips
+ * straight past the ticks in which nothing happens, so it does no work
+ * for idle peers until their timers are due, however many there are.
+ */
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+
+/*
+ * Returns the given bitmap rotated right by n bits.
+ */
+
+static uint64_t rotr(uint64_t x, int n)
+{
+    return (x >> n) | (x << ((64 - n) & 63));
+}
+
+
+/*
+ * Unlinks the given timer from whatever list it is on.
+ */
+
+static void unlink_timer(struct wheel *wh, struct timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+
+    if (t->level < WHEEL_LEVELS) {
+        if (wh->slots[t->level][t->slot] == NULL)
+            wh->bitmap[t->level] &= ~(1ULL << t->slot);
+        wh->pending--;
+    }
+
+    t->pprev = NULL;
+}
+
+
+/*
+ * Puts the given timer at the head of the given list.
+ */
+
+static void link_timer(struct timer **head, struct timer *t)
+{
+    t->next = *head;
+    if (t->next)
+        t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+
+/*
+ * Puts the given timer into the slot where it belongs, given the tick
+ * the wheel is about to process. Timers too far away for the top level
+ * are put in its furthest slot, and moved on when it comes round.
+ */
+
+static void place_timer(struct wheel *wh, struct timer *t)
+{
+    uint64_t e = t->expires, delta;
+    int level, slot;
+
+    if (e < wh->tick)
+        e = wh->tick;
+
+    delta = e - wh->tick;
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if (delta >> (WHEEL_BITS * (level + 1)) == 0)
+            break;
+    }
+
+    if (delta >> (WHEEL_BITS * WHEEL_LEVELS))
+        e = wh->tick + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    slot = (e >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    t->level = level;
+    t->slot = slot;
+    link_timer(&wh->slots[level][slot], t);
+    wh->bitmap[level] |= 1ULL << slot;
+    wh->pending++;
+}
+
+
+/*
+ * Sets up an empty wheel whose next tick is the one containing the given
+ * time, and the timerfd that will wake its event loop. Returns 0 on
+ * success, or prints an error and returns -1 on failure.
+ */
+
+int wheel_init(struct wheel *wh, uint64_t now)
+{
+    memset(wh, 0, sizeof(*wh));
+    wh->tick = now / WHEEL_TICK_USEC;
+    wh->armed = UINT64_MAX;
+
+    wh->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wh->fd < 0) {
+        fprintf(stderr, "Couldn't create timerfd: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Sets up the given timer, which is not yet armed.
+ */
+
+void timer_init(struct timer *t, int kind, struct peer *peer)
+{
+    memset(t, 0, sizeof(*t));
+    t->kind = kind;
+    t->peer = peer;
+}
+
+
+/*
+ * Arms the given timer (or moves it, if it is armed already) to expire
+ * at the given time, or at the start of the first tick after it.
+ */
+
+void timer_arm(struct wheel *wh, struct timer *t, uint64_t when)
+{
+    if (t->pprev)
+        unlink_timer(wh, t);
+
+    t->expires = (when + WHEEL_TICK_USEC - 1) / WHEEL_TICK_USEC;
+    place_timer(wh, t);
+    wh->stats.armed++;
+}
+
+
+/*
+ * Disarms the given timer, if it is armed.
+ */
+
+void timer_cancel(struct wheel *wh, struct timer *t)
+{
+    if (t->pprev == NULL)
+        return;
+
+    unlink_timer(wh, t);
+    wh->stats.cancelled++;
+}
+
+
+/*
+ * Returns the first tick, from the next one on, at which something may
+ * happen: a timer expires, or a slot is cascaded.
+ */
+
+static uint64_t next_tick(const struct wheel *wh)
+{
+    uint64_t next = UINT64_MAX;
+    int level;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        int shift = WHEEL_BITS * level;
+        uint64_t base = wh->tick >> shift, at;
+        int d;
+
+        if (wh->bitmap[level] == 0)
+            continue;
+
+        /*
+         * The slot we are in is due first if we haven't processed its
+         * first tick yet (as on level 0, where each slot is one tick).
+         * Otherwise, it was cascaded when we entered it, and anything
+         * in it now is a whole turn away.
+         */
+
+        if ((wh->tick & ((1ULL << shift) - 1)) == 0) {
+            d = __builtin_ctzll(rotr(wh->bitmap[level], base & WHEEL_MASK));
+        } else {
+            d = __builtin_ctzll(rotr(wh->bitmap[level],
+                                     (base + 1) & WHEEL_MASK)) + 1;
+        }
+
+        at = (base + d) << shift;
+        if (at < next)
+            next = at;
+    }
+
+    return next;
+}
+
+
+/*
+ * Moves every timer in the given slot to where it belongs now.
+ */
+
+static void cascade(struct wheel *wh, int level, int slot)
+{
+    struct timer *t = wh->slots[level][slot];
+
+    wh->slots[level][slot] = NULL;
+    wh->bitmap[level] &= ~(1ULL << slot);
+
+    while (t) {
+        struct timer *next = t->next;
+
+        wh->pending--;
+        place_timer(wh, t);
+        wh->stats.cascaded++;
+        t = next;
+    }
+}
+
+
+/*
+ * Processes every tick up to and including the one containing the given
+ * time, and moves the timers that expire in them to the list that
+ * wheel_expired() takes them from.
+ */
+
+void wheel_advance(struct wheel *wh, uint64_t now)
+{
+    uint64_t target = now / WHEEL_TICK_USEC;
+
+    while (wh->tick <= target) {
+        uint64_t tick = wh->pending ? next_tick(wh) : UINT64_MAX;
+        struct timer *t;
+        int level;
+
+        if (tick > target) {
+            wh->tick = target + 1;
+            break;
+        }
+
+        wh->tick = tick;
+
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            int shift = WHEEL_BITS * level;
+
+            if (tick & ((1ULL << shift) - 1))
+                break;
+            cascade(wh, level, (tick >> shift) & WHEEL_MASK);
+        }
+
+        while ((t = wh->slots[0][tick & WHEEL_MASK]) != NULL) {
+            unlink_timer(wh, t);
+            t->level = WHEEL_LEVELS;
+            link_timer(&wh->expired, t);
+        }
+
+        wh->tick = tick + 1;
+    }
+}
+
+
+/*
+ * Returns the next timer that has expired (and is no longer armed), or
+ * NULL if there are none.
+ */
+
+struct timer *wheel_expired(struct wheel *wh)
+{
+    struct timer *t = wh->expired;
+
+    if (t == NULL)
+        return NULL;
+
+    unlink_timer(wh, t);
+    wh->stats.fired++;
+    return t;
+}
+
+
+/*
+ * Sets the timerfd to go off when the next timer may expire, or at the
+ * given time, if that is sooner (or never, if both are UINT64_MAX).
+ * Returns 0 on success, or prints an error and returns -1 on failure.
+ */
+
+int wheel_schedule(struct wheel *wh, uint64_t when)
+{
+    struct itimerspec its;
+    uint64_t tick = wh->pending ? next_tick(wh) : UINT64_MAX;
+
+    if (tick != UINT64_MAX && tick * WHEEL_TICK_USEC < when)
+        when = tick * WHEEL_TICK_USEC;
+
+    if (when == wh->armed)
+        return 0;
+
+    memset(&its, 0, sizeof(its));
+    if (when != UINT64_MAX) {
+        its.it_value.tv_sec = when / 1000000;
+        its.it_value.tv_nsec = (when % 1000000) * 1000;
+    }
+
+    if (timerfd_settime(wh->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        fprintf(stderr, "timerfd_settime() failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    wh->armed = when;
+    wh->stats.scheduled++;
+    return 0;
+}
+
+
+/*
+ * Takes note that the timerfd went off, so that it will be set again.
+ */
+
+void wheel_wakeup(struct wheel *wh)
+{
+    uint64_t count;
+
+    if (read(wh->fd, &count, sizeof(count)) == sizeof(count))
+        wh->stats.wakeups++;
+
+    wh->armed = UINT64_MAX;
+}
+
+
+/*
+ * Prints a one-line summary of the wheel's timers to the given file.
+ */
+
+void wheel_report(const struct wheel *wh, FILE *f)
+{
+    const struct wheel_stats *s = &wh->stats;
+
+    fprintf(f, "timers: %u pending, %lu armed, %lu cancelled, %lu fired, "
+            "%lu cascaded; timerfd set %lu times, %lu wakeups\n",
+            wh->pending, s->armed, s->cancelled, s->fired, s->cascaded,
+            s->scheduled, s->wakeups);
+}
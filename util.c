@@ -1,10 +1,13 @@
 #include "tappet.h"
 
+#include <sys/uio.h>
+
 static struct sockaddr_storage sock_addr;
 
 /*
- * Attaches to the TAP interface with the given name and returns an fd
- * (as described in linux/Documentation/networking/tuntap.txt).
+ * Attaches to the TAP interface with the given name (or to the TUN
+ * interface, if tun is set) and returns an fd (as described in
+ * linux/Documentation/networking/tuntap.txt).
  *
  * If this code is run as root, it will create the interface if it does
  * not exist. (It would be nice to report a more useful error when the
@@ -12,7 +15,7 @@ static struct sockaddr_storage sock_addr;
  * have only an interface name.)
  */
 
-int tap_attach(const char *name)
+int tap_attach(const char *name, int tun)
 {
     int n, fd;
     struct ifreq ifr;
@@ -25,7 +28,7 @@ int tap_attach(const char *name)
 
     memset(&ifr, 0, sizeof(ifr));
     strncpy(ifr.ifr_name, name, IFNAMSIZ);
-    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    ifr.ifr_flags = (tun ? IFF_TUN : IFF_TAP) | IFF_NO_PI;
 
     n = ioctl(fd, TUNSETIFF, (void *) &ifr);
     if (n < 0) {
@@ -233,11 +236,18 @@ int get_sockaddr(const char *address, const char *sport,
 
 /*
  * Creates a UDP socket, and if listen is 1, also binds it to the given
- * server address. Returns the socket on success, or -1 on failure.
+ * server address. With reuseport, other sockets may be bound to the
+ * same address (see connect.c), so a client's socket is bound to a port
+ * of its own at once, rather than when it first sends. The option is
+ * set only after the socket is bound, so that the port isn't shared
+ * with anyone else's socket. Returns the socket on success, or -1 on
+ * failure.
  */
 
-int udp_socket(int listen, const struct sockaddr *server, socklen_t srvlen)
+int udp_socket(int listen, const struct sockaddr *server, socklen_t srvlen,
+               int reuseport)
 {
+    union peeraddr any;
     int sock;
     int val;
 
@@ -252,6 +262,23 @@ int udp_socket(int listen, const struct sockaddr *server, socklen_t srvlen)
         return -1;
     }
 
+    if (listen != 1 && reuseport) {
+        memset(&any, 0, sizeof(any));
+        any.sa.sa_family = server->sa_family;
+        if (bind(sock, &any.sa, srvlen) < 0) {
+            fprintf(stderr, "Can't bind socket: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    val = 1;
+    if (reuseport &&
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0)
+    {
+        fprintf(stderr, "Couldn't set SO_REUSEPORT: %s\n", strerror(errno));
+        return -1;
+    }
+
     val = IP_PMTUDISC_DO;
     (void) setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
 
@@ -295,14 +322,14 @@ void describe_sockaddr(const struct sockaddr *addr, char *desc, int desclen)
     char port[16];
 
     if (addr->sa_family == AF_INET6) {
-        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &addr;
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) addr;
         inaddr = (const void *) &sin6->sin6_addr;
-        snprintf(port, 16, "[:%d]", sin6->sin6_port);
+        snprintf(port, 16, "[:%d]", ntohs(sin6->sin6_port));
     }
     else {
-        struct sockaddr_in *sin = (struct sockaddr_in *) &addr;
+        struct sockaddr_in *sin = (struct sockaddr_in *) addr;
         inaddr = (const void *) &sin->sin_addr;
-        snprintf(port, 16, ":%d", sin->sin_port);
+        snprintf(port, 16, ":%d", ntohs(sin->sin_port));
     }
 
     if (inet_ntop(addr->sa_family, inaddr, desc, desclen)) {
@@ -379,36 +406,123 @@ int tap_write(int tap, unsigned char *buf, int len)
 
 
 /*
- * Reads the complete nonce and up to len bytes of data from the UDP
- * socket into the given buffer.
+ * Writes a frame made up of the hdrlen bytes at hdr followed by the len
+ * bytes at buf to the TAP device, without copying them together first.
+ * Returns 0 on success, or prints an error and returns -1 on failure.
+ */
+
+int tap_writev(int tap, const unsigned char *hdr, int hdrlen,
+               const unsigned char *buf, int len)
+{
+    struct iovec iov[2];
+
+    if (set_blocking(tap, 1) < 0) {
+        fprintf(stderr, "Couldn't set TAP device to blocking: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    iov[0].iov_base = (void *) hdr;
+    iov[0].iov_len = hdrlen;
+    iov[1].iov_base = (void *) buf;
+    iov[1].iov_len = len;
+
+    if (writev(tap, iov, 2) < 0) {
+        fprintf(stderr, "Error writing to TAP: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Returns a hash of the flow that the given frame belongs to, based on
+ * its IP addresses and protocol (and ports, if it is unfragmented TCP
+ * or UDP), or on its MAC addresses if it isn't IP. If tun is set, the
+ * frame is a bare IP packet without an Ethernet header.
+ */
+
+uint32_t flow_hash(const unsigned char *f, int len, int tun)
+{
+    uint32_t h = 2166136261U;
+    int i, version, proto = -1, start = 0, end = 0, ports = -1;
+
+    if (tun) {
+        version = len > 0 ? f[0] >> 4 : 0;
+    }
+    else {
+        version = 0;
+        end = 12;
+        if (len >= 14+20 && f[12] == 0x08 && f[13] == 0x00)
+            version = 4;
+        else if (len >= 14+40 && f[12] == 0x86 && f[13] == 0xDD)
+            version = 6;
+        if (version) {
+            f += 14;
+            len -= 14;
+        }
+    }
+
+    if (version == 4 && len >= 20) {
+        proto = f[9];
+        start = 12;
+        end = 20;
+        if ((proto == 6 || proto == 17) && (f[6] & 0x3f) == 0 && f[7] == 0)
+            ports = (f[0] & 0x0f) * 4;
+    }
+    else if (version == 6 && len >= 40) {
+        proto = f[6];
+        start = 8;
+        end = 40;
+        if (proto == 6 || proto == 17)
+            ports = 40;
+    }
+
+    if (proto >= 0)
+        h = (h ^ proto) * 16777619U;
+
+    for (i = start; i < end; i++)
+        h = (h ^ f[i]) * 16777619U;
+
+    if (ports > 0 && ports + 4 <= len) {
+        for (i = ports; i < ports + 4; i++)
+            h = (h ^ f[i]) * 16777619U;
+    }
+
+    return h;
+}
+
+
+/*
+ * Reads a datagram, consisting of a complete nonce followed by up to
+ * len-NONCEBYTES bytes of data, from the UDP socket into the given
+ * buffer. The nonce and the data are kept together so that the data
+ * can be decrypted in place.
  *
- * Returns the number of bytes stored in the buffer on success (i.e.,
- * when a complete nonce and a complete packet were read).
+ * Returns the number of bytes of data stored after the nonce on success
+ * (i.e., when a complete nonce and a complete packet were read).
  *
  * Otherwise returns 0 if there were no bytes to be read. Returns -1 if
  * the caller should try again (i.e., an error occurred that can be
  * ignored), or prints an error and returns -2 on failure.
  */
 
-int udp_read(int udp,unsigned char nonce[NONCEBYTES],
-             unsigned char *buf, int len, struct sockaddr *addr,
+int udp_read(int udp, unsigned char *buf, int len, struct sockaddr *addr,
              socklen_t *addrlen)
 {
     int n;
     struct msghdr msg;
-    struct iovec iov[2];
+    struct iovec iov[1];
     char peeraddr[256];
 
-    iov[0].iov_base = nonce;
-    iov[0].iov_len = NONCEBYTES;
-
-    iov[1].iov_base = buf;
-    iov[1].iov_len = len;
+    iov[0].iov_base = buf;
+    iov[0].iov_len = len;
 
     msg.msg_name = (void *) addr;
     msg.msg_namelen = *addrlen;
     msg.msg_iov = iov;
-    msg.msg_iovlen = 2;
+    msg.msg_iovlen = 1;
     msg.msg_control = NULL;
     msg.msg_controllen = 0;
     msg.msg_flags = 0;
@@ -454,34 +568,33 @@ int udp_read(int udp,unsigned char nonce[NONCEBYTES],
 
 
 /*
- * Sends a nonce and len bytes from the given buffer through the UDP
- * socket. Returns 0 on success, or prints an error and returns -1 on
- * failure.
+ * Sends len bytes from the given buffer, which must begin with the
+ * nonce, through the UDP socket, passing the given flags to sendmsg().
+ * Returns the number of bytes sent on success, or 0 if the packet had
+ * to be dropped. Returns -2 if a MSG_ZEROCOPY send failed because the
+ * kernel could not pin the buffer (the caller should send a copy), or
+ * prints an error and returns -1 on failure.
  */
 
-int udp_write(int udp, unsigned char nonce[NONCEBYTES],
-              unsigned char *buf, int len, const struct sockaddr *addr,
-              socklen_t addrlen)
+int udp_write(int udp, unsigned char *buf, int len,
+              const struct sockaddr *addr, socklen_t addrlen, int flags)
 {
     int n;
     struct msghdr msg;
-    struct iovec iov[2];
-
-    iov[0].iov_base = nonce;
-    iov[0].iov_len = NONCEBYTES;
+    struct iovec iov[1];
 
-    iov[1].iov_base = buf;
-    iov[1].iov_len = len;
+    iov[0].iov_base = buf;
+    iov[0].iov_len = len;
 
     msg.msg_name = (void *) addr;
     msg.msg_namelen = addrlen;
     msg.msg_iov = iov;
-    msg.msg_iovlen = 2;
+    msg.msg_iovlen = 1;
     msg.msg_control = NULL;
     msg.msg_controllen = 0;
     msg.msg_flags = 0;
 
-    n = sendmsg(udp, &msg, 0);
+    n = sendmsg(udp, &msg, flags);
 
     if (n < 0) {
         if (errno == EMSGSIZE) {
@@ -493,7 +606,7 @@ int udp_write(int udp, unsigned char nonce[NONCEBYTES],
              * for this (yet).
              */
             fprintf(stderr, "PMTU is <%d bytes, set TAP MTU to <%d; "
-                    "dropping packet\n", len, len-74);
+                    "dropping packet\n", len-NONCEBYTES, len-NONCEBYTES-74);
             return 0;
         }
         else if (errno == ENETUNREACH) {
@@ -504,10 +617,21 @@ int udp_write(int udp, unsigned char nonce[NONCEBYTES],
              */
             return 0;
         }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            /*
+             * The socket doesn't block (as a hub's doesn't, with fair
+             * queueing), and has no room. The caller can tell from
+             * errno, and may try again later.
+             */
+            return 0;
+        }
+        else if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+            return -2;
+        }
         fprintf(stderr, "Error writing to UDP socket: %s\n",
                 strerror(errno));
         return -1;
     }
 
-    return 0;
+    return n;
 }
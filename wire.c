@@ -0,0 +1,291 @@
+#include "tappet.h"
+
+extern void randombytes(unsigned char *buf, unsigned long long len);
+
+/*
+ * The wire header is what precedes the ciphertext in a datagram. By
+ * default, it is the whole 24-byte nonce. With compact headers, it is
+ * one byte (our session index, with WIRE_FULL set if the full nonce
+ * follows), and then either the full nonce or just its 8-byte counter:
+ *
+ *     [ index|WIRE_FULL | nonce (24 bytes) ]  (announces the session)
+ *     [ index | counter (8 bytes) ]           (once it is known)
+ *
+ * The receiver caches the constant part of the nonce from a full
+ * header only after the datagram has been authenticated, and confirms
+ * that it has done so with a MSG_SESSION message carrying our index.
+ */
+
+
+/*
+ * Returns the counter part of the given nonce (nanoseconds on the
+ * monotonic clock of whoever generated it).
+ */
+
+uint64_t nonce_counter(const unsigned char nonce[NONCEBYTES])
+{
+    int i;
+    uint64_t n = 0;
+
+    for (i = WIRE_CONSTBYTES; i < NONCEBYTES; i++)
+        n = (n << 8) | nonce[i];
+
+    return n;
+}
+
+
+/*
+ * Sets up the given peer's session state, choosing a random non-zero
+ * session index if compact headers are to be used.
+ */
+
+void wire_init(struct peer *peer, int compact)
+{
+    memset(&peer->session, 0, sizeof(peer->session));
+    peer->hdrmax = NONCEBYTES;
+
+    if (compact) {
+        unsigned char idx;
+
+        do {
+            randombytes(&idx, 1);
+            idx &= ~WIRE_FULL;
+        } while (idx == 0);
+
+        peer->session.ours = idx;
+        peer->hdrmax = WIRE_MAXHDR;
+    }
+}
+
+
+/*
+ * Writes the header for a datagram to the given peer, encrypted with
+ * the peer's current ournonce, immediately before the ciphertext at ct.
+ * Returns the length of the header.
+ */
+
+int wire_header(struct peer *peer, unsigned char *ct)
+{
+    struct session *s = &peer->session;
+    uint64_t now;
+
+    if (s->ours == 0) {
+        memcpy(ct-NONCEBYTES, peer->ournonce, NONCEBYTES);
+        return NONCEBYTES;
+    }
+
+    now = nonce_counter(peer->ournonce);
+
+    if (!s->acked || now - s->last_full >= WIRE_REFRESH) {
+        s->last_full = now;
+        s->full_sent++;
+        ct[-WIRE_MAXHDR] = s->ours | WIRE_FULL;
+        memcpy(ct-NONCEBYTES, peer->ournonce, NONCEBYTES);
+        return WIRE_MAXHDR;
+    }
+
+    s->compact_sent++;
+    ct[-WIRE_COMPACTHDR] = s->ours;
+    memcpy(ct-8, peer->ournonce+WIRE_CONSTBYTES, 8);
+    return WIRE_COMPACTHDR;
+}
+
+
+/*
+ * Reconstructs the nonce of the len-byte datagram at wire from the given
+ * peer. Returns the length of the header (the ciphertext follows it), or
+ * -1 if the datagram must be dropped because it is too short or refers
+ * to a session whose nonce we do not know.
+ */
+
+int wire_parse(struct peer *peer, unsigned char *wire, int len,
+               unsigned char nonce[NONCEBYTES])
+{
+    struct session *s = &peer->session;
+    int hdr;
+
+    if (s->ours == 0) {
+        if (len < NONCEBYTES+ZEROBYTES)
+            return -1;
+        memcpy(nonce, wire, NONCEBYTES);
+        return NONCEBYTES;
+    }
+
+    if (wire[0] & WIRE_FULL) {
+        hdr = WIRE_MAXHDR;
+        if (len < hdr+ZEROBYTES)
+            return -1;
+        memcpy(nonce, wire+1, NONCEBYTES);
+        return hdr;
+    }
+
+    hdr = WIRE_COMPACTHDR;
+    if (len < hdr+ZEROBYTES)
+        return -1;
+
+    if (wire[0] != s->theirs) {
+        s->unknown++;
+        return -1;
+    }
+
+    s->compact_rcvd++;
+    memcpy(nonce, s->theirconst, WIRE_CONSTBYTES);
+    memcpy(nonce+WIRE_CONSTBYTES, wire+1, 8);
+    return hdr;
+}
+
+
+/*
+ * Takes note of an authenticated datagram from the given peer. If it
+ * announced a session, we cache the constant part of its nonce, and
+ * arrange to acknowledge it (at most once per WIRE_REFRESH, unless the
+ * session is new). A new session means that the peer has restarted and
+ * forgotten ours, so we must announce it again.
+ */
+
+void wire_accept(struct peer *peer, const unsigned char *wire,
+                 const unsigned char nonce[NONCEBYTES])
+{
+    struct session *s = &peer->session;
+    uint64_t now;
+
+    if (s->ours == 0 || !(wire[0] & WIRE_FULL))
+        return;
+
+    now = nonce_counter(nonce);
+
+    if ((wire[0] & ~WIRE_FULL) != s->theirs ||
+        memcmp(s->theirconst, nonce, WIRE_CONSTBYTES) != 0)
+    {
+        s->theirs = wire[0] & ~WIRE_FULL;
+        memcpy(s->theirconst, nonce, WIRE_CONSTBYTES);
+        s->acked = 0;
+        s->ack_due = 1;
+    }
+    else if (now - s->last_ack >= WIRE_REFRESH) {
+        s->ack_due = 1;
+    }
+
+    if (s->ack_due)
+        s->last_ack = now;
+}
+
+
+/*
+ * Sets up a replay window for the given peer, so that its datagrams
+ * may be accepted out of order. Returns 0 on success, or prints an
+ * error and returns -1 on failure.
+ */
+
+int replay_init(struct worker *w, struct peer *peer)
+{
+    struct replay *r;
+
+    if (peer->replay)
+        return 0;
+
+    r = arena_alloc(&w->arena, sizeof(struct replay));
+    if (r == NULL) {
+        fprintf(stderr, "Couldn't allocate replay window\n");
+        return -1;
+    }
+
+    memset(r, 0, sizeof(*r));
+    peer->replay = r;
+
+    return 0;
+}
+
+
+/*
+ * Returns 1 if a datagram with the given nonce from the peer may be
+ * accepted (i.e., we haven't seen the nonce before, as far as we know),
+ * or 0 otherwise. Without a replay window, only a nonce bigger than
+ * the last one we accepted will do.
+ */
+
+int nonce_fresh(const struct peer *peer,
+                const unsigned char nonce[NONCEBYTES])
+{
+    const struct replay *r = peer->replay;
+    uint64_t n;
+    int i;
+
+    if (memcmp(peer->theirnonce, nonce, NONCEBYTES) < 0)
+        return 1;
+
+    if (r == NULL ||
+        memcmp(peer->theirnonce, nonce, WIRE_CONSTBYTES) != 0)
+        return 0;
+
+    n = nonce_counter(nonce);
+    if (n <= r->floor)
+        return 0;
+
+    for (i = 0; i < r->nseen; i++) {
+        if (r->seen[i] == n)
+            return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Takes note of the nonce of an authenticated datagram from the peer.
+ */
+
+void nonce_accept(struct peer *peer, const unsigned char nonce[NONCEBYTES])
+{
+    struct replay *r = peer->replay;
+
+    if (r) {
+        uint64_t n = nonce_counter(nonce);
+
+        /*
+         * A new session starts with a clean slate. Otherwise, if we
+         * can't remember any more nonces, we forget the oldest, and
+         * refuse anything older from now on.
+         */
+
+        if (memcmp(peer->theirnonce, nonce, WIRE_CONSTBYTES) != 0) {
+            r->nseen = 0;
+            r->floor = 0;
+        }
+        else if (memcmp(peer->theirnonce, nonce, NONCEBYTES) > 0) {
+            r->late++;
+        }
+
+        if (r->nseen < REPLAY_WINDOW) {
+            r->seen[r->nseen++] = n;
+        }
+        else {
+            int i, oldest = 0;
+
+            for (i = 1; i < REPLAY_WINDOW; i++) {
+                if (r->seen[i] < r->seen[oldest])
+                    oldest = i;
+            }
+            if (r->seen[oldest] > r->floor)
+                r->floor = r->seen[oldest];
+            r->seen[oldest] = n;
+        }
+    }
+
+    if (memcmp(peer->theirnonce, nonce, NONCEBYTES) < 0)
+        memcpy(peer->theirnonce, nonce, NONCEBYTES);
+}
+
+
+/*
+ * Prints a one-line summary of compact header use to the given file.
+ */
+
+void wire_report(const struct session *s, FILE *f)
+{
+    fprintf(f, "session %d (peer's %d, %s): %lu full and %lu compact "
+            "headers sent, %lu compact received, %lu for unknown "
+            "sessions\n", s->ours, s->theirs,
+            s->acked ? "acknowledged" : "unacknowledged", s->full_sent,
+            s->compact_sent, s->compact_rcvd, s->unknown);
+}
@@ -0,0 +1,684 @@
+#include "tappet.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+/*
+ * An alternative to the kernel's UDP stack for the outer side of the
+ * tunnel: an AF_XDP socket bound to one queue of a NIC, with a small
+ * XDP program that steers IPv4 UDP datagrams addressed to our port on
+ * that queue into the socket, and passes everything else to the kernel
+ * as usual. We build and parse the Ethernet, IP, and UDP headers
+ * ourselves.
+ *
+ * The ordinary UDP socket stays open beside it. It keeps our port
+ * reserved, receives any of our datagrams that the NIC delivers to
+ * other queues, and is used to send until we know the MAC address of
+ * the next hop (which we learn from the datagrams we receive, or from
+ * the kernel's neighbour table).
+ *
+ * The packet memory (UMEM) shared with the kernel is allocated from an
+ * arena of its own. The first half of its frames are given to the
+ * kernel to receive into, and the rest are used to send from.
+ *
+ * Setting this up requires CAP_NET_ADMIN, CAP_NET_RAW, and CAP_BPF (or
+ * CAP_SYS_ADMIN on older kernels).
+ */
+
+#define XDP_RING_SIZE (XDP_FRAMES/2)
+
+#define ETH_HLEN 14
+#define IP_HLEN 20
+#define UDP_HLEN 8
+#define OUTER_HLEN (ETH_HLEN+IP_HLEN+UDP_HLEN)
+
+
+/*
+ * Just enough of the kernel's BPF instruction macros to write the XDP
+ * program below by hand, so that we don't need a BPF compiler.
+ */
+
+#define INSN(c, d, s, o, i) \
+    ((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), \
+                         .off = (o), .imm = (i) })
+#define LDX(size, d, s, o) INSN(BPF_LDX|BPF_MEM|(size), d, s, o, 0)
+#define MOV_REG(d, s) INSN(BPF_ALU64|BPF_MOV|BPF_X, d, s, 0, 0)
+#define MOV_IMM(d, i) INSN(BPF_ALU64|BPF_MOV|BPF_K, d, 0, 0, i)
+#define ADD_IMM(d, i) INSN(BPF_ALU64|BPF_ADD|BPF_K, d, 0, 0, i)
+#define AND_IMM(d, i) INSN(BPF_ALU64|BPF_AND|BPF_K, d, 0, 0, i)
+#define JNE_IMM(d, i, o) INSN(BPF_JMP|BPF_JNE|BPF_K, d, 0, o, i)
+#define JGT_REG(d, s, o) INSN(BPF_JMP|BPF_JGT|BPF_X, d, s, o, 0)
+#define LD_MAP_FD(d, fd) \
+    INSN(BPF_LD|BPF_DW|BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), \
+    INSN(0, 0, 0, 0, 0)
+#define CALL(f) INSN(BPF_JMP|BPF_CALL, 0, 0, 0, f)
+#define EXIT() INSN(BPF_JMP|BPF_EXIT, 0, 0, 0, 0)
+
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+}
+
+
+/*
+ * Loads an XDP program that redirects unfragmented IPv4 UDP datagrams
+ * with the given destination port to the AF_XDP socket in map_fd for
+ * the queue they arrived on, and passes everything else. Returns the
+ * program fd, or -1 on failure.
+ */
+
+static int load_program(int map_fd, uint16_t port)
+{
+    int fd;
+    union bpf_attr attr;
+    char log[4096];
+
+    /*
+     * Each failed check jumps forward to the final "return XDP_PASS".
+     * (The map load takes two instruction slots.) Packet fields are
+     * loaded in network byte order, so we compare them with constants
+     * converted by htons().
+     */
+
+    struct bpf_insn prog[] = {
+        MOV_REG(BPF_REG_6, BPF_REG_1),
+        LDX(BPF_W, BPF_REG_2, BPF_REG_1, 0),            /* data */
+        LDX(BPF_W, BPF_REG_3, BPF_REG_1, 4),            /* data_end */
+        MOV_REG(BPF_REG_4, BPF_REG_2),
+        ADD_IMM(BPF_REG_4, OUTER_HLEN),
+        JGT_REG(BPF_REG_4, BPF_REG_3, 17),
+        LDX(BPF_H, BPF_REG_4, BPF_REG_2, 12),           /* ethertype */
+        JNE_IMM(BPF_REG_4, htons(0x0800), 15),
+        LDX(BPF_B, BPF_REG_4, BPF_REG_2, 14),           /* version, IHL */
+        JNE_IMM(BPF_REG_4, 0x45, 13),
+        LDX(BPF_H, BPF_REG_4, BPF_REG_2, 20),           /* MF, offset */
+        AND_IMM(BPF_REG_4, htons(0x3FFF)),
+        JNE_IMM(BPF_REG_4, 0, 10),
+        LDX(BPF_B, BPF_REG_4, BPF_REG_2, 23),           /* protocol */
+        JNE_IMM(BPF_REG_4, 17, 8),
+        LDX(BPF_H, BPF_REG_4, BPF_REG_2, 36),           /* UDP dport */
+        JNE_IMM(BPF_REG_4, htons(port), 6),
+        LDX(BPF_W, BPF_REG_2, BPF_REG_6, 16),           /* rx_queue_index */
+        LD_MAP_FD(BPF_REG_1, map_fd),
+        MOV_IMM(BPF_REG_3, XDP_PASS),
+        CALL(BPF_FUNC_redirect_map),
+        EXIT(),
+        MOV_IMM(BPF_REG_0, XDP_PASS),
+        EXIT(),
+    };
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uintptr_t) prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uintptr_t) "MIT";
+    attr.log_buf = (uintptr_t) log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    log[0] = '\0';
+
+    fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0 && log[0] != '\0')
+        fprintf(stderr, "XDP program rejected by the verifier:\n%s", log);
+
+    return fd;
+}
+
+
+/*
+ * Maps one of the socket's rings into memory.
+ */
+
+static int map_ring(int fd, struct xdp_ring *r, const struct xdp_ring_offset *off,
+                    int size, size_t entsize, off_t pgoff)
+{
+    unsigned char *p;
+
+    p = mmap(NULL, off->desc + size * entsize, PROT_READ|PROT_WRITE,
+             MAP_SHARED|MAP_POPULATE, fd, pgoff);
+    if (p == MAP_FAILED)
+        return -1;
+
+    r->producer = (uint32_t *) (p + off->producer);
+    r->consumer = (uint32_t *) (p + off->consumer);
+    r->flags = (uint32_t *) (p + off->flags);
+    r->ring = p + off->desc;
+    r->mask = size - 1;
+
+    return 0;
+}
+
+
+/*
+ * Finds our own IPv4 address for talking to the given server, by
+ * asking the kernel which source address it would use.
+ */
+
+static int local_address(const struct sockaddr_in *server,
+                         struct sockaddr_in *local)
+{
+    int s, n;
+    socklen_t len = sizeof(*local);
+
+    s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0)
+        return -1;
+
+    n = connect(s, (const struct sockaddr *) server, sizeof(*server));
+    if (n == 0)
+        n = getsockname(s, (struct sockaddr *) local, &len);
+
+    close(s);
+    return n;
+}
+
+
+/*
+ * Looks up the MAC address of the next hop towards the given address
+ * in the kernel's routing and neighbour tables. Returns 0 on success,
+ * or -1 if the neighbour is not (yet) known.
+ */
+
+static int nexthop_mac(const char *ifname, struct in_addr dst,
+                       unsigned char mac[6])
+{
+    FILE *f;
+    char line[256], dev[IFNAMSIZ+1], hw[32];
+    unsigned int d, g, m, flags;
+    uint32_t via = dst.s_addr, best = 0;
+    int found = -1;
+
+    f = fopen("/proc/net/route", "r");
+    if (f != NULL) {
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "%16s %x %x %x %*d %*d %*d %x", dev, &d, &g,
+                       &flags, &m) != 5 || strcmp(dev, ifname) != 0)
+                continue;
+
+            if ((dst.s_addr & m) == d && (found < 0 || ntohl(m) >= best)) {
+                best = ntohl(m);
+                via = (flags & 0x2) ? g : dst.s_addr;
+                found = 0;
+            }
+        }
+        (void) fclose(f);
+    }
+
+    f = fopen("/proc/net/arp", "r");
+    if (f == NULL)
+        return -1;
+
+    found = -1;
+    while (found < 0 && fgets(line, sizeof(line), f)) {
+        char ip[64];
+        struct in_addr a;
+
+        if (sscanf(line, "%63s %*s %x %31s %*s %16s", ip, &flags, hw,
+                   dev) != 4 || inet_pton(AF_INET, ip, &a) != 1 ||
+            a.s_addr != via || !(flags & 0x2) || strcmp(dev, ifname) != 0)
+            continue;
+
+        if (sscanf(hw, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1],
+                   &mac[2], &mac[3], &mac[4], &mac[5]) == 6)
+            found = 0;
+    }
+
+    (void) fclose(f);
+    return found;
+}
+
+
+/*
+ * Sets up an AF_XDP socket on the given queue of the given interface
+ * for the tunnel whose UDP socket is udp and whose server is server.
+ * Returns 0 on success, or prints an error and returns -1 on failure.
+ */
+
+int xdp_init(struct xdp_port *x, const char *ifname, int queue, int udp,
+             const struct sockaddr *server, int arena_flags, int node)
+{
+    int i, key;
+    struct ifreq ifr;
+    struct xdp_umem_reg reg;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp sxdp;
+    union bpf_attr attr;
+    socklen_t len;
+    int size = XDP_RING_SIZE;
+
+    memset(x, 0, sizeof(*x));
+    x->fd = x->map_fd = x->prog_fd = x->link_fd = -1;
+    x->queue = queue;
+    strncpy(x->ifname, ifname, IFNAMSIZ-1);
+
+    if (server->sa_family != AF_INET) {
+        fprintf(stderr, "The AF_XDP transport supports only IPv4\n");
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ-1);
+    if (ioctl(udp, SIOCGIFINDEX, &ifr) < 0) {
+        fprintf(stderr, "Couldn't find interface %s: %s\n", ifname,
+                strerror(errno));
+        return -1;
+    }
+    x->ifindex = ifr.ifr_ifindex;
+
+    /*
+     * Find out which address and port our datagrams come from. (The
+     * client's socket may not have been bound yet.)
+     */
+
+    len = sizeof(x->local);
+    if (getsockname(udp, (struct sockaddr *) &x->local, &len) == 0 &&
+        x->local.sin_port == 0)
+    {
+        struct sockaddr_in any;
+
+        memset(&any, 0, sizeof(any));
+        any.sin_family = AF_INET;
+        len = sizeof(x->local);
+        if (bind(udp, (struct sockaddr *) &any, sizeof(any)) < 0 ||
+            getsockname(udp, (struct sockaddr *) &x->local, &len) < 0)
+        {
+            fprintf(stderr, "Couldn't bind UDP socket: %s\n",
+                    strerror(errno));
+            return -1;
+        }
+    }
+
+    if (x->local.sin_addr.s_addr == htonl(INADDR_ANY)) {
+        struct sockaddr_in src;
+
+        if (local_address((const struct sockaddr_in *) server, &src) < 0) {
+            fprintf(stderr, "Couldn't find a route to the server: %s\n",
+                    strerror(errno));
+            return -1;
+        }
+        x->local.sin_addr = src.sin_addr;
+    }
+
+    if (ioctl(udp, SIOCGIFHWADDR, &ifr) < 0) {
+        fprintf(stderr, "Couldn't get MAC address of %s: %s\n", ifname,
+                strerror(errno));
+        return -1;
+    }
+    memcpy(x->mac, ifr.ifr_hwaddr.sa_data, 6);
+
+    /*
+     * Create the socket and register the packet memory with it.
+     */
+
+    if (arena_init(&x->umem, (size_t) XDP_FRAMES * XDP_FRAME_SIZE,
+                   arena_flags, node) < 0)
+        return -1;
+
+    x->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (x->fd < 0) {
+        fprintf(stderr, "Couldn't create AF_XDP socket: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uintptr_t) x->umem.base;
+    reg.len = (uint64_t) XDP_FRAMES * XDP_FRAME_SIZE;
+    reg.chunk_size = XDP_FRAME_SIZE;
+    reg.headroom = 0;
+
+    if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size,
+                   sizeof(size)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0)
+    {
+        fprintf(stderr, "Couldn't set up AF_XDP rings: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    len = sizeof(off);
+    if (getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) < 0 ||
+        map_ring(x->fd, &x->rx, &off.rx, size, sizeof(struct xdp_desc),
+                 XDP_PGOFF_RX_RING) < 0 ||
+        map_ring(x->fd, &x->tx, &off.tx, size, sizeof(struct xdp_desc),
+                 XDP_PGOFF_TX_RING) < 0 ||
+        map_ring(x->fd, &x->fill, &off.fr, size, sizeof(uint64_t),
+                 XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+        map_ring(x->fd, &x->comp, &off.cr, size, sizeof(uint64_t),
+                 XDP_UMEM_PGOFF_COMPLETION_RING) < 0)
+    {
+        fprintf(stderr, "Couldn't map AF_XDP rings: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /*
+     * Give the first half of the frames to the kernel to receive into,
+     * and keep the rest for sending.
+     */
+
+    for (i = 0; i < XDP_RING_SIZE; i++)
+        ((uint64_t *) x->fill.ring)[i] = (uint64_t) i * XDP_FRAME_SIZE;
+    __atomic_store_n(x->fill.producer, XDP_RING_SIZE, __ATOMIC_RELEASE);
+
+    for (i = XDP_RING_SIZE; i < XDP_FRAMES; i++)
+        x->frames[x->nframes++] = (uint64_t) i * XDP_FRAME_SIZE;
+
+    /*
+     * Bind to the queue, in zero-copy mode if the driver supports it,
+     * or in copy mode otherwise.
+     */
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = x->ifindex;
+    sxdp.sxdp_queue_id = queue;
+    sxdp.sxdp_flags = XDP_ZEROCOPY|XDP_USE_NEED_WAKEUP;
+    x->zerocopy = 1;
+
+    if (bind(x->fd, (struct sockaddr *) &sxdp, sizeof(sxdp)) < 0) {
+        sxdp.sxdp_flags = XDP_COPY|XDP_USE_NEED_WAKEUP;
+        x->zerocopy = 0;
+        if (bind(x->fd, (struct sockaddr *) &sxdp, sizeof(sxdp)) < 0) {
+            fprintf(stderr, "Couldn't bind AF_XDP socket to %s queue %d: "
+                    "%s\n", ifname, queue, strerror(errno));
+            return -1;
+        }
+    }
+
+    /*
+     * Create the map that tells the XDP program where our socket is,
+     * load the program, and attach it to the interface (natively if the
+     * driver supports XDP, or generically otherwise). The attachment
+     * goes away when we exit.
+     */
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(int);
+    attr.value_size = sizeof(int);
+    attr.max_entries = queue + 1;
+    x->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+
+    key = queue;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = x->map_fd;
+    attr.key = (uintptr_t) &key;
+    attr.value = (uintptr_t) &x->fd;
+
+    if (x->map_fd < 0 || sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+        fprintf(stderr, "Couldn't create XSKMAP: %s\n", strerror(errno));
+        return -1;
+    }
+
+    x->prog_fd = load_program(x->map_fd, ntohs(x->local.sin_port));
+    if (x->prog_fd < 0) {
+        fprintf(stderr, "Couldn't load XDP program: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = x->prog_fd;
+    attr.link_create.target_ifindex = x->ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+    x->native = 1;
+
+    x->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+    if (x->link_fd < 0) {
+        attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+        x->native = 0;
+        x->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+    }
+    if (x->link_fd < 0) {
+        fprintf(stderr, "Couldn't attach XDP program to %s: %s\n", ifname,
+                strerror(errno));
+        return -1;
+    }
+
+    /*
+     * The client knows where it will be sending, so it may as well
+     * look for the next hop now.
+     */
+
+    x->target = ((const struct sockaddr_in *) server)->sin_addr;
+    if (nexthop_mac(x->ifname, x->target, x->nexthop) == 0)
+        x->have_nexthop = 1;
+
+    return 0;
+}
+
+
+/*
+ * Computes the IPv4 header checksum.
+ */
+
+static uint16_t ip_checksum(const unsigned char *p, int len)
+{
+    uint32_t sum = 0;
+
+    while (len > 1) {
+        sum += (p[0] << 8) | p[1];
+        p += 2;
+        len -= 2;
+    }
+
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return ~sum & 0xFFFF;
+}
+
+
+/*
+ * Reads one datagram addressed to us from the socket's RX ring into
+ * the given buffer, like udp_read(), and returns the frame to the fill
+ * ring. Returns the number of bytes stored after the nonce, 0 if there
+ * is nothing to read, or -1 if a frame was discarded.
+ */
+
+int xdp_read(struct xdp_port *x, unsigned char *buf, int len,
+             struct sockaddr *addr, socklen_t *addrlen)
+{
+    uint32_t cons, prod;
+    struct xdp_desc *d;
+    unsigned char *p, *ip, *udp;
+    int ihl, n, ulen;
+    struct sockaddr_in *sin = (struct sockaddr_in *) addr;
+
+    cons = *x->rx.consumer;
+    prod = __atomic_load_n(x->rx.producer, __ATOMIC_ACQUIRE);
+    if (cons == prod)
+        return 0;
+
+    d = &((struct xdp_desc *) x->rx.ring)[cons & x->rx.mask];
+    p = x->umem.base + d->addr;
+    n = -1;
+
+    /*
+     * The XDP program has already checked that this is an unfragmented
+     * IPv4 UDP datagram for our port. We needn't verify the IP or UDP
+     * checksums, because the payload is authenticated anyway.
+     */
+
+    ip = p + ETH_HLEN;
+    ihl = (ip[0] & 0x0F) * 4;
+    udp = ip + ihl;
+    ulen = (udp[4] << 8) | udp[5];
+
+    x->rx_frames++;
+
+    if (ETH_HLEN + ihl + UDP_HLEN <= (int) d->len &&
+        ulen >= UDP_HLEN && ETH_HLEN + ihl + ulen <= (int) d->len &&
+        memcmp(ip + 16, &x->local.sin_addr, 4) == 0)
+    {
+        n = ulen - UDP_HLEN;
+        if (n <= NONCEBYTES || n > len) {
+            n = -1;
+        }
+        else {
+            memcpy(buf, udp + UDP_HLEN, n);
+            memcpy(x->rxmac, p + 6, 6);
+
+            memset(sin, 0, sizeof(*sin));
+            sin->sin_family = AF_INET;
+            memcpy(&sin->sin_addr, ip + 12, 4);
+            memcpy(&sin->sin_port, udp, 2);
+            *addrlen = sizeof(*sin);
+
+            n -= NONCEBYTES;
+        }
+    }
+
+    if (n < 0)
+        x->rx_bad++;
+
+    /*
+     * Give the frame back to the kernel.
+     */
+
+    prod = *x->fill.producer;
+    ((uint64_t *) x->fill.ring)[prod & x->fill.mask] =
+        d->addr & ~((uint64_t) XDP_FRAME_SIZE - 1);
+    __atomic_store_n(x->fill.producer, prod + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(x->rx.consumer, cons + 1, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+
+/*
+ * Remembers that the datagram we last read came to us through the next
+ * hop towards our peer, so that we can send replies the same way.
+ */
+
+void xdp_learn(struct xdp_port *x)
+{
+    memcpy(x->nexthop, x->rxmac, 6);
+    x->have_nexthop = 1;
+}
+
+
+/*
+ * Sends len bytes from the given buffer to the given address, like
+ * udp_write(). Returns the number of bytes queued, 0 if the datagram
+ * was dropped, or -2 if it cannot be sent this way (because the address
+ * is not IPv4, or we do not know the next hop yet) and should be sent
+ * through the UDP socket instead.
+ */
+
+int xdp_write(struct xdp_port *x, unsigned char *buf, int len,
+              const struct sockaddr *addr, socklen_t addrlen)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in *) addr;
+    uint32_t cons, prod;
+    struct xdp_desc *d;
+    unsigned char *p, *ip, *udp;
+    uint16_t sum;
+
+    if (addr->sa_family != AF_INET || len + OUTER_HLEN > XDP_FRAME_SIZE)
+        return -2;
+
+    if (!x->have_nexthop) {
+        if ((x->lookups++ % 1000) != 0 ||
+            nexthop_mac(x->ifname, sin->sin_addr, x->nexthop) < 0)
+            return -2;
+        x->have_nexthop = 1;
+    }
+
+    /*
+     * Take back any frames the kernel has finished sending.
+     */
+
+    cons = *x->comp.consumer;
+    prod = __atomic_load_n(x->comp.producer, __ATOMIC_ACQUIRE);
+    while (cons != prod) {
+        x->frames[x->nframes++] = ((uint64_t *) x->comp.ring)[cons & x->comp.mask];
+        cons++;
+    }
+    __atomic_store_n(x->comp.consumer, cons, __ATOMIC_RELEASE);
+
+    if (x->nframes == 0) {
+        x->tx_full++;
+        return 0;
+    }
+
+    /*
+     * Build the Ethernet, IPv4, and UDP headers in front of a copy of
+     * the datagram. We leave the UDP checksum empty, which IPv4 allows.
+     */
+
+    p = x->umem.base + x->frames[--x->nframes];
+    ip = p + ETH_HLEN;
+    udp = ip + IP_HLEN;
+
+    memcpy(p, x->nexthop, 6);
+    memcpy(p + 6, x->mac, 6);
+    p[12] = 0x08;
+    p[13] = 0x00;
+
+    ip[0] = 0x45;
+    ip[1] = 0;
+    ip[2] = (IP_HLEN + UDP_HLEN + len) >> 8;
+    ip[3] = (IP_HLEN + UDP_HLEN + len) & 0xFF;
+    ip[4] = x->ip_id >> 8;
+    ip[5] = x->ip_id & 0xFF;
+    ip[6] = 0x40;
+    ip[7] = 0;
+    ip[8] = 64;
+    ip[9] = 17;
+    ip[10] = ip[11] = 0;
+    memcpy(ip + 12, &x->local.sin_addr, 4);
+    memcpy(ip + 16, &sin->sin_addr, 4);
+    sum = ip_checksum(ip, IP_HLEN);
+    ip[10] = sum >> 8;
+    ip[11] = sum & 0xFF;
+    x->ip_id++;
+
+    memcpy(udp, &x->local.sin_port, 2);
+    memcpy(udp + 2, &sin->sin_port, 2);
+    udp[4] = (UDP_HLEN + len) >> 8;
+    udp[5] = (UDP_HLEN + len) & 0xFF;
+    udp[6] = udp[7] = 0;
+
+    memcpy(udp + UDP_HLEN, buf, len);
+
+    prod = *x->tx.producer;
+    d = &((struct xdp_desc *) x->tx.ring)[prod & x->tx.mask];
+    d->addr = p - x->umem.base;
+    d->len = OUTER_HLEN + len;
+    d->options = 0;
+    __atomic_store_n(x->tx.producer, prod + 1, __ATOMIC_RELEASE);
+
+    /*
+     * Tell the kernel there is something to send, if it wants to be
+     * told. (It may be busy, in which case it will get to it anyway.)
+     */
+
+    if (__atomic_load_n(x->tx.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)
+        (void) sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+
+    x->tx_frames++;
+    return len;
+}
+
+
+/*
+ * Prints a one-line summary of AF_XDP traffic to the given file.
+ */
+
+void xdp_report(const struct xdp_port *x, FILE *f)
+{
+    fprintf(f, "xdp %s queue %d (%s, %s): %lu frames received, %lu "
+            "discarded, %lu sent, %lu sent through the kernel, %lu dropped "
+            "with TX ring full\n", x->ifname, x->queue,
+            x->native ? "native" : "generic",
+            x->zerocopy ? "zero-copy" : "copy", x->rx_frames, x->rx_bad,
+            x->tx_frames, x->tx_kernel, x->tx_full);
+}
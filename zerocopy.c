@@ -0,0 +1,203 @@
+#include "tappet.h"
+
+#include <linux/errqueue.h>
+
+/*
+ * With MSG_ZEROCOPY, sendmsg() pins our buffer instead of copying the
+ * datagram into the kernel, and tells us later (through the socket's
+ * error queue) when it is done with it. Until then, the buffer belongs
+ * to the kernel and must not be reused, so we keep it on a list of
+ * buffers in flight and take a fresh one from the pool for the next
+ * frame.
+ *
+ * The kernel numbers zerocopy sends consecutively from 0, and reports
+ * completions as ranges of these numbers. It may also tell us that it
+ * ended up copying the data after all (e.g., because the packet was
+ * looped back locally), in which case zerocopy is only costing us the
+ * extra bookkeeping.
+ *
+ * Pinning pages is only cheaper than copying for large datagrams, so
+ * only those at least zc->threshold bytes long are sent this way.
+ */
+
+int zc_init(struct zerocopy *zc, int udp, int threshold)
+{
+    int val = 1;
+
+    memset(zc, 0, sizeof(*zc));
+
+    if (setsockopt(udp, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val)) < 0) {
+        fprintf(stderr, "Couldn't enable zerocopy transmission: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    zc->enabled = 1;
+    zc->threshold = threshold;
+
+    return 0;
+}
+
+
+/*
+ * Sends len bytes from the wire area of *bp, with MSG_ZEROCOPY if the
+ * datagram is large enough and we can spare a buffer to replace it. If
+ * the kernel takes the buffer, it is added to the in-flight list and
+ * *bp is replaced with a fresh buffer owned by the given stage. Returns
+ * the same values as udp_write().
+ */
+
+int zc_write(struct zerocopy *zc, int udp, struct pktpool *pool,
+             struct pktbuf **bp, int len, const struct sockaddr *addr,
+             socklen_t addrlen)
+{
+    int n, owner;
+    struct pktbuf *b = *bp;
+
+    if (!zc->enabled || len < zc->threshold)
+        return udp_write(udp, PKTBUF_WIRE(b), len, addr, addrlen, 0);
+
+    /*
+     * We always keep one buffer in reserve, so that we can fall back
+     * to copying if every other buffer is waiting for the kernel.
+     */
+
+    if (pool->available < 2)
+        (void) zc_reap(zc, udp, pool);
+    if (pool->available < 2) {
+        zc->no_buffer++;
+        return udp_write(udp, PKTBUF_WIRE(b), len, addr, addrlen, 0);
+    }
+
+    n = udp_write(udp, PKTBUF_WIRE(b), len, addr, addrlen, MSG_ZEROCOPY);
+
+    /*
+     * If the kernel couldn't pin the pages (e.g., because we exceeded
+     * our optmem limit), we send a copy instead.
+     */
+
+    if (n == -2) {
+        zc->no_buffer++;
+        return udp_write(udp, PKTBUF_WIRE(b), len, addr, addrlen, 0);
+    }
+
+    if (n <= 0)
+        return n;
+
+    owner = b->owner;
+    b->owner = BUF_KERNEL;
+    b->len = len;
+    b->seq = zc->next++;
+    b->next = NULL;
+    if (zc->tail)
+        zc->tail->next = b;
+    else
+        zc->head = b;
+    zc->tail = b;
+    zc->sent++;
+    zc->inflight++;
+
+    *bp = pool_get(pool, owner);
+
+    return n;
+}
+
+
+/*
+ * Reads zerocopy completions from the socket's error queue and returns
+ * the buffers the kernel has finished with to the pool. Returns the
+ * number of buffers released, or -1 on error.
+ */
+
+int zc_reap(struct zerocopy *zc, int udp, struct pktpool *pool)
+{
+    int released = 0;
+
+    if (zc->inflight == 0)
+        return 0;
+
+    while (1) {
+        struct msghdr msg;
+        struct cmsghdr *cm;
+        char control[128];
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(udp, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            fprintf(stderr, "Error reading zerocopy completions: %s\n",
+                    strerror(errno));
+            return -1;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *ee;
+            struct pktbuf *b;
+            uint32_t lo, hi;
+
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 &&
+                   cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            ee = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            lo = ee->ee_info;
+            hi = ee->ee_data;
+
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zc->copied += hi - lo + 1;
+
+            /*
+             * We mark completed buffers by setting their length to -1.
+             * (The comparison is written to work across wraparound.)
+             */
+
+            for (b = zc->head; b; b = b->next) {
+                if (b->seq - lo <= hi - lo)
+                    b->len = -1;
+            }
+        }
+
+        /*
+         * Completions almost always arrive in order, but we release
+         * buffers only from the head of the list, which keeps it a
+         * simple FIFO; a buffer completed out of order just waits for
+         * the ones before it.
+         */
+
+        while (zc->head && zc->head->len == -1) {
+            struct pktbuf *b = zc->head;
+
+            zc->head = b->next;
+            if (zc->head == NULL)
+                zc->tail = NULL;
+
+            zc->inflight--;
+            zc->completed++;
+            released++;
+            pool_put(pool, b);
+        }
+    }
+
+    return released;
+}
+
+
+/*
+ * Prints a one-line summary of zerocopy transmission to the given file.
+ */
+
+void zc_report(const struct zerocopy *zc, FILE *f)
+{
+    fprintf(f, "zerocopy: %lu sent, %lu completed (%.1f%%), %lu copied by "
+            "the kernel, %d in flight, %lu sent by copy for lack of "
+            "buffers\n", zc->sent, zc->completed,
+            zc->sent ? 100.0 * zc->completed / zc->sent : 0.0,
+            zc->copied, zc->inflight, zc->no_buffer);
+}